@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+
+#define DEBUG 0
+
+#include "oil_bench.h"
+#include "ppm_io.h"
+
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+/*=====================================================================================
+* Benchmark of the oil filter: sweeps kernels x image sizes x Fs x Fl x threads on
+* synthetic images, going through the same file I/O as Main. Every output is checked
+* against the naive kernel. One CSV line per run, with the wall time of each phase,
+* the throughput and the speedup and parallel efficiency against a 1-thread run.
+=====================================================================================*/
+
+#define BENCH_MAX_VALUES 32
+
+// Parses "a,b,c" into values, returns the # of values
+static int bench_list(const char *text, int *values){
+	int n = 0;
+	char *copy = strdup(text);
+	for (char *item = strtok(copy, ","); (item != NULL) && (n < BENCH_MAX_VALUES); item = strtok(NULL, ",")) values[n++] = atoi(item);
+	free(copy);
+	return n;
+}
+
+// Same for "512x512,1024x768", a single number giving a square image
+static int bench_sizes(const char *text, int *widths, int *heights){
+	int n = 0;
+	char *copy = strdup(text);
+	for (char *item = strtok(copy, ","); (item != NULL) && (n < BENCH_MAX_VALUES); item = strtok(NULL, ",")){
+		if (sscanf(item, "%dx%d", &widths[n], &heights[n]) == 1) heights[n] = widths[n];
+		++n;
+	}
+	free(copy);
+	return n;
+}
+
+// Same for "sliding,fixed"
+static int bench_names(char *text, char **names){
+	int n = 0;
+	for (char *item = strtok(text, ","); (item != NULL) && (n < BENCH_MAX_VALUES); item = strtok(NULL, ",")) names[n++] = item;
+	return n;
+}
+
+// One run through the files, as Main does. Returns 1 if the output matches 'reference'.
+static int bench_run(const char *kernel, const char *input_name, const char *output_name, const oil_image *reference,
+                     int Fs, int Fl, oil_phases *phases){
+	double start = oil_wtime();
+	ppm_file input, output;
+	if (ppm_open(&input, input_name) != 0) exit(1);
+	phases->parse = oil_wtime() - start;
+
+	start = oil_wtime();
+	oil_image pic, newPic;
+	if (ppm_read_image(&input, &pic) != 0) exit(1);
+	phases->load = oil_wtime() - start;
+
+	start = oil_wtime();
+	if (ppm_create(&output, output_name, '6', input.width, input.height, input.maxval) != 0) exit(1);
+	ppm_output_image(&output, &newPic);
+	phases->write = oil_wtime() - start;
+
+	start = oil_wtime();
+	if (oil_run_kernel(kernel, &pic, &newPic, Fs, Fl) != 0){
+		fprintf(stderr, "!!! Unknown kernel %s.\n", kernel);
+		exit(1);
+	}
+	phases->filter = oil_wtime() - start;
+	int match = (reference == NULL) || oil_image_equal(&newPic, reference);
+
+	start = oil_wtime();
+	ppm_write_image(&output, &newPic);
+	ppm_close(&output);
+	oil_image_free(&newPic);
+	phases->write += oil_wtime() - start;
+	oil_image_free(&pic);
+	ppm_close(&input);
+	return match;
+}
+
+// Fastest of the repetitions of one run, phase by phase, with the current # of threads.
+// Returns 1 if every output matched.
+static int bench_best(const char *kernel, const char *input_name, const char *output_name, const oil_image *reference,
+                      int Fs, int Fl, int repetitions, oil_phases *best){
+	oil_phases phases;
+	int match = 1;
+	best->parse = best->load = best->filter = best->write = 1e30;
+	for (int r = 0; r < repetitions; ++r){
+		match &= bench_run(kernel, input_name, output_name, reference, Fs, Fl, &phases);
+		if (phases.parse < best->parse) best->parse = phases.parse;
+		if (phases.load < best->load) best->load = phases.load;
+		if (phases.filter < best->filter) best->filter = phases.filter;
+		if (phases.write < best->write) best->write = phases.write;
+	}
+	return match;
+}
+
+
+int main(int argc, char **argv){
+	printf("Usage: ./Bench [-k kernels] [-s sizes] [-f Fs] [-l Fl] [-t threads] [-d depth] [-r repetitions] [-n] [-o results.csv]\n");
+	printf("Lists are comma-separated, e.g. -k sliding,fixed -s 512,1024x768 -f 3,5 -l 4,25 -t 1,2,4\n-----------------\n");
+	char kernel_list[256] = "sliding,fixed,simd";
+	char *csv_name = "bench.csv";
+	int widths[BENCH_MAX_VALUES] = {512, 1024}, heights[BENCH_MAX_VALUES] = {512, 1024}, nsizes = 2;
+	int sizes_Fs[BENCH_MAX_VALUES] = {3, 5, 8}, nFs = 3;
+	int sizes_Fl[BENCH_MAX_VALUES] = {4, 25}, nFl = 2;
+	int threads[BENCH_MAX_VALUES] = {1}, nthreads = 1;
+	int depth = 255, repetitions = 3, check = 1;
+	// All the threads available, by powers of two
+	for (int t = 2; t <= omp_get_max_threads(); t *= 2) threads[nthreads++] = t;
+	if ((omp_get_max_threads() & (omp_get_max_threads() - 1)) != 0) threads[nthreads++] = omp_get_max_threads();
+
+	int opt;
+	while ((opt = getopt(argc, argv, "k:s:f:l:t:d:r:no:")) != -1){
+		switch (opt){
+			case 'k': snprintf(kernel_list, sizeof(kernel_list), "%s", optarg); break;
+			case 's': nsizes = bench_sizes(optarg, widths, heights); break;
+			case 'f': nFs = bench_list(optarg, sizes_Fs); break;
+			case 'l': nFl = bench_list(optarg, sizes_Fl); break;
+			case 't': nthreads = bench_list(optarg, threads); break;
+			case 'd': depth = atoi(optarg); break;
+			case 'r': repetitions = atoi(optarg); break;
+			case 'n': check = 0; break;
+			case 'o': csv_name = optarg; break;
+			default: exit(0);
+		}
+	}
+	if (repetitions < 1) repetitions = 1;
+	char *kernels[BENCH_MAX_VALUES];
+	int nkernels = bench_names(kernel_list, kernels);
+
+	FILE *csv = fopen(csv_name, "w");
+	if (csv == NULL){
+		fprintf(stderr, "!!! Error while creating %s.\n", csv_name);
+		exit(1);
+	}
+	fprintf(csv, "kernel,width,height,depth,Fs,Fl,threads,parse_s,load_s,filter_s,write_s,total_s,mpixels_per_s,speedup,efficiency,match\n");
+	const char *input_name = "bench_input.ppm", *output_name = "bench_output.ppm";
+	int failures = 0;
+
+	for (int s = 0; s < nsizes; ++s){
+		int width = widths[s], height = heights[s];
+		// The synthetic image goes through a file, so that parse and load are measured too
+		oil_image pic;
+		oil_image_synthetic(&pic, width, height, depth, 2018);
+		if (oil_image_save(&pic, input_name) != 0) exit(1);
+
+		for (int f = 0; f < nFs; ++f) for (int l = 0; l < nFl; ++l){
+			int Fs = sizes_Fs[f], Fl = sizes_Fl[l];
+			oil_image reference;
+			if (check){
+				oil_image_init(&reference, width, height, depth);
+				oil_filter_naive(&pic, &reference, Fs, Fl);
+			}
+
+			for (int k = 0; k < nkernels; ++k){
+				// Filter time on 1 thread, for the speedup: measured on its own unless it is the first run.
+				// Without a valid time, the speedup and the efficiency are left empty.
+				oil_phases best;
+				double base_time = 0.0;
+				if (threads[0] != 1){
+					omp_set_num_threads(1);
+					if (!bench_best(kernels[k], input_name, output_name, check ? &reference : NULL, Fs, Fl, repetitions, &best)) ++failures;
+					base_time = best.filter;
+				}
+				for (int t = 0; t < nthreads; ++t){
+					omp_set_num_threads(threads[t]);
+					int match = bench_best(kernels[k], input_name, output_name, check ? &reference : NULL, Fs, Fl, repetitions, &best);
+					if ((t == 0) && (threads[0] == 1)) base_time = best.filter;
+					int timed = (base_time > 0.0) && (base_time < 1e30) && (best.filter < 1e30);
+					char speedup[32] = "", efficiency[32] = "";
+					if (timed){
+						snprintf(speedup, sizeof(speedup), "%.3lf", base_time/best.filter);
+						snprintf(efficiency, sizeof(efficiency), "%.3lf", base_time/best.filter/threads[t]);
+					}
+					double mpixels = (double)width*height/best.filter/1e6;
+					if (!match) ++failures;
+
+					fprintf(csv, "%s,%d,%d,%d,%d,%d,%d,%.6lf,%.6lf,%.6lf,%.6lf,%.6lf,%.3lf,%s,%s,%s\n", kernels[k], width, height, depth, Fs, Fl, threads[t],
+						best.parse, best.load, best.filter, best.write, oil_phases_total(&best), mpixels, speedup, efficiency, check ? (match ? "yes" : "no") : "unchecked");
+					fflush(csv);
+					printf("%-8s %5dx%-5d Fs=%-2d Fl=%-3d threads=%-3d filter %8.4lf s  %8.2lf Mpixels/s  efficiency %5s  %s\n", kernels[k], width, height, Fs, Fl, threads[t],
+						best.filter, mpixels, timed ? efficiency : "-", check ? (match ? "OK" : "MISMATCH") : "");
+				}
+			}
+			if (check) oil_image_free(&reference);
+		}
+		oil_image_free(&pic);
+	}
+	fclose(csv);
+	unlink(input_name);
+	unlink(output_name);
+	printf("Results written to %s, %d mismatch(es).\n", csv_name, failures);
+	return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,3 @@
+clear
+gcc -O2 -o Bench Bench.c -lm -std=c99 -fopenmp -pthread
+./Bench -k sliding,fixed,simd -s 512,1024 -f 3,5,8 -l 4,25 -o bench.csv
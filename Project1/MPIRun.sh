@@ -0,0 +1,26 @@
+clear
+mpicc -O2 -o MainMPI MainMPI.c -lm -std=c99 -fopenmp
+gcc -o Main Main.c -lm -std=c99 -fopenmp -pthread
+rm -f strong.csv weak.csv
+
+# The hybrid run must give the single-node image
+./Main -o oily_omp.ppm nic.ppm 5 25 > /dev/null
+for np in 1 2 4; do
+	mpirun -np $np ./MainMPI -o oily_mpi.ppm nic.ppm 5 25 > /dev/null
+	cmp -s oily_mpi.ppm oily_omp.ppm && echo "$np ranks: same image" || echo "$np ranks: DIFFERENT image"
+done
+
+# Strong scaling: same image for every # of ranks
+for np in 1 2 4 8; do
+	mpirun -np $np ./MainMPI -g 4096x4096 -c strong.csv -o oily_mpi.ppm synthetic.ppm 5 25 > /dev/null
+done
+# Weak scaling: 1024 rows per rank
+for np in 1 2 4 8; do
+	mpirun -np $np ./MainMPI -g 4096x1024 -w -c weak.csv -o oily_mpi.ppm synthetic.ppm 5 25 > /dev/null
+done
+
+echo "Strong scaling: speedup = T1/TN, efficiency = T1/(N*TN)"
+awk -F, 'NR == 2 {t1 = $11} NR > 1 {printf "%3d ranks  %8.4f s  speedup %5.2f  efficiency %5.2f\n", $1, $11, t1/$11, t1/($1*$11)}' strong.csv
+echo "Weak scaling: efficiency = T1/TN"
+awk -F, 'NR == 2 {t1 = $11} NR > 1 {printf "%3d ranks  %8.4f s  efficiency %5.2f\n", $1, $11, t1/$11}' weak.csv
+rm -f synthetic.ppm oily_mpi.ppm oily_omp.ppm
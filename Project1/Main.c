@@ -1,12 +1,24 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700 // realpath
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <time.h>
 #include <malloc.h>
+#include <unistd.h>
+#include <omp.h>
 
 #define DEBUG 0
 
+#include "oil_simd.h"
+#include "oil_tiles.h"
+#include "oil_fixed.h"
+#include "oil_bench.h"
+#include "ppm_io.h"
+#include "oil_stream.h"
+#include "oil_batch.h"
+#include "oil_pipe.h"
+
 /*=======================================================================================
 *	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
 *	For: High Performance Scientific course at ULiège, 2018-19
@@ -21,114 +33,82 @@
 
 	int main(int argc, char **argv){
 	
-	printf("Usage: ./Main <file_name.ppm> <(int)Filter_size> <(int)Filter_level>\n-----------------\n");
+	//Get some options
+	char *kernel = "sliding";
+	char *oily_filename = "oily.ppm";
+	int tiled = 0, tile_width = 0, tile_height = 0; //A size of 0 is chosen automatically
+	int strip_rows = 0; //Streaming mode when > 0
+	char *batch_dir = NULL; //Batch mode when set
+	int opt;
+	while ((opt = getopt(argc, argv, "k:t:s:o:b:")) != -1){
+		switch (opt){
+			case 'k': kernel = optarg; break;
+			case 't':
+				tiled = 1;
+				if (strcmp(optarg, "auto") != 0) sscanf(optarg, "%dx%d", &tile_width, &tile_height);
+				break;
+			case 's': strip_rows = atoi(optarg); break;
+			case 'o': oily_filename = optarg; break;
+			case 'b': batch_dir = optarg; break;
+			default: exit(0);
+		}
+	}
+	//With "-" as file name, frames are read from stdin and written to stdout: the messages go to stderr
+	FILE *info = ((argc - optind >= 1) && (strcmp(argv[optind], "-") == 0)) ? stderr : stdout;
+	fprintf(info, "Usage: ./Main [-k naive|sliding|fixed|planar|simd] [-t <width>x<height>|auto] [-s <strip_rows>] [-o <output.ppm>] [-b <output_dir>] <file_name.ppm|input_dir|list_file|-> <(int)Filter_size> <(int)Filter_level>\n-----------------\n");
+	if (argc - optind < 3){
+		fprintf(info, "Missing arguments. Aborting ...\n");
+		exit(0);
+	}
 	//Get some parameters
-	char *filename = argv[1];
-	int Fs = atoi(argv[2]);
-	int Fl = atoi(argv[3]);
+	char *filename = argv[optind];
+	int Fs = atoi(argv[optind+1]);
+	int Fl = atoi(argv[optind+2]);
 
-	printf("File: %s\nFs: %d\nFl: %d\n", filename, Fs, Fl);
+	fprintf(info, "File: %s\nFs: %d\nFl: %d\nKernel: %s\n", filename, Fs, Fl, (info == stderr) ? "pipe" : (batch_dir != NULL) ? "batch" : (strip_rows > 0) ? "streaming" : tiled ? "tiled" : kernel);
 
-	int depth = 0, width = 0, height = 0;
-	long fileLength = 0;
-
-	//Read the file
-	FILE *pFile; //File pointer
-	pFile = fopen(filename, "rb"); //Opens the file  
-	if (pFile == NULL) {//Checks if the file was opened correctly
-		printf("Error while opening the file.\n");
-		exit(0);
+	//A stream of concatenated raw frames, e.g. from a video decoder
+	if (info == stderr){
+		if (oil_filter_pipe(stdin, stdout, Fs, Fl) != 0) fprintf(stderr, "The stream could not be filtered.\n");
+		return(0);
 	}
 
-	//Read the next parameters as one string
-	char c, str[40];
-	int cursor=0;
-	for (int i=0; i< 4; ++i){
-			c = fgetc(pFile);
-		while ((c != '\n') && (c != '\r')&&(c != '\0') && (c != ' ')){
-			str[cursor] = c;
-			c = fgetc(pFile);
-			++cursor;
-		} 
-		str[cursor] = ' ';
-		++cursor;
+	//Every image of a directory or of a list file, filtered into batch_dir
+	if (batch_dir != NULL){
+		if (oil_filter_batch(filename, batch_dir, Fs, Fl) != 0) printf("Some images could not be filtered.\n");
+		return(0);
 	}
-	str[cursor+1] = '\0';
-
-	//Separates the strings and assign values
-	char s_width[8], s_height[8], s_depth[4], s_magic[3];
-	cursor = 0;
-	int rep = 0;
 
-	//Reads out the .ppm meta-data
-	//String that should contain P6
-	while ((str[cursor] != ' ') && (str[cursor] != '\r') && (str[cursor] != '\0') && (str[cursor] != '\n')){
-		s_magic[cursor-rep] = str[cursor];
-		++cursor;
-	}
-	s_magic[cursor-rep] = '\0';
-	if ((s_magic[0] != 'P') || (s_magic[1] != '6')){
-		printf("Wrong file format. Aborting ...\n");
-		exit(0);
+	//Images larger than the memory are read, filtered and written by strips
+	if (strip_rows > 0){
+		if (oil_filter_stream(filename, oily_filename, Fs, Fl, strip_rows) != 0) printf("Streaming failed.\n");
+		return(0);
 	}
-	++cursor;
-	rep = cursor;
-	//String that contains the width
-	while ((str[cursor] != ' ') && (str[cursor] != '\r') && (str[cursor] != '\0') && (str[cursor] != '\n')) {
-		s_width[cursor-rep] = str[cursor];
-		++cursor;
-	}
-	s_width[cursor] = '\0';
-	width = atoi(s_width);
-	++cursor;
-	rep = cursor;
-	//String that contains the height
-	while ((str[cursor] != ' ') && (str[cursor] != '\r') && (str[cursor] != '\0') && (str[cursor] != '\n')){
-		s_height[cursor-rep] = str[cursor];
-		++cursor;
-	}
-	s_height[cursor-rep] = '\0';
-	height = atoi(s_height);
-	++cursor;
-	rep = cursor;
-	//String that contains the depth
-	while ((str[cursor] != ' ') && (str[cursor] != '\r') && (str[cursor] != '\0') && (str[cursor] != '\n')){
-		s_depth[cursor-rep] = str[cursor];
-		++cursor;
-	}
-	s_depth[cursor-rep] = '\0';
-	depth = atoi(s_depth);
-
-	printf("Image properties\n-----------------\nWidth : %d\nHeight: %d\nColor depth: %d\n-----------------\n", width, height, depth);
-	
-	//Getting the file length
-	fseek(pFile, 0, SEEK_END);
-	fileLength = ftell(pFile);
-	if(DEBUG)printf("File length: %ld\n", fileLength);
-	fseek(pFile, 0, SEEK_SET);
 
-	//Allocate memory
-	unsigned char * buffer = (char *)malloc(fileLength+1); //Creates a buffer
-	if(DEBUG)printf("Buffer created\n");
-	//Read
-	fread(buffer, fileLength+1, 1, pFile);
-	fclose(pFile);
+	//Every phase is timed with a monotonic wall clock
+	oil_phases phases = {0.0, 0.0, 0.0, 0.0};
+	double start = oil_wtime();
 
-	
-	int offset = cursor+1; //Number of bytes preceeding the image data
-	unsigned char * pic = (unsigned char *)malloc(3*height*width*sizeof(char));
+	//Maps the file and reads its header (P3/P6 or P2/P5, comments allowed)
+	ppm_file input;
+	if (ppm_open(&input, filename) != 0) exit(0);
+	phases.parse = oil_wtime() - start;
+	int width = input.width, height = input.height, depth = input.maxval;
 
+	printf("Image properties\n-----------------\nFormat: P%c\nWidth : %d\nHeight: %d\nColor depth: %d\n-----------------\n", input.magic, width, height, depth);
 
-	//Create an array of integers instead of binary values
-	for (int i = 0; i < height; ++i) {
-		for (int j = 0; j < width; ++j) {
-			for (int k = 0; k < 3 ; ++k) {
-				pic[3*(i*width + j) + k] = buffer[offset + 3*(i*width + j) + k];
-			}
-		}
+	int numthreads = omp_get_max_threads();
+	oil_tiling tiling;
+	if (tiled){
+		oil_tiling_init(&tiling, width, height, Fs, tile_width, tile_height, numthreads);
+		printf("Tiles: %d x %d (%d x %d tiles), halo: %d\n", tiling.tile_width, tiling.tile_height, tiling.ntiles_x, tiling.ntiles_y, Fs);
 	}
 
-	free(buffer);
+	//8-bit P6 samples are used in place in the mapping, the other formats are converted
+	oil_image pic;
+	start = oil_wtime();
+	if (ppm_read_image(&input, &pic) != 0) exit(0);
+	phases.load = oil_wtime() - start;
 
 
 	//======================= ALGORITHM ===========================//
@@ -137,143 +117,61 @@
 		- filter size Fs
 		- filter level Fl
 		- width and height extracted from the file
-		- array pic[width][height]
+		- image pic (8 or 16-bit samples)
 	Output :
 		- array containing the filtered image
 	*/
 
-	//Check out the time
-	clock_t begin = clock();
-	clock_t end = clock();
-	double time_spent;
-	
 	printf("Algorithm started...\n");
-	unsigned char * newPic = (unsigned char *)malloc(3*height*width*sizeof(char));
-
-	int k=0;
-	//Creates a square mask with relative postions of neighbors
-	int adresses[4*Fs*Fs][2]; //Declare a larger array than needed
-	for (int a = Fs; a >= -Fs; --a) {
-		for (int b = Fs; b >= -Fs; --b) {
-			if (a*a + b*b <= Fs*Fs) {
-				//Append (a,b) to adresses
-				adresses[k][0] = a;
-				adresses[k][1] = b;
-				++k;
-			}
-		}
-	} //We now have k neighbors
-	int numthreads = 1;
-
-#pragma omp parallel //Parallel region of the code
-	{
-		int actual_neighbors = 0;
-		int temp_Pic[k][3];//Local copy of the useful portion of the image
-		int averageC[depth+1][3];
-		int intensityCount[depth+1];
-		int RGB_max[3]={0,0,0};
-		int curMax = 0;
-
-		numthreads = __builtin_omp_get_num_threads();
-		#pragma omp for
-		//Applying the algorithm to the whole image
-		for (int i = 0; i < height; ++i){
-			for (int j = 0; j < width; ++j) {
-
-				actual_neighbors = 0;
-				for (int l = 0; l < k; ++l) {
-					//Check if the neighbor is not outside the picture
-					if ((i + adresses[l][1] >= 0) && (i + adresses[l][1] < height) && (j + adresses[l][0] >= 0) && (j + adresses[l][0] < width)) {
-						temp_Pic[actual_neighbors][0] = pic[3*((i + adresses[l][1])*width + j + adresses[l][0]) + 0];
-						temp_Pic[actual_neighbors][1] = pic[3*((i + adresses[l][1])*width + j + adresses[l][0]) + 1];
-						temp_Pic[actual_neighbors][2] = pic[3*((i + adresses[l][1])*width + j + adresses[l][0]) + 2];
-						if (DEBUG)printf("%d %d %d\n", temp_Pic[actual_neighbors][0], temp_Pic[actual_neighbors][1], temp_Pic[actual_neighbors][2]);
-						actual_neighbors++;
-					}
-				}
-
-				if (DEBUG)printf("Actual neighbors found: %d\n", actual_neighbors);
-
-				//Setting the variables to 0
-				for (int l=0 ; l<depth+1; ++l){
-					averageC[l][0] = 0;
-					averageC[l][1] = 0;
-					averageC[l][2] = 0;
-					intensityCount[l]=0;
-				}
-				RGB_max[0]=0;
-				RGB_max[1]=0;
-				RGB_max[2]=0;
-				curMax = 0;
-
-				//Computes intensities and find the max
-				for (int l=0 ; l<actual_neighbors; ++l){
-					int curIntensity = floor((temp_Pic[l][0] + temp_Pic[l][1] + temp_Pic[l][2]) / (3 * Fl));
-					if (DEBUG)printf("Current intensity: %d\n", curIntensity);
-					intensityCount[curIntensity]++;
-					if (intensityCount[curIntensity]>curMax)curMax=intensityCount[curIntensity];
-					averageC[curIntensity][0] += temp_Pic[l][0];
-					averageC[curIntensity][1] += temp_Pic[l][1];
-					averageC[curIntensity][2] += temp_Pic[l][2];
-					//These lines are responsible for the change in appearance
-					if (averageC[curIntensity][0] > RGB_max[0])RGB_max[0]=averageC[curIntensity][0];//Red
-					if (averageC[curIntensity][1] > RGB_max[1])RGB_max[1]=averageC[curIntensity][1];//Green
-					if (averageC[curIntensity][2] > RGB_max[2])RGB_max[2]=averageC[curIntensity][2];//Blue
-				}
-
-				if (DEBUG)printf("Max values: %d %d %d\n", RGB_max[0], RGB_max[1], RGB_max[2]);
-
-				//Sets the new pixel values
-				newPic[3*(i*width + j) + 0] = RGB_max[0] / curMax;
-				newPic[3*(i*width + j) + 1] = RGB_max[1] / curMax;
-				newPic[3*(i*width + j) + 2] = RGB_max[2] / curMax;
-
-				if (DEBUG)printf("New pixels: %d %d %d\n", newPic[3*(i*width + j) + 0], newPic[3*(i*width + j) + 1], newPic[3*(i*width + j) + 2]);
-			}
-		}
+	//The output file is created at its final size, an 8-bit P6 image is filtered straight into it
+	start = oil_wtime();
+	//Over the input, the output goes to a temporary file renamed at the end: the input is still read
+	ppm_file output;
+	char *temp_filename = NULL;
+	if (ppm_same_file(filename, oily_filename) && ((temp_filename = ppm_temp_name(oily_filename)) == NULL)) exit(0);
+	if (ppm_create(&output, (temp_filename != NULL) ? temp_filename : oily_filename, (input.channels == 3) ? '6' : '5', width, height, depth) != 0){
+		if (temp_filename != NULL) unlink(temp_filename);
+		exit(0);
 	}
-	
-	end = clock();
-	time_spent = (double)(end - begin) / (CLOCKS_PER_SEC * numthreads);
-	printf("\nJob done in %2.4lf s, using %d threads.\n", time_spent, numthreads);
-	free(pic);
+	oil_image newPic;
+	ppm_output_image(&output, &newPic);
+	phases.write = oil_wtime() - start;
+
+	if (strcmp(kernel, "fixed") == 0) printf("Specialized: %s, Fl = 2^k: %s\n", (oil_fixed_row_kernel(&pic, Fs) != oil_sliding_row) ? "yes" : "no", (oil_fixed_shift(Fl) >= 0) ? "yes" : "no");
+	if (strcmp(kernel, "simd") == 0) printf("AVX2: %s\n", oil_cpu_has_avx2() ? "yes" : "no, using the scalar fallback");
+
+	start = oil_wtime();
+	if (tiled){
+#pragma omp parallel num_threads(numthreads)
+		oil_tiling_touch(&tiling, &newPic);
+		oil_filter_tiled(&pic, &newPic, Fs, Fl, &tiling);
+		int stolen = 0;
+		for (int t = 0; t < numthreads; ++t) stolen += tiling.stolen[t];
+		printf("Tiles stolen: %d / %d\n", stolen, tiling.ntiles_x*tiling.ntiles_y);
+		oil_tiling_free(&tiling);
+	}
+	else if (oil_run_kernel(kernel, &pic, &newPic, Fs, Fl) != 0){
+		printf("Unknown kernel %s. Aborting ...\n", kernel);
+		if (temp_filename != NULL) unlink(temp_filename);
+		exit(0);
+	}
+	phases.filter = oil_wtime() - start;
+	printf("\nJob done in %2.4lf s (%.2lf Mpixels/s), using %d threads.\n", phases.filter, (double)width*height/phases.filter/1e6, numthreads);
+	oil_image_free(&pic);
+	ppm_close(&input);
 
 
 	//======================= POST-PROCESSING ===========================//
-	//Takes the filtred image and saves it as a .ppm
-	
-	char oily_filename[9] = "oily.ppm";
-
-	FILE *pNewFile = fopen(oily_filename, "wb");
-	//Writing the header
-	char header[offset], temp[6];
-	for (int i =0; i<offset ; ++i)header[i]='\0';
-	sprintf(temp, "P6\n");
-	strcat(header, temp);
-	sprintf(temp, "%d", width);
-	strcat(header, temp);
-	strcat(header, " ");
-	sprintf(temp, "%d", height);
-	strcat(header, temp);
-	strcat(header, "\n");
-	sprintf(temp, "%d", depth);
-	strcat(header, temp);
-	strcat(header, "\n");
-	strcat(header, "\0");
-	fwrite(header, 1, offset, pNewFile);
-
-	//Writing the data contained in pic
-	unsigned char newBuffer[3*width]; //Creates another buffer
-	for (int i = 0; i < height; ++i) {
-		for (int j = 0; j < width; ++j) {
-			newBuffer[3*j]   =   newPic[3*(i*width + j)];//Red
-			newBuffer[3*j + 1] = newPic[3*(i*width + j)+1];//Green
-			newBuffer[3*j + 2] = newPic[3*(i*width + j)+2];// Blue
-		}
-		fwrite(newBuffer, 1, sizeof(newBuffer), pNewFile);
-	}
-	fclose(pNewFile);
-	free(newPic);
+	//Takes the filtred image and saves it as a .ppm (or .pgm)
+
+	start = oil_wtime();
+	ppm_write_image(&output, &newPic);
+	ppm_close(&output);
+	if ((temp_filename != NULL) && (rename(temp_filename, oily_filename) != 0)) printf("!!! Could not rename %s to %s.\n", temp_filename, oily_filename);
+	free(temp_filename);
+	oil_image_free(&newPic);
+	phases.write += oil_wtime() - start;
+	printf("Parse: %.4lf s, load: %.4lf s, filter: %.4lf s, write: %.4lf s, total: %.4lf s\n", phases.parse, phases.load, phases.filter, phases.write, oil_phases_total(&phases));
 	//======================= END OF PROGRAM ===========================//
 
 	return(0);
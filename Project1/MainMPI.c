@@ -0,0 +1,95 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mpi.h>
+#include <omp.h>
+
+#define DEBUG 0
+
+#include "oil_mpi.h"
+#include "oil_bench.h"
+
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+/*=====================================================================================
+* Multi-node oil filter: one MPI rank per node (or per socket), OpenMP inside each rank.
+*	mpirun -np N ./MainMPI [-o <output.ppm>] [-c <results.csv>] <file_name.ppm> <Fs> <Fl>
+* With -g <width>x<height>, a synthetic image is written to <file_name.ppm> first; with -w
+* the height is given per rank, so that the work per rank stays the same (weak scaling).
+=====================================================================================*/
+
+int main(int argc, char **argv){
+	int provided, rank, nranks;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+
+	char *oily_filename = "oily.ppm";
+	char *csv_name = NULL;
+	int gen_width = 0, gen_height = 0, weak = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "o:c:g:w")) != -1){
+		switch (opt){
+			case 'o': oily_filename = optarg; break;
+			case 'c': csv_name = optarg; break;
+			case 'g': sscanf(optarg, "%dx%d", &gen_width, &gen_height); break;
+			case 'w': weak = 1; break;
+			default: MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+	if (argc - optind < 3){
+		if (rank == 0) printf("Usage: mpirun -np <N> ./MainMPI [-o <output.ppm>] [-c <results.csv>] [-g <width>x<height> [-w]] <file_name.ppm> <(int)Filter_size> <(int)Filter_level>\n");
+		MPI_Finalize();
+		return(0);
+	}
+	char *filename = argv[optind];
+	int Fs = atoi(argv[optind+1]);
+	int Fl = atoi(argv[optind+2]);
+
+	//Synthetic input, written by rank 0
+	if (gen_width > 0){
+		if (weak) gen_height *= nranks;
+		int status = 0;
+		if (rank == 0){
+			oil_image pic;
+			oil_image_synthetic(&pic, gen_width, gen_height, 255, 2018);
+			status = oil_image_save(&pic, filename);
+			oil_image_free(&pic);
+		}
+		MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+		if (status != 0) MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	oil_mpi_times times;
+	int status = oil_filter_mpi(filename, oily_filename, Fs, Fl, MPI_COMM_WORLD, &times);
+	if (status != 0) MPI_Abort(MPI_COMM_WORLD, 1);
+
+	if (rank == 0){
+		ppm_file input;
+		oil_mpi_header(&input, filename, MPI_COMM_SELF);
+		printf("File: %s (%d x %d)\nFs: %d\nFl: %d\nRanks: %d, threads per rank: %d\n", filename, input.width, input.height, Fs, Fl, nranks, omp_get_max_threads());
+		printf("Read: %.4lf s, halos: %.4lf s, filter: %.4lf s, write: %.4lf s, total: %.4lf s (slowest rank)\n",
+			times.read, times.exchange, times.filter, times.write, times.total);
+		if (csv_name != NULL){
+			//One line per run, the header is written with the first one
+			int fresh = (access(csv_name, F_OK) != 0);
+			FILE *csv = fopen(csv_name, "a");
+			if (csv != NULL){
+				if (fresh) fprintf(csv, "ranks,threads,width,height,Fs,Fl,read_s,exchange_s,filter_s,write_s,total_s\n");
+				fprintf(csv, "%d,%d,%d,%d,%d,%d,%.6lf,%.6lf,%.6lf,%.6lf,%.6lf\n", nranks, omp_get_max_threads(), input.width, input.height, Fs, Fl,
+					times.read, times.exchange, times.filter, times.write, times.total);
+				fclose(csv);
+			}
+		}
+	}
+	MPI_Finalize();
+	return(0);
+}
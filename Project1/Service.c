@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+
+#define DEBUG 0
+
+#include "oil_service.h"
+#include "ppm_io.h"
+
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+/*=====================================================================================
+* Filter service and its client.
+*	./Service -d <socket>                                           runs the service
+*	./Service -c <socket> [-o <output.ppm>] [-r <n>] <file.ppm> <Fs> <Fl>   filters a file n times
+*	./Service -c <socket> stats|stop
+=====================================================================================*/
+
+int main(int argc, char **argv){
+	char *daemon_path = NULL, *client_path = NULL;
+	char *oily_filename = "oily.ppm";
+	int repetitions = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:c:o:r:")) != -1){
+		switch (opt){
+			case 'd': daemon_path = optarg; break;
+			case 'c': client_path = optarg; break;
+			case 'o': oily_filename = optarg; break;
+			case 'r': repetitions = atoi(optarg); break;
+			default: exit(0);
+		}
+	}
+	if ((daemon_path == NULL) == (client_path == NULL)){
+		printf("Usage: ./Service -d <socket>\n       ./Service -c <socket> [-o <output.ppm>] [-r <n>] <file_name.ppm> <(int)Filter_size> <(int)Filter_level>\n       ./Service -c <socket> stats|stop\n");
+		exit(0);
+	}
+
+	//======================= SERVICE ===========================//
+	if (daemon_path != NULL){
+		oil_service service;
+		if (oil_service_open(&service, daemon_path) != 0) exit(1);
+		oil_service_run(&service);
+		oil_service_close(&service);
+		return(0);
+	}
+
+	//======================= CLIENT ===========================//
+	int sock = oil_client_connect(client_path);
+	if (sock < 0) exit(1);
+	oil_reply reply;
+	if ((argc - optind == 1) && ((strcmp(argv[optind], "stats") == 0) || (strcmp(argv[optind], "stop") == 0))){
+		int type = (strcmp(argv[optind], "stats") == 0) ? OIL_REQUEST_STATS : OIL_REQUEST_STOP;
+		if (oil_client_request(sock, type, &reply) != 0) exit(1);
+		printf("Requests: %ld\nLatency p50: %.3lf ms\nLatency p99: %.3lf ms\nLatency max: %.3lf ms\n", reply.requests, 1e3*reply.p50, 1e3*reply.p99, 1e3*reply.max);
+		close(sock);
+		return(0);
+	}
+	if (argc - optind < 3){
+		printf("Missing arguments. Aborting ...\n");
+		exit(0);
+	}
+	char *filename = argv[optind];
+	int Fs = atoi(argv[optind+1]);
+	int Fl = atoi(argv[optind+2]);
+
+	//The samples are decoded straight into the shared segment
+	ppm_file input;
+	if (ppm_open(&input, filename) != 0) exit(1);
+	int width = input.width, height = input.height, depth = input.maxval;
+	long size = oil_segment_size(width, height, depth);
+	int segment;
+	unsigned char *data = oil_segment_create(size, &segment);
+	if (data == NULL) exit(1);
+	oil_image pic, newPic;
+	oil_image_wrap(&pic, width, height, depth, data);
+	oil_image_wrap(&newPic, width, height, depth, data + size/2);
+	if ((input.magic == '5') || (input.magic == '6')){
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < height; ++i) ppm_decode_rows(&input, input.raster, &pic, i, i+1);
+	}
+	else{
+		oil_image plain;
+		if (ppm_read_image(&input, &plain) != 0) exit(1);
+		memcpy(data, (plain.pixels16 != NULL) ? (void *)plain.pixels16 : (void *)plain.pixels, size/2);
+		oil_image_free(&plain);
+	}
+
+	//Round trips, as seen from the client
+	double best = 1e30, total = 0.0;
+	for (int r = 0; r < repetitions; ++r){
+		double begin = oil_wtime();
+		if (oil_client_filter(sock, segment, width, height, depth, Fs, Fl, &reply) != 0){
+			fprintf(stderr, "!!! The service could not filter %s.\n", filename);
+			exit(1);
+		}
+		double elapsed = oil_wtime() - begin;
+		total += elapsed;
+		if (elapsed < best) best = elapsed;
+	}
+	printf("%d requests, round trip: %.3lf ms mean, %.3lf ms best, filter: %.3lf ms\n", repetitions, 1e3*total/repetitions, 1e3*best, 1e3*reply.filter_time);
+	printf("Service: %ld requests, latency p50: %.3lf ms, p99: %.3lf ms\n", reply.requests, 1e3*reply.p50, 1e3*reply.p99);
+
+	ppm_file output;
+	if (ppm_create(&output, oily_filename, (input.channels == 3) ? '6' : '5', width, height, depth) != 0) exit(1);
+	ppm_write_image(&output, &newPic);
+	ppm_close(&output);
+	ppm_close(&input);
+	munmap(data, size);
+	close(segment);
+	close(sock);
+	return(0);
+}
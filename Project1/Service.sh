@@ -0,0 +1,7 @@
+clear
+gcc -O2 -o Service Service.c -lm -std=c99 -fopenmp -pthread -lrt
+./Service -d /tmp/oil.sock &
+sleep 1
+./Service -c /tmp/oil.sock -r 10 nic.ppm 5 25
+./Service -c /tmp/oil.sock stats
+./Service -c /tmp/oil.sock stop
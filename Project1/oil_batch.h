@@ -0,0 +1,217 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_BATCH_H
+#define OIL_BATCH_H
+
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <omp.h>
+#include "oil_filter.h"
+#include "oil_queue.h"
+#include "ppm_io.h"
+
+/*=====================================================================================
+* Batch mode: filters every image of a directory (or of a list file) into an output
+* directory within a single process. The mask and the OpenMP team are reused, and three
+* stages work on different images at the same time: a thread opens the next images,
+* the team converts and filters the current one, another thread releases the previous ones.
+* The helper threads never start OpenMP teams of their own: the parallel conversions of
+* the raw formats are done by the filter team.
+=====================================================================================*/
+
+#define OIL_BATCH_DEPTH 2 // # of images waiting between two stages
+
+// Structures
+typedef struct oil_job oil_job;
+struct oil_job{
+	char input_name[PATH_MAX];
+	char output_name[PATH_MAX];
+	ppm_file input;
+	ppm_file output;
+	oil_image src;
+	oil_image dst;
+	int ok;
+};
+
+typedef struct oil_batch oil_batch;
+struct oil_batch{
+	char **names; // Input files
+	int count;
+	const char *output_dir;
+	oil_queue decoded; // Jobs ready to be filtered
+	oil_queue filtered; // Jobs ready to be written
+	oil_queue slots; // Jobs that can be reused
+	oil_job jobs[2*OIL_BATCH_DEPTH + 2];
+	long pixels; // Pixels filtered
+	int failed;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int oil_batch_list(const char *source, char ***names);
+void *oil_batch_decoder(void *arg);
+void *oil_batch_encoder(void *arg);
+int oil_filter_batch(const char *source, const char *output_dir, int Fs, int Fl);
+
+
+/*=====================================================================================*/
+
+
+/*============== Input list ===================*/
+static int oil_batch_compare(const void *a, const void *b){
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Builds the list of input files: the .ppm/.pgm/.pnm files of a directory, sorted,
+// or the lines of a list file. Returns the # of files, -1 on error.
+int oil_batch_list(const char *source, char ***names){
+	int count = 0, capacity = 64;
+	*names = malloc(sizeof(char *) * capacity);
+	char path[PATH_MAX];
+
+	DIR *dir = opendir(source);
+	if (dir != NULL){
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL){
+			const char *dot = strrchr(entry->d_name, '.');
+			if ((dot == NULL) || ((strcmp(dot, ".ppm") != 0) && (strcmp(dot, ".pgm") != 0) && (strcmp(dot, ".pnm") != 0))) continue;
+			snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+			if (count == capacity) *names = realloc(*names, sizeof(char *) * (capacity *= 2));
+			(*names)[count++] = strdup(path);
+		}
+		closedir(dir);
+		qsort(*names, count, sizeof(char *), oil_batch_compare);
+		return count;
+	}
+
+	FILE *list = fopen(source, "r");
+	if (list == NULL){
+		fprintf(stderr, "!!! %s is neither a directory nor a list of files.\n", source);
+		free(*names);
+		return -1;
+	}
+	while (fgets(path, sizeof(path), list) != NULL){
+		path[strcspn(path, "\r\n")] = '\0';
+		if (path[0] == '\0') continue;
+		if (count == capacity) *names = realloc(*names, sizeof(char *) * (capacity *= 2));
+		(*names)[count++] = strdup(path);
+	}
+	fclose(list);
+	return count;
+}
+
+
+/*============== Pipeline stages ===================*/
+// Maps the next inputs and creates their outputs, so that the filter writes straight into them.
+// Only the plain formats, parsed serially, are converted here.
+void *oil_batch_decoder(void *arg){
+	oil_batch *batch = arg;
+	for (int n = 0; n < batch->count; ++n){
+		oil_job *job = oil_queue_pop(&batch->slots);
+		const char *base = strrchr(batch->names[n], '/');
+		base = (base == NULL) ? batch->names[n] : base + 1;
+		snprintf(job->input_name, PATH_MAX, "%s", batch->names[n]);
+		snprintf(job->output_name, PATH_MAX, "%s/%s", batch->output_dir, base);
+		job->ok = 0;
+
+		// Never write over an input
+		char input_path[PATH_MAX], output_path[PATH_MAX];
+		if ((realpath(job->input_name, input_path) != NULL) && (realpath(job->output_name, output_path) != NULL) && (strcmp(input_path, output_path) == 0)){
+			fprintf(stderr, "!!! %s would be overwritten, skipped.\n", job->input_name);
+		}
+		else if (ppm_open(&job->input, job->input_name) == 0){
+			int plain = (job->input.magic == '2') || (job->input.magic == '3');
+			if (plain && (ppm_read_image(&job->input, &job->src) != 0)) ppm_close(&job->input);
+			else if (ppm_create(&job->output, job->output_name, (job->input.channels == 3) ? '6' : '5', job->input.width, job->input.height, job->input.maxval) != 0){
+				if (plain) oil_image_free(&job->src);
+				ppm_close(&job->input);
+			}
+			else{
+				ppm_output_image(&job->output, &job->dst);
+				job->ok = 1;
+			}
+		}
+		oil_queue_push(&batch->decoded, job);
+	}
+	return NULL;
+}
+
+// Releases the images and the files of the filtered jobs
+void *oil_batch_encoder(void *arg){
+	oil_batch *batch = arg;
+	for (int n = 0; n < batch->count; ++n){
+		oil_job *job = oil_queue_pop(&batch->filtered);
+		if (job->ok){
+			ppm_close(&job->output);
+			oil_image_free(&job->dst);
+			oil_image_free(&job->src);
+			ppm_close(&job->input);
+		}
+		else batch->failed++;
+		oil_queue_push(&batch->slots, job);
+	}
+	return NULL;
+}
+
+
+/*============== Batch filter ===================*/
+// Filters every image of 'source' (a directory or a list file) into output_dir.
+// Prints the throughput at the end.
+int oil_filter_batch(const char *source, const char *output_dir, int Fs, int Fl){
+	oil_batch batch;
+	memset(&batch, 0, sizeof(oil_batch));
+	batch.count = oil_batch_list(source, &batch.names);
+	if (batch.count < 0) return -1;
+	batch.output_dir = output_dir;
+	printf("Batch: %d images into %s\n", batch.count, output_dir);
+
+	int njobs = sizeof(batch.jobs)/sizeof(batch.jobs[0]);
+	oil_queue_init(&batch.decoded, OIL_BATCH_DEPTH);
+	oil_queue_init(&batch.filtered, OIL_BATCH_DEPTH);
+	oil_queue_init(&batch.slots, njobs);
+	for (int j = 0; j < njobs; ++j) oil_queue_push(&batch.slots, &batch.jobs[j]);
+	oil_mask mask;
+	oil_mask_init(&mask, Fs); // Shared by every image
+
+	double begin = omp_get_wtime();
+	pthread_t decoder, encoder;
+	pthread_create(&decoder, NULL, oil_batch_decoder, &batch);
+	pthread_create(&encoder, NULL, oil_batch_encoder, &batch);
+
+	for (int n = 0; n < batch.count; ++n){
+		oil_job *job = oil_queue_pop(&batch.decoded);
+		if (job->ok){
+			// The raw formats are converted on this team, the plain ones were parsed by the decoder
+			if ((job->input.magic == '5') || (job->input.magic == '6')) ppm_read_image(&job->input, &job->src);
+			oil_filter_sliding_mask(&job->src, &job->dst, &mask, Fl);
+			ppm_write_image(&job->output, &job->dst);
+			batch.pixels += (long)job->src.width*job->src.height;
+		}
+		oil_queue_push(&batch.filtered, job);
+	}
+
+	pthread_join(decoder, NULL);
+	pthread_join(encoder, NULL);
+	double elapsed = omp_get_wtime() - begin;
+	int done = batch.count - batch.failed;
+	printf("Filtered %d images (%d failed) in %.4lf s: %.2lf images/s, %.2lf Mpixels/s, using %d threads.\n",
+		done, batch.failed, elapsed, done/elapsed, batch.pixels/elapsed/1e6, omp_get_max_threads());
+
+	oil_mask_free(&mask);
+	oil_queue_free(&batch.decoded);
+	oil_queue_free(&batch.filtered);
+	oil_queue_free(&batch.slots);
+	for (int n = 0; n < batch.count; ++n) free(batch.names[n]);
+	free(batch.names);
+	return (batch.failed > 0) ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_BENCH_H
+#define OIL_BENCH_H
+
+#include <time.h>
+#include <omp.h>
+#include "oil_filter.h"
+#include "oil_fixed.h"
+#include "oil_simd.h"
+#include "oil_tiles.h"
+#include "ppm_io.h"
+
+/*=====================================================================================
+* Tools shared by Main and the benchmark: a monotonic wall clock with per-phase timers,
+* synthetic test images, and the kernels looked up by name.
+* clock() gives the CPU time of the whole process, which grows with the # of threads:
+* every timing is taken with oil_wtime instead.
+=====================================================================================*/
+
+// Structure
+// Wall time spent in each phase of a run, in seconds
+typedef struct oil_phases oil_phases;
+struct oil_phases{
+	double parse; // Opening and parsing the header
+	double load; // Reading and converting the samples
+	double filter;
+	double write; // Creating, converting and closing the output
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+double oil_wtime(void);
+double oil_phases_total(const oil_phases *phases);
+/*==============*/
+void oil_image_synthetic(oil_image *img, int width, int height, int depth, unsigned int seed);
+int oil_image_equal(const oil_image *a, const oil_image *b);
+int oil_image_save(const oil_image *img, const char *filename);
+/*==============*/
+int oil_run_kernel(const char *kernel, const oil_image *src, oil_image *dst, int Fs, int Fl);
+
+
+/*=====================================================================================*/
+
+
+/*============== Timing ===================*/
+// Monotonic wall clock, in seconds
+double oil_wtime(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + 1e-9*now.tv_nsec;
+}
+
+double oil_phases_total(const oil_phases *phases){
+	return phases->parse + phases->load + phases->filter + phases->write;
+}
+
+
+/*============== Test images ===================*/
+// Fills an image with smooth gradients, flat rectangles and noise, so that the windows
+// hold from one to many intensity bins. The same seed always gives the same image.
+void oil_image_synthetic(oil_image *img, int width, int height, int depth, unsigned int seed){
+	oil_image_init(img, width, height, depth);
+	#pragma omp parallel for
+	for (int i = 0; i < height; ++i){
+		unsigned int state = seed*2654435761u + (unsigned int)i*40503u + 1u; // One generator per row
+		for (int j = 0; j < width; ++j){
+			state = state*1664525u + 1013904223u;
+			int noise = (int)((state >> 16) % 33) - 16;
+			int flat = (((i / 37) + (j / 53)) % 3 == 0); // Rectangles without noise
+			long p = 3*((long)i*width + j);
+			for (int c = 0; c < 3; ++c){
+				long value = (long)depth*((c == 0) ? j : (c == 1) ? i : (i + j)/2) / ((c == 0) ? width : height);
+				if (!flat) value += noise*(depth/255 + 1);
+				if (value < 0) value = 0;
+				if (value > depth) value = depth;
+				oil_image_set(img, p + c, (int)value);
+			}
+		}
+	}
+}
+
+// 1 if both images hold the same samples
+int oil_image_equal(const oil_image *a, const oil_image *b){
+	if ((a->width != b->width) || (a->height != b->height)) return 0;
+	long n = 3*(long)a->width*a->height;
+	for (long p = 0; p < n; ++p){
+		if (oil_image_get(a, p) != oil_image_get(b, p)) return 0;
+	}
+	return 1;
+}
+
+// Writes an image as a raw PPM file
+int oil_image_save(const oil_image *img, const char *filename){
+	ppm_file file;
+	oil_image raw;
+	if (ppm_create(&file, filename, '6', img->width, img->height, img->depth) != 0) return -1;
+	ppm_output_image(&file, &raw);
+	if (raw.borrowed) memcpy(raw.pixels, img->pixels, 3*(long)img->width*img->height); // 8-bit: straight into the mapping
+	ppm_write_image(&file, (raw.borrowed) ? &raw : img);
+	ppm_close(&file);
+	oil_image_free(&raw);
+	return 0;
+}
+
+
+/*============== Kernels ===================*/
+// Runs the kernel called 'kernel' with the current # of OpenMP threads:
+// naive, sliding, fixed, planar, simd or tiled (automatic tile size).
+// Returns -1 for an unknown name.
+int oil_run_kernel(const char *kernel, const oil_image *src, oil_image *dst, int Fs, int Fl){
+	if (strcmp(kernel, "naive") == 0) oil_filter_naive(src, dst, Fs, Fl);
+	else if (strcmp(kernel, "sliding") == 0) oil_filter_sliding(src, dst, Fs, Fl);
+	else if (strcmp(kernel, "fixed") == 0) oil_filter_fixed(src, dst, Fs, Fl);
+	else if (strcmp(kernel, "planar") == 0) oil_filter_planar(src, dst, Fs, Fl, 0);
+	else if (strcmp(kernel, "simd") == 0) oil_filter_planar(src, dst, Fs, Fl, oil_cpu_has_avx2());
+	else if (strcmp(kernel, "tiled") == 0){
+		oil_tiling tiling;
+		oil_tiling_init(&tiling, src->width, src->height, Fs, 0, 0, omp_get_max_threads());
+		oil_filter_tiled(src, dst, Fs, Fl, &tiling);
+		oil_tiling_free(&tiling);
+	}
+	else return -1;
+	return 0;
+}
+
+#endif
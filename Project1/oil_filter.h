@@ -0,0 +1,497 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_FILTER_H
+#define OIL_FILTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+#define OIL_HISTOGRAM_TRACKED 32 // From this # of bins on, the maxima are kept up to date instead of rescanned
+
+/*=====================================================================================
+* Contains the oil-paint filter kernels and the circular mask they share
+=====================================================================================*/
+
+// Structures
+// An RGB image, the samples are stored interleaved (3*(i*width + j) + channel).
+// 8-bit images (depth < 256) use 'pixels', 16-bit images use 'pixels16'.
+typedef struct oil_image oil_image;
+struct oil_image{
+	int width;
+	int height;
+	int depth; // Maximal value of a sample
+	unsigned char *pixels;
+	unsigned short *pixels16;
+	int borrowed; // The samples belong to someone else (e.g. a mapped file) and are not freed
+};
+
+// The circular mask of radius Fs, stored as one horizontal span per row: the row dy
+// (from -Fs to Fs) covers the contiguous columns [-half_width[dy+Fs], half_width[dy+Fs]]
+typedef struct oil_mask oil_mask;
+struct oil_mask{
+	int radius; // Fs
+	int count; // # of neighbors in the mask (k)
+	int *half_width;
+};
+
+// Intensity histogram of a window, with the RGB sums of every intensity bin.
+// The non-empty bins are kept in a list so that evaluating the window does not
+// need to browse every possible intensity. With many bins, the maxima over the bins are
+// kept up to date: adding a pixel can only raise them, and the list is rescanned only after
+// a pixel left a bin holding one of them. A short list is cheaper to rescan every time.
+typedef struct oil_histogram oil_histogram;
+struct oil_histogram{
+	int nbins;
+	int *count; // # of pixels per bin
+	long *sum; // RGB sums per bin, sum[3*bin + channel]
+	int nactive; // # of non-empty bins
+	int *active; // List of the non-empty bins
+	int *position; // Position of each non-empty bin in the active list
+	int max_count; // Largest count and largest RGB sums over the bins
+	long max_sum[3];
+	int tracked; // nbins >= OIL_HISTOGRAM_TRACKED
+	int stale; // A maximum may have decreased, max_count and max_sum must be rescanned
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+void oil_image_init(oil_image *img, int width, int height, int depth);
+void oil_image_wrap(oil_image *img, int width, int height, int depth, void *samples);
+static inline int oil_image_get(const oil_image *img, long index);
+static inline void oil_image_set(oil_image *img, long index, int value);
+static inline void oil_image_gather(const oil_image *img, long index, int n, int *samples);
+void oil_image_free(oil_image *img);
+/*==============*/
+int oil_nbins(int depth, int Fl);
+void oil_bin_rows(const oil_image *img, int Fl, unsigned short *bins, int first_row, int last_row);
+unsigned short *oil_bin_plane(const oil_image *img, int Fl);
+/*==============*/
+void oil_mask_init(oil_mask *mask, int Fs);
+void oil_mask_free(oil_mask *mask);
+/*==============*/
+void oil_histogram_init(oil_histogram *hist, int nbins);
+void oil_histogram_clear(oil_histogram *hist);
+void oil_histogram_add(oil_histogram *hist, int bin, int r, int g, int b);
+void oil_histogram_remove(oil_histogram *hist, int bin, int r, int g, int b);
+int oil_histogram_maxima(oil_histogram *hist, long *RGB_max);
+void oil_histogram_evaluate(oil_histogram *hist, int *rgb);
+void oil_histogram_free(oil_histogram *hist);
+/*==============*/
+void oil_filter_naive(const oil_image *src, oil_image *dst, int Fs, int Fl);
+void oil_sliding_row(oil_histogram *hist, const oil_image *src, const unsigned short *bins, const oil_mask *mask, oil_image *dst, int i, int first, int last);
+void oil_filter_sliding(const oil_image *src, oil_image *dst, int Fs, int Fl);
+void oil_filter_sliding_mask(const oil_image *src, oil_image *dst, const oil_mask *mask, int Fl);
+
+
+/*=====================================================================================*/
+
+
+/*============== Image functions ===================*/
+// Allocates the samples of a width x height image
+void oil_image_init(oil_image *img, int width, int height, int depth){
+	img->width = width;
+	img->height = height;
+	img->depth = depth;
+	img->pixels = NULL;
+	img->pixels16 = NULL;
+	img->borrowed = 0;
+	if (depth < 256) img->pixels = malloc(sizeof(unsigned char) * 3*(long)width*height);
+	else img->pixels16 = malloc(sizeof(unsigned short) * 3*(long)width*height);
+}
+
+// Reads one sample, index = 3*(i*width + j) + channel
+static inline int oil_image_get(const oil_image *img, long index){
+	return (img->pixels16 != NULL) ? img->pixels16[index] : img->pixels[index];
+}
+
+static inline void oil_image_set(oil_image *img, long index, int value){
+	if (img->pixels16 != NULL) img->pixels16[index] = value;
+	else img->pixels[index] = value;
+}
+
+// Copies n consecutive samples, the sample size is tested once so the copy vectorizes
+static inline void oil_image_gather(const oil_image *img, long index, int n, int *samples){
+	if (img->pixels16 != NULL){
+		const unsigned short *p = &img->pixels16[index];
+		for (int l = 0; l < n; ++l) samples[l] = p[l];
+	}
+	else{
+		const unsigned char *p = &img->pixels[index];
+		for (int l = 0; l < n; ++l) samples[l] = p[l];
+	}
+}
+
+// Uses existing interleaved samples (unsigned char or unsigned short depending on depth) without copying them
+void oil_image_wrap(oil_image *img, int width, int height, int depth, void *samples){
+	img->width = width;
+	img->height = height;
+	img->depth = depth;
+	img->pixels = (depth < 256) ? samples : NULL;
+	img->pixels16 = (depth < 256) ? NULL : samples;
+	img->borrowed = 1;
+}
+
+void oil_image_free(oil_image *img){
+	if (img->borrowed) return;
+	free(img->pixels);
+	free(img->pixels16);
+}
+
+
+/*============== Intensity functions ===================*/
+// # of intensity bins actually reachable: floor((r+g+b)/(3*Fl)) is at most depth/Fl
+int oil_nbins(int depth, int Fl){
+	return depth/Fl + 1;
+}
+
+// Computes the intensity bin of the pixels of the rows [first_row, last_row), bins[i*width + j]
+void oil_bin_rows(const oil_image *img, int Fl, unsigned short *bins, int first_row, int last_row){
+	int divisor = 3*Fl;
+	long first = (long)first_row*img->width, last = (long)last_row*img->width;
+
+	if (img->pixels16 != NULL){
+		for (long p = first; p < last; ++p){
+			bins[p] = (img->pixels16[3*p] + img->pixels16[3*p + 1] + img->pixels16[3*p + 2]) / divisor;
+		}
+	}
+	else{
+		for (long p = first; p < last; ++p){
+			bins[p] = (img->pixels[3*p] + img->pixels[3*p + 1] + img->pixels[3*p + 2]) / divisor;
+		}
+	}
+}
+
+// Computes the intensity bin of every pixel once
+unsigned short *oil_bin_plane(const oil_image *img, int Fl){
+	unsigned short *bins = malloc(sizeof(unsigned short) * (long)img->width*img->height);
+	#pragma omp parallel for
+	for (int i = 0; i < img->height; ++i){
+		oil_bin_rows(img, Fl, bins, i, i+1);
+	}
+	return bins;
+}
+
+
+/*============== Mask functions ===================*/
+// Builds the circular mask, every (a,b) with a*a + b*b <= Fs*Fs belongs to it
+void oil_mask_init(oil_mask *mask, int Fs){
+	mask->radius = Fs;
+	mask->count = 0;
+	mask->half_width = malloc(sizeof(int) * (2*Fs + 1));
+	for (int dy = -Fs; dy <= Fs; ++dy){
+		int w = 0;
+		while ((w+1)*(w+1) + dy*dy <= Fs*Fs) ++w;
+		mask->half_width[dy + Fs] = w;
+		mask->count += 2*w + 1;
+	}
+}
+
+void oil_mask_free(oil_mask *mask){
+	free(mask->half_width);
+}
+
+
+/*============== Histogram functions ===================*/
+void oil_histogram_init(oil_histogram *hist, int nbins){
+	hist->nbins = nbins;
+	hist->tracked = (nbins >= OIL_HISTOGRAM_TRACKED);
+	hist->count = malloc(sizeof(int) * nbins);
+	hist->sum = malloc(sizeof(long) * 3*nbins);
+	hist->active = malloc(sizeof(int) * nbins);
+	hist->position = malloc(sizeof(int) * nbins);
+	memset(hist->count, 0, sizeof(int) * nbins);
+	memset(hist->sum, 0, sizeof(long) * 3*nbins);
+	hist->nactive = 0;
+	hist->max_count = 0;
+	hist->max_sum[0] = hist->max_sum[1] = hist->max_sum[2] = 0;
+	hist->stale = !hist->tracked;
+}
+
+// Empties the histogram, only the non-empty bins are touched
+void oil_histogram_clear(oil_histogram *hist){
+	for (int l = 0; l < hist->nactive; ++l){
+		int bin = hist->active[l];
+		hist->count[bin] = 0;
+		hist->sum[3*bin + 0] = 0;
+		hist->sum[3*bin + 1] = 0;
+		hist->sum[3*bin + 2] = 0;
+	}
+	hist->nactive = 0;
+	hist->max_count = 0;
+	hist->max_sum[0] = hist->max_sum[1] = hist->max_sum[2] = 0;
+	hist->stale = !hist->tracked;
+}
+
+// Adds one pixel of intensity 'bin' to the window
+void oil_histogram_add(oil_histogram *hist, int bin, int r, int g, int b){
+	if (hist->count[bin] == 0){
+		hist->position[bin] = hist->nactive;
+		hist->active[hist->nactive] = bin;
+		++hist->nactive;
+	}
+	hist->count[bin]++;
+	hist->sum[3*bin + 0] += r;
+	hist->sum[3*bin + 1] += g;
+	hist->sum[3*bin + 2] += b;
+	if (hist->stale) return; // The next evaluation rescans the bins anyway
+	if (hist->count[bin] > hist->max_count) hist->max_count = hist->count[bin];
+	if (hist->sum[3*bin + 0] > hist->max_sum[0]) hist->max_sum[0] = hist->sum[3*bin + 0];
+	if (hist->sum[3*bin + 1] > hist->max_sum[1]) hist->max_sum[1] = hist->sum[3*bin + 1];
+	if (hist->sum[3*bin + 2] > hist->max_sum[2]) hist->max_sum[2] = hist->sum[3*bin + 2];
+}
+
+// Removes one pixel of intensity 'bin' from the window
+void oil_histogram_remove(oil_histogram *hist, int bin, int r, int g, int b){
+	// The bin may hold a maximum that is about to decrease
+	if (!hist->stale && ((hist->count[bin] == hist->max_count) || (hist->sum[3*bin + 0] == hist->max_sum[0])
+	    || (hist->sum[3*bin + 1] == hist->max_sum[1]) || (hist->sum[3*bin + 2] == hist->max_sum[2]))) hist->stale = 1;
+	hist->count[bin]--;
+	hist->sum[3*bin + 0] -= r;
+	hist->sum[3*bin + 1] -= g;
+	hist->sum[3*bin + 2] -= b;
+	if (hist->count[bin] == 0){
+		// Swap the last active bin in place of the emptied one
+		int last = hist->active[hist->nactive - 1];
+		hist->active[hist->position[bin]] = last;
+		hist->position[last] = hist->position[bin];
+		--hist->nactive;
+	}
+}
+
+// Finds the largest RGB sums and the largest count over the bins, returns the count.
+// The sums only grow while a window is built, so the running maxima of the original
+// kernel are the maxima over the bins: the result only depends on the window content.
+// The active bins are only browsed when a maximum may have left the window.
+int oil_histogram_maxima(oil_histogram *hist, long *RGB_max){
+	if (hist->stale){
+		int curMax = 0;
+		long sums[3] = {0, 0, 0};
+		for (int l = 0; l < hist->nactive; ++l){
+			int bin = hist->active[l];
+			if (hist->count[bin] > curMax) curMax = hist->count[bin];
+			if (hist->sum[3*bin + 0] > sums[0]) sums[0] = hist->sum[3*bin + 0];
+			if (hist->sum[3*bin + 1] > sums[1]) sums[1] = hist->sum[3*bin + 1];
+			if (hist->sum[3*bin + 2] > sums[2]) sums[2] = hist->sum[3*bin + 2];
+		}
+		hist->max_count = curMax;
+		hist->max_sum[0] = sums[0];
+		hist->max_sum[1] = sums[1];
+		hist->max_sum[2] = sums[2];
+		hist->stale = !hist->tracked;
+	}
+	RGB_max[0] = hist->max_sum[0];
+	RGB_max[1] = hist->max_sum[1];
+	RGB_max[2] = hist->max_sum[2];
+	return hist->max_count;
+}
+
+// Computes the filtered pixel from the window
+void oil_histogram_evaluate(oil_histogram *hist, int *rgb){
+	long RGB_max[3];
+	int curMax = oil_histogram_maxima(hist, RGB_max);
+	rgb[0] = RGB_max[0] / curMax;
+	rgb[1] = RGB_max[1] / curMax;
+	rgb[2] = RGB_max[2] / curMax;
+}
+
+void oil_histogram_free(oil_histogram *hist){
+	free(hist->count);
+	free(hist->sum);
+	free(hist->active);
+	free(hist->position);
+}
+
+
+/*============== Filter kernels ===================*/
+// Reference kernel: rebuilds the histogram of the whole circle for every pixel, O(Fs²+depth/Fl)
+// The neighbors are copied span by span: pixels at least Fs away from the border take
+// the interior path without any bounds check, the others clip the spans to the picture.
+void oil_filter_naive(const oil_image *src, oil_image *dst, int Fs, int Fl){
+	int width = src->width, height = src->height;
+	int nbins = oil_nbins(src->depth, Fl);
+	oil_mask mask;
+	oil_mask_init(&mask, Fs);
+	int k = mask.count; //We have k neighbors
+
+#pragma omp parallel //Parallel region of the code
+	{
+		int actual_neighbors = 0;
+		int *temp_Pic = malloc(sizeof(int) * 3*k);//Local copy of the useful portion of the image, temp_Pic[3*l + channel]
+		long (*averageC)[3] = malloc(sizeof(long[3]) * nbins);
+		int *intensityCount = malloc(sizeof(int) * nbins);
+		long RGB_max[3]={0,0,0};
+		int curMax = 0;
+
+		#pragma omp for
+		//Applying the algorithm to the whole image
+		for (int i = 0; i < height; ++i){
+			int interior_row = (i >= Fs) && (i < height - Fs);
+			for (int j = 0; j < width; ++j) {
+
+				actual_neighbors = 0;
+				if (interior_row && (j >= Fs) && (j < width - Fs)){
+					//Interior: every span lies inside the picture
+					for (int dy = -Fs; dy <= Fs; ++dy){
+						int w = mask.half_width[dy + Fs];
+						oil_image_gather(src, 3*((long)(i + dy)*width + j - w), 3*(2*w + 1), &temp_Pic[3*actual_neighbors]);
+						actual_neighbors += 2*w + 1;
+					}
+				}
+				else{
+					//Border frame: the spans are clipped to the picture
+					for (int dy = -Fs; dy <= Fs; ++dy){
+						if ((i + dy < 0) || (i + dy >= height)) continue;
+						int w = mask.half_width[dy + Fs];
+						int first = (j - w < 0) ? 0 : j - w;
+						int last = (j + w >= width) ? width - 1 : j + w;
+						oil_image_gather(src, 3*((long)(i + dy)*width + first), 3*(last - first + 1), &temp_Pic[3*actual_neighbors]);
+						actual_neighbors += last - first + 1;
+					}
+				}
+
+				if (DEBUG)printf("Actual neighbors found: %d\n", actual_neighbors);
+
+				//Setting the variables to 0
+				for (int l=0 ; l<nbins; ++l){
+					averageC[l][0] = 0;
+					averageC[l][1] = 0;
+					averageC[l][2] = 0;
+					intensityCount[l]=0;
+				}
+				RGB_max[0]=0;
+				RGB_max[1]=0;
+				RGB_max[2]=0;
+				curMax = 0;
+
+				//Computes intensities and find the max
+				for (int l=0 ; l<actual_neighbors; ++l){
+					int *p = &temp_Pic[3*l];
+					int curIntensity = (p[0] + p[1] + p[2]) / (3 * Fl);
+					if (DEBUG)printf("Current intensity: %d\n", curIntensity);
+					intensityCount[curIntensity]++;
+					if (intensityCount[curIntensity]>curMax)curMax=intensityCount[curIntensity];
+					averageC[curIntensity][0] += p[0];
+					averageC[curIntensity][1] += p[1];
+					averageC[curIntensity][2] += p[2];
+					//These lines are responsible for the change in appearance
+					if (averageC[curIntensity][0] > RGB_max[0])RGB_max[0]=averageC[curIntensity][0];//Red
+					if (averageC[curIntensity][1] > RGB_max[1])RGB_max[1]=averageC[curIntensity][1];//Green
+					if (averageC[curIntensity][2] > RGB_max[2])RGB_max[2]=averageC[curIntensity][2];//Blue
+				}
+
+				if (DEBUG)printf("Max values: %ld %ld %ld\n", RGB_max[0], RGB_max[1], RGB_max[2]);
+
+				//Sets the new pixel values
+				oil_image_set(dst, 3*((long)i*width + j) + 0, RGB_max[0] / curMax);
+				oil_image_set(dst, 3*((long)i*width + j) + 1, RGB_max[1] / curMax);
+				oil_image_set(dst, 3*((long)i*width + j) + 2, RGB_max[2] / curMax);
+			}
+		}
+		free(temp_Pic);
+		free(averageC);
+		free(intensityCount);
+	}
+	oil_mask_free(&mask);
+}
+
+// Moves the window of the row i from column j-1 to column j, for the mask rows [dy_first, dy_last].
+// With 'clipped' = 0 the caller guarantees that every edge pixel lies inside the picture.
+static inline void oil_slide(oil_histogram *hist, const oil_image *src, const unsigned short *bins, const oil_mask *mask,
+                             int i, int j, int dy_first, int dy_last, int clipped){
+	int width = src->width, Fs = mask->radius;
+	for (int dy = dy_first; dy <= dy_last; ++dy){
+		int w = mask->half_width[dy + Fs];
+		long row = (long)(i + dy)*width;
+		int leaving = j - 1 - w;
+		int entering = j + w;
+		if (!clipped || (leaving >= 0)){
+			long p = row + leaving;
+			oil_histogram_remove(hist, bins[p], oil_image_get(src, 3*p), oil_image_get(src, 3*p + 1), oil_image_get(src, 3*p + 2));
+		}
+		if (!clipped || (entering < width)){
+			long p = row + entering;
+			oil_histogram_add(hist, bins[p], oil_image_get(src, 3*p), oil_image_get(src, 3*p + 1), oil_image_get(src, 3*p + 2));
+		}
+	}
+}
+
+// Filters the pixels [first, last] of the row i with a sliding window: the histogram of the
+// first pixel is built, then only the pixels entering on the right edge and leaving on the
+// left edge are processed, O(Fs) per pixel plus a rescan of the non-empty bins whenever
+// a maximum of the window leaves it (at every pixel below OIL_HISTOGRAM_TRACKED bins). The mask rows falling outside the picture are
+// dropped once, and only the Fs first and last columns of the picture test the edges.
+void oil_sliding_row(oil_histogram *hist, const oil_image *src, const unsigned short *bins, const oil_mask *mask, oil_image *dst, int i, int first, int last){
+	int width = src->width, height = src->height, Fs = mask->radius;
+	int dy_first = (i - Fs < 0) ? -i : -Fs;
+	int dy_last = (i + Fs >= height) ? height - 1 - i : Fs;
+	// Columns for which both edges of every span are inside the picture
+	int interior_first = Fs + 1;
+	int interior_last = width - Fs - 1;
+	int rgb[3];
+
+	// Fills the window of the first pixel
+	oil_histogram_clear(hist);
+	for (int dy = dy_first; dy <= dy_last; ++dy){
+		int w = mask->half_width[dy + Fs];
+		int x_first = (first - w < 0) ? 0 : first - w;
+		int x_last = (first + w >= width) ? width - 1 : first + w;
+		for (int x = x_first; x <= x_last; ++x){
+			long p = (long)(i + dy)*width + x;
+			oil_histogram_add(hist, bins[p], oil_image_get(src, 3*p), oil_image_get(src, 3*p + 1), oil_image_get(src, 3*p + 2));
+		}
+	}
+	oil_histogram_evaluate(hist, rgb);
+	for (int c = 0; c < 3; ++c) oil_image_set(dst, 3*((long)i*width + first) + c, rgb[c]);
+
+	// Slides it along the row
+	for (int j = first + 1; j <= last; ++j){
+		int clipped = (j < interior_first) || (j > interior_last);
+		oil_slide(hist, src, bins, mask, i, j, dy_first, dy_last, clipped);
+		oil_histogram_evaluate(hist, rgb);
+		for (int c = 0; c < 3; ++c) oil_image_set(dst, 3*((long)i*width + j) + c, rgb[c]);
+	}
+}
+
+// Sliding-window kernel, the rows are shared between the threads.
+// The intensity bins are computed once per image beforehand.
+// Gives the same image as oil_filter_naive.
+void oil_filter_sliding(const oil_image *src, oil_image *dst, int Fs, int Fl){
+	oil_mask mask;
+	oil_mask_init(&mask, Fs);
+	oil_filter_sliding_mask(src, dst, &mask, Fl);
+	oil_mask_free(&mask);
+}
+
+// Same, with a mask built once for several images
+void oil_filter_sliding_mask(const oil_image *src, oil_image *dst, const oil_mask *mask, int Fl){
+	int nbins = oil_nbins(src->depth, Fl);
+	unsigned short *bins = oil_bin_plane(src, Fl);
+
+#pragma omp parallel
+	{
+		oil_histogram hist;
+		oil_histogram_init(&hist, nbins);
+
+		#pragma omp for
+		for (int i = 0; i < src->height; ++i){
+			oil_sliding_row(&hist, src, bins, mask, dst, i, 0, src->width - 1);
+		}
+		oil_histogram_free(&hist);
+	}
+	free(bins);
+}
+
+#endif
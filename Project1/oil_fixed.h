@@ -0,0 +1,209 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_FIXED_H
+#define OIL_FIXED_H
+
+#include "oil_filter.h"
+
+/*=====================================================================================
+* Sliding-window kernels specialized at compile time for the filter sizes used the most,
+* Fs = 1..OIL_FIXED_MAX_FS, on 8-bit images.
+* Each one is the generic row kernel with Fs and the mask as constants: the loop over the
+* mask rows is fully unrolled and the span widths become immediates. With Fl a power of
+* two, the bins are computed as ((r+g+b) >> log2(Fl)) / 3, the constant division being
+* turned into a multiplication. Other parameters fall back to the generic kernel.
+=====================================================================================*/
+
+#define OIL_FIXED_MAX_FS 8
+
+// Half widths of the mask rows, oil_fixed_mask[Fs][dy + Fs], same as oil_mask_init
+static const int oil_fixed_mask[OIL_FIXED_MAX_FS + 1][2*OIL_FIXED_MAX_FS + 1] = {
+	{0},
+	{0, 1, 0},
+	{0, 1, 2, 1, 0},
+	{0, 2, 2, 3, 2, 2, 0},
+	{0, 2, 3, 3, 4, 3, 3, 2, 0},
+	{0, 3, 4, 4, 4, 5, 4, 4, 4, 3, 0},
+	{0, 3, 4, 5, 5, 5, 6, 5, 5, 5, 4, 3, 0},
+	{0, 3, 4, 5, 6, 6, 6, 7, 6, 6, 6, 5, 4, 3, 0},
+	{0, 3, 5, 6, 6, 7, 7, 7, 8, 7, 7, 7, 6, 6, 5, 3, 0}
+};
+
+// Row kernel, same arguments as oil_sliding_row
+typedef void (*oil_row_kernel)(oil_histogram *hist, const oil_image *src, const unsigned short *bins, const oil_mask *mask, oil_image *dst, int i, int first, int last);
+
+/*=====================================================================================*/
+
+// Prototypes
+int oil_fixed_shift(int Fl);
+void oil_bin_rows_shift(const oil_image *img, int shift, unsigned short *bins, int first_row, int last_row);
+oil_row_kernel oil_fixed_row_kernel(const oil_image *src, int Fs);
+/*==============*/
+void oil_filter_fixed(const oil_image *src, oil_image *dst, int Fs, int Fl);
+void oil_filter_fixed_mask(const oil_image *src, oil_image *dst, const oil_mask *mask, int Fl);
+/*==============*/
+int oil_filter_buffer(const void *input, void *output, int width, int height, int depth, int Fs, int Fl);
+
+
+/*=====================================================================================*/
+
+
+/*============== Intensity functions ===================*/
+// log2(Fl) when Fl is a power of two, -1 otherwise
+int oil_fixed_shift(int Fl){
+	if ((Fl <= 0) || ((Fl & (Fl - 1)) != 0)) return -1;
+	int shift = 0;
+	while ((1 << shift) < Fl) ++shift;
+	return shift;
+}
+
+// Same as oil_bin_rows for Fl = 2^shift: floor(floor(s/Fl)/3) = floor(s/(3*Fl))
+void oil_bin_rows_shift(const oil_image *img, int shift, unsigned short *bins, int first_row, int last_row){
+	long first = (long)first_row*img->width, last = (long)last_row*img->width;
+
+	if (img->pixels16 != NULL){
+		for (long p = first; p < last; ++p){
+			bins[p] = ((img->pixels16[3*p] + img->pixels16[3*p + 1] + img->pixels16[3*p + 2]) >> shift) / 3;
+		}
+	}
+	else{
+		for (long p = first; p < last; ++p){
+			bins[p] = ((img->pixels[3*p] + img->pixels[3*p + 1] + img->pixels[3*p + 2]) >> shift) / 3;
+		}
+	}
+}
+
+
+/*============== Specialized row kernel ===================*/
+// Moves the window of an interior pixel (i, j-1) -> (i, j) of an 8-bit image,
+// every mask row and both edges of every span lie inside the picture.
+static inline __attribute__((always_inline)) void oil_fixed_slide(oil_histogram *hist, const unsigned char *pixels, const unsigned short *bins,
+                                                                    int width, int i, int j, const int Fs){
+	#pragma GCC unroll 17
+	for (int dy = -Fs; dy <= Fs; ++dy){
+		const int w = oil_fixed_mask[Fs][dy + Fs];
+		long row = (long)(i + dy)*width;
+		long p = row + j - 1 - w;
+		oil_histogram_remove(hist, bins[p], pixels[3*p], pixels[3*p + 1], pixels[3*p + 2]);
+		p = row + j + w;
+		oil_histogram_add(hist, bins[p], pixels[3*p], pixels[3*p + 1], pixels[3*p + 2]);
+	}
+}
+
+// oil_sliding_row with a constant Fs. Only the rows at least Fs away from the top and
+// bottom borders are specialized, the others and the clipped columns take the generic path.
+static inline __attribute__((always_inline)) void oil_fixed_row(oil_histogram *hist, const oil_image *src, const unsigned short *bins, const oil_mask *mask,
+                                                                  oil_image *dst, int i, int first, int last, const int Fs){
+	int width = src->width, height = src->height;
+	if ((i < Fs) || (i >= height - Fs) || (width <= 2*Fs + 1)){
+		oil_sliding_row(hist, src, bins, mask, dst, i, first, last);
+		return;
+	}
+	const unsigned char *pixels = src->pixels;
+	unsigned char *out = dst->pixels;
+	// Columns [first, interior_first) and (interior_last, last] clip the spans
+	int interior_first = (first + 1 > Fs + 1) ? first + 1 : Fs + 1;
+	int interior_last = (last < width - Fs - 1) ? last : width - Fs - 1;
+	int rgb[3];
+
+	// The first pixel and the left border are handled by the generic kernel
+	int j = (interior_first - 1 < last) ? interior_first - 1 : last;
+	oil_sliding_row(hist, src, bins, mask, dst, i, first, j);
+	for (++j; j <= interior_last; ++j){
+		oil_fixed_slide(hist, pixels, bins, width, i, j, Fs);
+		oil_histogram_evaluate(hist, rgb);
+		long p = 3*((long)i*width + j);
+		out[p] = rgb[0];
+		out[p + 1] = rgb[1];
+		out[p + 2] = rgb[2];
+	}
+	for (; j <= last; ++j){
+		oil_slide(hist, src, bins, mask, i, j, -Fs, Fs, 1);
+		oil_histogram_evaluate(hist, rgb);
+		for (int c = 0; c < 3; ++c) oil_image_set(dst, 3*((long)i*width + j) + c, rgb[c]);
+	}
+}
+
+// One row kernel per radius
+#define OIL_FIXED_ROW(FS) \
+static void oil_fixed_row_##FS(oil_histogram *hist, const oil_image *src, const unsigned short *bins, const oil_mask *mask, oil_image *dst, int i, int first, int last){ \
+	oil_fixed_row(hist, src, bins, mask, dst, i, first, last, FS); \
+}
+OIL_FIXED_ROW(1)
+OIL_FIXED_ROW(2)
+OIL_FIXED_ROW(3)
+OIL_FIXED_ROW(4)
+OIL_FIXED_ROW(5)
+OIL_FIXED_ROW(6)
+OIL_FIXED_ROW(7)
+OIL_FIXED_ROW(8)
+#undef OIL_FIXED_ROW
+
+static const oil_row_kernel oil_fixed_rows[OIL_FIXED_MAX_FS + 1] = {
+	NULL, oil_fixed_row_1, oil_fixed_row_2, oil_fixed_row_3, oil_fixed_row_4,
+	oil_fixed_row_5, oil_fixed_row_6, oil_fixed_row_7, oil_fixed_row_8
+};
+
+// Specialized row kernel for this image and radius, the generic one otherwise
+oil_row_kernel oil_fixed_row_kernel(const oil_image *src, int Fs){
+	if ((Fs >= 1) && (Fs <= OIL_FIXED_MAX_FS) && (src->pixels16 == NULL)) return oil_fixed_rows[Fs];
+	return oil_sliding_row;
+}
+
+
+/*============== Dispatching kernel ===================*/
+// Sliding-window kernel using the specialized code when there is one for Fs and Fl.
+// Gives the same image as oil_filter_naive.
+void oil_filter_fixed(const oil_image *src, oil_image *dst, int Fs, int Fl){
+	oil_mask mask;
+	oil_mask_init(&mask, Fs);
+	oil_filter_fixed_mask(src, dst, &mask, Fl);
+	oil_mask_free(&mask);
+}
+
+// Same, with a mask built once for several images
+void oil_filter_fixed_mask(const oil_image *src, oil_image *dst, const oil_mask *mask, int Fl){
+	int nbins = oil_nbins(src->depth, Fl);
+	int shift = oil_fixed_shift(Fl);
+	oil_row_kernel row_kernel = oil_fixed_row_kernel(src, mask->radius);
+	unsigned short *bins = malloc(sizeof(unsigned short) * (long)src->width*src->height);
+
+#pragma omp parallel
+	{
+		#pragma omp for
+		for (int i = 0; i < src->height; ++i){
+			if (shift >= 0) oil_bin_rows_shift(src, shift, bins, i, i+1);
+			else oil_bin_rows(src, Fl, bins, i, i+1);
+		}
+
+		oil_histogram hist;
+		oil_histogram_init(&hist, nbins);
+		#pragma omp for
+		for (int i = 0; i < src->height; ++i){
+			row_kernel(&hist, src, bins, mask, dst, i, 0, src->width - 1);
+		}
+		oil_histogram_free(&hist);
+	}
+	free(bins);
+}
+
+
+/*============== Library entry point ===================*/
+// Filters interleaved RGB samples, 'input' and 'output' holding 3*width*height samples:
+// unsigned char for depth < 256, unsigned short otherwise. Returns -1 on invalid parameters.
+int oil_filter_buffer(const void *input, void *output, int width, int height, int depth, int Fs, int Fl){
+	if ((width <= 0) || (height <= 0) || (depth <= 0) || (depth > 65535) || (Fs < 0) || (Fl <= 0)) return -1;
+	oil_image src, dst;
+	oil_image_wrap(&src, width, height, depth, (void *)input);
+	oil_image_wrap(&dst, width, height, depth, output);
+	oil_filter_fixed(&src, &dst, Fs, Fl);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_MPI_H
+#define OIL_MPI_H
+
+#include <mpi.h>
+#include <omp.h>
+#include "oil_filter.h"
+#include "oil_fixed.h"
+#include "ppm_io.h"
+
+/*=====================================================================================
+* Hybrid MPI + OpenMP filter for several nodes. The image is cut in bands of rows, one
+* per rank; each rank reads its band straight from the file with MPI-IO, gets the Fs
+* rows above and below it from its neighbours, filters the band with its OpenMP team
+* and writes it at its place in the output file. The output is the same as on one node.
+=====================================================================================*/
+
+// Structures
+// Wall time of each phase, the slowest rank is kept
+typedef struct oil_mpi_times oil_mpi_times;
+struct oil_mpi_times{
+	double read;
+	double exchange; // Halo rows
+	double filter;
+	double write;
+	double total;
+};
+
+// Rows held by a rank, in image rows
+typedef struct oil_band oil_band;
+struct oil_band{
+	int first_row; // The rank filters [first_row, last_row)
+	int last_row;
+	int halo_top; // # of rows held above first_row, at most Fs
+	int halo_bottom;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+void oil_band_init(oil_band *band, int height, int Fs, int rank, int nranks);
+int oil_mpi_header(ppm_file *file, const char *filename, MPI_Comm comm);
+int oil_filter_mpi(const char *filename, const char *oily_filename, int Fs, int Fl, MPI_Comm comm, oil_mpi_times *times);
+
+
+/*=====================================================================================*/
+
+
+/*============== Decomposition ===================*/
+// Balanced bands of contiguous rows
+void oil_band_init(oil_band *band, int height, int Fs, int rank, int nranks){
+	band->first_row = (int)((long)rank*height/nranks);
+	band->last_row = (int)((long)(rank + 1)*height/nranks);
+	band->halo_top = (band->first_row < Fs) ? band->first_row : Fs;
+	band->halo_bottom = (height - band->last_row < Fs) ? height - band->last_row : Fs;
+}
+
+// Parses the header on rank 0 and gives it to every rank
+int oil_mpi_header(ppm_file *file, const char *filename, MPI_Comm comm){
+	int rank, status = 0;
+	MPI_Comm_rank(comm, &rank);
+	if (rank == 0){
+		status = ppm_open_rows(file, filename);
+		if (status == 0) ppm_close(file);
+	}
+	MPI_Bcast(&status, 1, MPI_INT, 0, comm);
+	if (status != 0) return -1;
+	MPI_Bcast(file, sizeof(ppm_file), MPI_BYTE, 0, comm);
+	file->fd = -1;
+	file->map = NULL;
+	file->raster = NULL;
+	file->stream = NULL;
+	return 0;
+}
+
+
+/*============== Hybrid filter ===================*/
+// Filters a raw file (P5 or P6, 8 or 16 bits) into another one with every rank of comm.
+// 'times' gets the phases of the slowest rank.
+int oil_filter_mpi(const char *filename, const char *oily_filename, int Fs, int Fl, MPI_Comm comm, oil_mpi_times *times){
+	int rank, nranks;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &nranks);
+	oil_mpi_times local = {0.0, 0.0, 0.0, 0.0, 0.0};
+	MPI_Barrier(comm);
+	double begin = MPI_Wtime(), start = begin;
+
+	ppm_file input;
+	if (oil_mpi_header(&input, filename, comm) != 0) return -1;
+	int width = input.width, height = input.height, depth = input.maxval;
+	long row_size = ppm_row_size(&input);
+	oil_band band;
+	oil_band_init(&band, height, Fs, rank, nranks);
+	int nrows = band.halo_top + (band.last_row - band.first_row) + band.halo_bottom;
+	MPI_Datatype row_type;
+	MPI_Type_contiguous(row_size, MPI_BYTE, &row_type);
+	MPI_Type_commit(&row_type);
+
+	// Band, read by every rank at once
+	unsigned char *raw = malloc(nrows*row_size);
+	unsigned char *out = malloc(nrows*row_size);
+	MPI_File file;
+	if (MPI_File_open(comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS){
+		if (rank == 0) fprintf(stderr, "!!! Error while opening %s.\n", filename);
+		return -1;
+	}
+	MPI_Offset offset = input.header_size + (MPI_Offset)band.first_row*row_size;
+	MPI_File_read_at_all(file, offset, raw + band.halo_top*row_size, band.last_row - band.first_row, row_type, MPI_STATUS_IGNORE);
+	local.read = MPI_Wtime() - start;
+
+	// Halos: the neighbours hold them when every band has at least Fs rows,
+	// otherwise a halo may span several bands and is read from the file
+	start = MPI_Wtime();
+	if (height/nranks >= Fs){
+		int above = (rank > 0) ? rank - 1 : MPI_PROC_NULL;
+		int below = (rank < nranks - 1) ? rank + 1 : MPI_PROC_NULL;
+		int band_rows = band.last_row - band.first_row;
+		MPI_Sendrecv(raw + band.halo_top*row_size, band.halo_top, row_type, above, 0,
+		             raw + (band.halo_top + band_rows)*row_size, band.halo_bottom, row_type, below, 0, comm, MPI_STATUS_IGNORE);
+		MPI_Sendrecv(raw + (band.halo_top + band_rows - band.halo_bottom)*row_size, band.halo_bottom, row_type, below, 1,
+		             raw, band.halo_top, row_type, above, 1, comm, MPI_STATUS_IGNORE);
+	}
+	else{
+		MPI_File_read_at(file, input.header_size + (MPI_Offset)(band.first_row - band.halo_top)*row_size, raw, band.halo_top, row_type, MPI_STATUS_IGNORE);
+		MPI_File_read_at(file, input.header_size + (MPI_Offset)band.last_row*row_size, raw + (nrows - band.halo_bottom)*row_size, band.halo_bottom, row_type, MPI_STATUS_IGNORE);
+	}
+	MPI_File_close(&file);
+	local.exchange = MPI_Wtime() - start;
+
+	// The band and its halos are filtered as an image of their own, like a strip of oil_filter_stream
+	start = MPI_Wtime();
+	int in_place = (input.magic == '6') && (depth < 256);
+	oil_image src, dst;
+	if (in_place){
+		oil_image_wrap(&src, width, nrows, depth, raw);
+		oil_image_wrap(&dst, width, nrows, depth, out);
+	}
+	else{
+		oil_image_init(&src, width, nrows, depth);
+		oil_image_init(&dst, width, nrows, depth);
+	}
+	unsigned short *bins = malloc(sizeof(unsigned short) * (long)nrows*width);
+	oil_mask mask;
+	oil_mask_init(&mask, Fs);
+	oil_row_kernel row_kernel = oil_fixed_row_kernel(&src, Fs);
+	int first = band.halo_top, last = nrows - band.halo_bottom;
+
+	#pragma omp parallel
+	{
+		if (!in_place){
+			#pragma omp for
+			for (int i = 0; i < nrows; ++i) ppm_decode_rows(&input, raw, &src, i, i+1);
+		}
+		#pragma omp for
+		for (int i = 0; i < nrows; ++i) oil_bin_rows(&src, Fl, bins, i, i+1);
+
+		oil_histogram hist;
+		oil_histogram_init(&hist, oil_nbins(depth, Fl));
+		#pragma omp for schedule(dynamic, 4)
+		for (int i = first; i < last; ++i) row_kernel(&hist, &src, bins, &mask, &dst, i, 0, width - 1);
+		oil_histogram_free(&hist);
+
+		if (!in_place){
+			#pragma omp for
+			for (int i = first; i < last; ++i) ppm_encode_rows(&input, &dst, out, i, i+1);
+		}
+	}
+	local.filter = MPI_Wtime() - start;
+
+	// Every rank writes its band at its place, rank 0 also writes the header
+	start = MPI_Wtime();
+	char header[64];
+	int header_size = sprintf(header, "P%c\n%d %d\n%d\n", input.magic, width, height, depth);
+	int status = MPI_File_open(comm, oily_filename, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &file);
+	if (status == MPI_SUCCESS){
+		MPI_File_set_size(file, header_size + (MPI_Offset)height*row_size);
+		if (rank == 0) MPI_File_write_at(file, 0, header, header_size, MPI_BYTE, MPI_STATUS_IGNORE);
+		offset = header_size + (MPI_Offset)band.first_row*row_size;
+		MPI_File_write_at_all(file, offset, out + first*row_size, last - first, row_type, MPI_STATUS_IGNORE);
+		MPI_File_close(&file);
+	}
+	else if (rank == 0) fprintf(stderr, "!!! Error while creating %s.\n", oily_filename);
+	local.write = MPI_Wtime() - start;
+	local.total = MPI_Wtime() - begin;
+
+	// Clean-up
+	if (!in_place){
+		oil_image_free(&src);
+		oil_image_free(&dst);
+	}
+	free(bins);
+	free(raw);
+	free(out);
+	oil_mask_free(&mask);
+	MPI_Type_free(&row_type);
+	MPI_Reduce(&local, times, 5, MPI_DOUBLE, MPI_MAX, 0, comm);
+	return (status == MPI_SUCCESS) ? 0 : -1;
+}
+
+#endif
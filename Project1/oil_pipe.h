@@ -0,0 +1,232 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_PIPE_H
+#define OIL_PIPE_H
+
+#include <pthread.h>
+#include <omp.h>
+#include "oil_filter.h"
+#include "oil_queue.h"
+#include "ppm_io.h"
+
+/*=====================================================================================
+* Pipe mode: filters a stream of concatenated raw frames (P6 or P5) read from stdin and
+* writes the filtered frames to stdout, e.g. decoder | Main - Fs Fl | encoder.
+* Two input and two output frame buffers are reused from one frame to the next: a
+* thread reads frame N+1 while the OpenMP team filters frame N and another thread
+* writes frame N-1. stdout only carries frames, the statistics go to stderr.
+=====================================================================================*/
+
+#define OIL_PIPE_BUFFERS 2 // Double buffering on each side of the filter
+
+// Structures
+typedef struct oil_frame oil_frame;
+struct oil_frame{
+	ppm_file header; // Format of the frame, no file behind it
+	unsigned char *raw; // Raster as stored in the stream
+	long capacity; // Size of raw, grown when a larger frame comes
+	long number; // Position of the frame in the stream
+	double arrival; // When its header was read, for the latency
+};
+
+typedef struct oil_pipe oil_pipe;
+struct oil_pipe{
+	FILE *input;
+	FILE *output;
+	oil_frame inputs[OIL_PIPE_BUFFERS];
+	oil_frame outputs[OIL_PIPE_BUFFERS];
+	oil_queue free_inputs; // Input buffers ready to be read into
+	oil_queue read; // Frames ready to be filtered, closed at the end of the stream
+	oil_queue free_outputs;
+	oil_queue filtered; // Frames ready to be written, closed after the last one
+	long frames; // # of frames written
+	long pixels;
+	double latency_sum; // Arrival to write completion
+	double latency_max;
+	int error;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+void oil_frame_reserve(oil_frame *frame, long size);
+void *oil_pipe_reader(void *arg);
+void *oil_pipe_writer(void *arg);
+int oil_filter_pipe(FILE *input, FILE *output, int Fs, int Fl);
+
+
+/*=====================================================================================*/
+
+
+/*============== Frame buffers ===================*/
+// Makes room for a raster of 'size' bytes
+void oil_frame_reserve(oil_frame *frame, long size){
+	if (size <= frame->capacity) return;
+	free(frame->raw);
+	frame->raw = malloc(size);
+	frame->capacity = size;
+}
+
+
+/*============== Pipeline stages ===================*/
+// Reads the frames until the end of the stream
+void *oil_pipe_reader(void *arg){
+	oil_pipe *pipe = arg;
+	for (long number = 0; !pipe->error; ++number){
+		int c;
+		do c = getc(pipe->input); while ((c == ' ') || (c == '\t') || (c == '\n') || (c == '\r')); // Some writers end the raster with a newline
+		if (c == EOF) break; // Clean end of the stream, between two frames
+		ungetc(c, pipe->input);
+
+		oil_frame *frame = oil_queue_pop(&pipe->free_inputs);
+		frame->arrival = omp_get_wtime();
+		frame->number = number;
+		memset(&frame->header, 0, sizeof(ppm_file));
+		frame->header.fd = -1;
+		ppm_source src = {NULL, 0, 0, pipe->input};
+		if (ppm_parse_header(&src, &frame->header) != 0){
+			pipe->error = 1;
+			break;
+		}
+		if ((frame->header.magic != '5') && (frame->header.magic != '6')){
+			fprintf(stderr, "!!! Frame %ld: only raw frames (P5, P6) can be streamed.\n", number);
+			pipe->error = 1;
+			break;
+		}
+		long size = ppm_raster_size(&frame->header);
+		oil_frame_reserve(frame, size);
+		if ((long)fread(frame->raw, 1, size, pipe->input) != size){
+			fprintf(stderr, "!!! Frame %ld is truncated.\n", number);
+			pipe->error = 1;
+			break;
+		}
+		oil_queue_push(&pipe->read, frame);
+	}
+	oil_queue_close(&pipe->read);
+	return NULL;
+}
+
+// Writes each filtered frame as soon as it is ready
+void *oil_pipe_writer(void *arg){
+	oil_pipe *pipe = arg;
+	oil_frame *frame;
+	int failed = 0; // The frames filtered before an error in the input are still written
+	while ((frame = oil_queue_pop(&pipe->filtered)) != NULL){
+		const ppm_file *header = &frame->header;
+		long size = ppm_raster_size(header);
+		if (!failed){
+			fprintf(pipe->output, "P%c\n%d %d\n%d\n", header->magic, header->width, header->height, header->maxval);
+			if (((long)fwrite(frame->raw, 1, size, pipe->output) != size) || (fflush(pipe->output) != 0)){
+				fprintf(stderr, "!!! Error while writing frame %ld.\n", frame->number);
+				failed = 1;
+			}
+		}
+		double latency = omp_get_wtime() - frame->arrival;
+		pipe->latency_sum += latency;
+		if (latency > pipe->latency_max) pipe->latency_max = latency;
+		pipe->frames++;
+		pipe->pixels += (long)header->width*header->height;
+		fprintf(stderr, "Frame %ld: %d x %d, latency %.2lf ms\n", frame->number, header->width, header->height, 1e3*latency);
+		oil_queue_push(&pipe->free_outputs, frame);
+	}
+	if (failed) pipe->error = 1;
+	return NULL;
+}
+
+
+/*============== Pipe filter ===================*/
+// Filters every frame of 'input' into 'output', until the end of the stream.
+// Each frame gives the same image as the in-memory kernels.
+int oil_filter_pipe(FILE *input, FILE *output, int Fs, int Fl){
+	oil_pipe pipe;
+	memset(&pipe, 0, sizeof(oil_pipe));
+	pipe.input = input;
+	pipe.output = output;
+	oil_queue_init(&pipe.free_inputs, OIL_PIPE_BUFFERS);
+	oil_queue_init(&pipe.read, OIL_PIPE_BUFFERS);
+	oil_queue_init(&pipe.free_outputs, OIL_PIPE_BUFFERS);
+	oil_queue_init(&pipe.filtered, OIL_PIPE_BUFFERS);
+	for (int b = 0; b < OIL_PIPE_BUFFERS; ++b){
+		oil_queue_push(&pipe.free_inputs, &pipe.inputs[b]);
+		oil_queue_push(&pipe.free_outputs, &pipe.outputs[b]);
+	}
+	oil_mask mask;
+	oil_mask_init(&mask, Fs); // Shared by every frame
+	oil_image decoded, filtered; // Only used by the frames that cannot be filtered in place
+	memset(&decoded, 0, sizeof(oil_image));
+	memset(&filtered, 0, sizeof(oil_image));
+	double filter_time = 0.0;
+
+	double begin = omp_get_wtime();
+	pthread_t reader, writer;
+	pthread_create(&reader, NULL, oil_pipe_reader, &pipe);
+	pthread_create(&writer, NULL, oil_pipe_writer, &pipe);
+
+	oil_frame *frame;
+	while ((frame = oil_queue_pop(&pipe.read)) != NULL){
+		oil_frame *out = oil_queue_pop(&pipe.free_outputs);
+		double filter_begin = omp_get_wtime();
+		ppm_file *header = &frame->header;
+		int width = header->width, height = header->height, depth = header->maxval;
+		out->header = *header;
+		out->number = frame->number;
+		out->arrival = frame->arrival;
+		oil_frame_reserve(out, ppm_raster_size(header));
+
+		// An 8-bit P6 frame is filtered in place, the other ones go through converted images
+		oil_image src, dst;
+		if ((header->magic == '6') && (depth < 256)){
+			oil_image_wrap(&src, width, height, depth, frame->raw);
+			oil_image_wrap(&dst, width, height, depth, out->raw);
+			oil_filter_sliding_mask(&src, &dst, &mask, Fl);
+		}
+		else{
+			if ((decoded.width != width) || (decoded.height != height) || (decoded.depth != depth)){
+				oil_image_free(&decoded);
+				oil_image_free(&filtered);
+				oil_image_init(&decoded, width, height, depth);
+				oil_image_init(&filtered, width, height, depth);
+			}
+			#pragma omp parallel for
+			for (int i = 0; i < height; ++i) ppm_decode_rows(header, frame->raw, &decoded, i, i+1);
+			oil_filter_sliding_mask(&decoded, &filtered, &mask, Fl);
+			#pragma omp parallel for
+			for (int i = 0; i < height; ++i) ppm_encode_rows(header, &filtered, out->raw, i, i+1);
+		}
+		filter_time += omp_get_wtime() - filter_begin;
+		oil_queue_push(&pipe.free_inputs, frame);
+		oil_queue_push(&pipe.filtered, out);
+	}
+	oil_queue_close(&pipe.filtered);
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	double elapsed = omp_get_wtime() - begin;
+	if (pipe.frames > 0){
+		fprintf(stderr, "Filtered %ld frames in %.4lf s: %.2lf frames/s, %.2lf Mpixels/s, filter: %.2lf ms/frame, latency: %.2lf ms mean, %.2lf ms max, using %d threads.\n",
+			pipe.frames, elapsed, pipe.frames/elapsed, pipe.pixels/elapsed/1e6, 1e3*filter_time/pipe.frames,
+			1e3*pipe.latency_sum/pipe.frames, 1e3*pipe.latency_max, omp_get_max_threads());
+	}
+
+	// Clean-up
+	for (int b = 0; b < OIL_PIPE_BUFFERS; ++b){
+		free(pipe.inputs[b].raw);
+		free(pipe.outputs[b].raw);
+	}
+	oil_image_free(&decoded);
+	oil_image_free(&filtered);
+	oil_mask_free(&mask);
+	oil_queue_free(&pipe.free_inputs);
+	oil_queue_free(&pipe.read);
+	oil_queue_free(&pipe.free_outputs);
+	oil_queue_free(&pipe.filtered);
+	return pipe.error ? -1 : 0;
+}
+
+#endif
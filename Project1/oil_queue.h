@@ -0,0 +1,98 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_QUEUE_H
+#define OIL_QUEUE_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/*=====================================================================================
+* Bounded blocking FIFO of pointers, used to chain the stages of the I/O pipelines.
+* A full queue blocks the producer, which bounds the memory held between two stages.
+=====================================================================================*/
+
+// Structure
+typedef struct oil_queue oil_queue;
+struct oil_queue{
+	void **items;
+	int capacity;
+	int head; // Index of the oldest item
+	int count;
+	int closed; // No more items will be pushed
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+void oil_queue_init(oil_queue *queue, int capacity);
+void oil_queue_push(oil_queue *queue, void *item);
+void *oil_queue_pop(oil_queue *queue);
+void oil_queue_close(oil_queue *queue);
+void oil_queue_free(oil_queue *queue);
+
+
+/*=====================================================================================*/
+
+
+void oil_queue_init(oil_queue *queue, int capacity){
+	queue->items = malloc(sizeof(void *) * capacity);
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+
+// Appends an item, waits while the queue is full
+void oil_queue_push(oil_queue *queue, void *item){
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity) pthread_cond_wait(&queue->not_full, &queue->lock);
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+// Takes the oldest item, waits while the queue is empty.
+// Returns NULL once the queue is closed and every item has been taken.
+void *oil_queue_pop(oil_queue *queue){
+	pthread_mutex_lock(&queue->lock);
+	while ((queue->count == 0) && !queue->closed) pthread_cond_wait(&queue->not_empty, &queue->lock);
+	void *item = NULL;
+	if (queue->count > 0){
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+// Wakes up the consumers waiting on an empty queue, they get NULL
+void oil_queue_close(oil_queue *queue){
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void oil_queue_free(oil_queue *queue){
+	free(queue->items);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+#endif
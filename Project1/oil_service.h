@@ -0,0 +1,366 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_SERVICE_H
+#define OIL_SERVICE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <omp.h>
+#include "oil_filter.h"
+#include "oil_fixed.h"
+#include "oil_bench.h"
+
+/*=====================================================================================
+* Filter service: a long-running process answering filter requests over a Unix socket.
+* The process, the OpenMP team and the masks stay alive between the requests.
+* The images are not sent through the socket: the client puts the input samples in a
+* shared memory segment followed by room for the output, and passes its descriptor
+* with the request (SCM_RIGHTS). The service filters from one half into the other and
+* only replies with a status. The latency of the last requests is kept for p50/p99.
+=====================================================================================*/
+
+#define OIL_SERVICE_SAMPLES 4096 // # of latencies kept for the percentiles
+#define OIL_SERVICE_MAX_FS 64 // Masks kept for Fs <= OIL_SERVICE_MAX_FS
+#define OIL_SERVICE_LIMIT_FS 1024 // Larger filters are refused
+#define OIL_SERVICE_TIMEOUT 5 // Seconds a client may stay silent before it is dropped
+
+enum { OIL_REQUEST_FILTER = 1, OIL_REQUEST_STATS = 2, OIL_REQUEST_STOP = 3 };
+
+// Structures
+typedef struct oil_request oil_request;
+struct oil_request{
+	int type;
+	int width; // Samples of the segment: 3*width*height input samples, then as many output samples
+	int height;
+	int depth;
+	int Fs;
+	int Fl;
+};
+
+typedef struct oil_reply oil_reply;
+struct oil_reply{
+	int status; // 0 when the request succeeded
+	double filter_time; // Seconds
+	long requests; // Statistics since the start of the service
+	double p50; // Latency percentiles over the last requests, seconds
+	double p99;
+	double max;
+};
+
+typedef struct oil_service oil_service;
+struct oil_service{
+	int listener;
+	char path[108];
+	oil_mask *masks[OIL_SERVICE_MAX_FS + 1]; // Built on first use
+	double latencies[OIL_SERVICE_SAMPLES]; // Ring buffer
+	long requests;
+	int running;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int oil_write_full(int fd, const void *data, long size);
+int oil_read_full(int fd, void *data, long size);
+int oil_send_with_fd(int sock, const void *data, long size, int fd);
+int oil_recv_with_fd(int sock, void *data, long size, int *fd);
+long oil_segment_size(int width, int height, int depth);
+void *oil_segment_create(long size, int *fd);
+/*==============*/
+int oil_service_open(oil_service *service, const char *path);
+double oil_service_percentile(const oil_service *service, double q);
+int oil_service_handle(oil_service *service, int client);
+void oil_service_run(oil_service *service);
+void oil_service_close(oil_service *service);
+/*==============*/
+int oil_client_connect(const char *path);
+int oil_client_filter(int sock, int segment, int width, int height, int depth, int Fs, int Fl, oil_reply *reply);
+int oil_client_request(int sock, int type, oil_reply *reply);
+
+
+/*=====================================================================================*/
+
+
+/*============== Transport ===================*/
+int oil_write_full(int fd, const void *data, long size){
+	long done = 0;
+	while (done < size){
+		ssize_t n = write(fd, (const char *)data + done, size - done);
+		if (n <= 0) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+// Returns 1 when the peer closed the connection before the first byte
+int oil_read_full(int fd, void *data, long size){
+	long done = 0;
+	while (done < size){
+		ssize_t n = read(fd, (char *)data + done, size - done);
+		if (n == 0) return (done == 0) ? 1 : -1;
+		if (n < 0) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+// Sends a message with a file descriptor attached
+int oil_send_with_fd(int sock, const void *data, long size, int fd){
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = {(void *)data, size};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return (sendmsg(sock, &msg, 0) == size) ? 0 : -1;
+}
+
+// Receives a message, *fd is the attached descriptor or -1.
+// Returns 1 when the peer closed the connection.
+int oil_recv_with_fd(int sock, void *data, long size, int *fd){
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {data, size};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	*fd = -1;
+	ssize_t n = recvmsg(sock, &msg, 0);
+	if (n == 0) return 1;
+	if (n < 0) return -1;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	// The descriptor comes with the first byte, the rest may follow
+	if ((n < size) && (oil_read_full(sock, (char *)data + n, size - n) != 0)){
+		if (*fd >= 0) close(*fd);
+		return -1;
+	}
+	return 0;
+}
+
+// Size of the shared segment of a request: the input samples, then the output samples
+long oil_segment_size(int width, int height, int depth){
+	return 2 * 3*(long)width*height * ((depth < 256) ? sizeof(unsigned char) : sizeof(unsigned short));
+}
+
+// Creates and maps an anonymous shared memory segment, *fd is its descriptor
+void *oil_segment_create(long size, int *fd){
+	char name[64];
+	static int counter = 0;
+	snprintf(name, sizeof(name), "/oil-%ld-%d", (long)getpid(), counter++);
+	*fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (*fd < 0){
+		fprintf(stderr, "!!! Could not create the shared memory segment %s.\n", name);
+		return NULL;
+	}
+	shm_unlink(name); // Only reachable through the descriptor from now on
+	void *data = MAP_FAILED;
+	if (ftruncate(*fd, size) == 0) data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (data == MAP_FAILED){
+		fprintf(stderr, "!!! Could not map %ld bytes of shared memory.\n", size);
+		close(*fd);
+		*fd = -1;
+		return NULL;
+	}
+	return data;
+}
+
+
+/*============== Service ===================*/
+// Creates the socket and warms the OpenMP team up
+int oil_service_open(oil_service *service, const char *path){
+	memset(service, 0, sizeof(oil_service));
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "!!! Socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	strcpy(service->path, path);
+	service->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path); // Left by a previous run
+	if ((service->listener < 0) || (bind(service->listener, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(service->listener, 16) != 0)){
+		fprintf(stderr, "!!! Could not listen on %s.\n", path);
+		if (service->listener >= 0) close(service->listener);
+		return -1;
+	}
+	// A client leaving before its reply must not kill the service: the write fails with EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+	int nthreads = 0;
+	#pragma omp parallel
+	{
+		#pragma omp atomic
+		nthreads++;
+	}
+	printf("Listening on %s with %d threads\n", path, nthreads);
+	service->running = 1;
+	return 0;
+}
+
+// Latency below which a fraction q of the last requests fall
+static int oil_service_compare(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+double oil_service_percentile(const oil_service *service, double q){
+	long n = (service->requests < OIL_SERVICE_SAMPLES) ? service->requests : OIL_SERVICE_SAMPLES;
+	if (n == 0) return 0.0;
+	double sorted[OIL_SERVICE_SAMPLES];
+	memcpy(sorted, service->latencies, sizeof(double) * n);
+	qsort(sorted, n, sizeof(double), oil_service_compare);
+	long rank = (long)(q*n + 0.999999) - 1; // Nearest rank
+	if (rank < 0) rank = 0;
+	if (rank >= n) rank = n - 1;
+	return sorted[rank];
+}
+
+// Answers the requests of one client until it disconnects.
+// Returns 1 when the client asked the service to stop.
+int oil_service_handle(oil_service *service, int client){
+	while (1){
+		oil_request request;
+		oil_reply reply;
+		int segment;
+		if (oil_recv_with_fd(client, &request, sizeof(request), &segment) != 0) return 0;
+		double begin = oil_wtime();
+		memset(&reply, 0, sizeof(reply));
+
+		if (request.type == OIL_REQUEST_FILTER){
+			long size = oil_segment_size(request.width, request.height, request.depth);
+			struct stat properties;
+			unsigned char *data = MAP_FAILED;
+			if ((segment >= 0) && (request.width > 0) && (request.height > 0) && (request.depth > 0) && (request.depth <= 65535)
+			    && (request.Fs >= 0) && (request.Fs <= OIL_SERVICE_LIMIT_FS) && (request.Fl > 0) && (request.Fl <= request.depth)
+			    && (fstat(segment, &properties) == 0) && (properties.st_size >= size)){
+				data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment, 0);
+			}
+			if (data == MAP_FAILED) reply.status = -1;
+			else{
+				oil_image src, dst;
+				oil_image_wrap(&src, request.width, request.height, request.depth, data);
+				oil_image_wrap(&dst, request.width, request.height, request.depth, data + size/2);
+				oil_mask local, *mask = &local;
+				if (request.Fs <= OIL_SERVICE_MAX_FS){
+					if (service->masks[request.Fs] == NULL){
+						service->masks[request.Fs] = malloc(sizeof(oil_mask));
+						oil_mask_init(service->masks[request.Fs], request.Fs);
+					}
+					mask = service->masks[request.Fs];
+				}
+				else oil_mask_init(&local, request.Fs);
+				oil_filter_fixed_mask(&src, &dst, mask, request.Fl);
+				if (mask == &local) oil_mask_free(&local);
+				munmap(data, size);
+			}
+			reply.filter_time = oil_wtime() - begin;
+		}
+		else if (request.type == OIL_REQUEST_STOP) service->running = 0;
+		else if (request.type != OIL_REQUEST_STATS) reply.status = -1;
+		if (segment >= 0) close(segment);
+
+		if (request.type == OIL_REQUEST_FILTER){
+			service->latencies[service->requests % OIL_SERVICE_SAMPLES] = oil_wtime() - begin;
+			service->requests++;
+		}
+		reply.requests = service->requests;
+		reply.p50 = oil_service_percentile(service, 0.50);
+		reply.p99 = oil_service_percentile(service, 0.99);
+		reply.max = oil_service_percentile(service, 1.0);
+		if (oil_write_full(client, &reply, sizeof(reply)) != 0) return 0; // EPIPE or timeout: the client is dropped
+		if (!service->running) return 1;
+	}
+}
+
+// Serves the clients one after the other, each request using the whole team,
+// until a stop request. A client silent for OIL_SERVICE_TIMEOUT seconds is dropped,
+// so that it does not hold the others back.
+void oil_service_run(oil_service *service){
+	struct timeval timeout = {OIL_SERVICE_TIMEOUT, 0};
+	while (service->running){
+		int client = accept(service->listener, NULL, NULL);
+		if (client < 0) continue;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		oil_service_handle(service, client);
+		close(client);
+	}
+	printf("Served %ld requests, latency p50: %.3lf ms, p99: %.3lf ms\n", service->requests,
+		1e3*oil_service_percentile(service, 0.50), 1e3*oil_service_percentile(service, 0.99));
+}
+
+void oil_service_close(oil_service *service){
+	for (int Fs = 0; Fs <= OIL_SERVICE_MAX_FS; ++Fs){
+		if (service->masks[Fs] == NULL) continue;
+		oil_mask_free(service->masks[Fs]);
+		free(service->masks[Fs]);
+	}
+	close(service->listener);
+	unlink(service->path);
+}
+
+
+/*============== Client ===================*/
+int oil_client_connect(const char *path){
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((sock < 0) || (connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0)){
+		fprintf(stderr, "!!! Could not connect to %s.\n", path);
+		if (sock >= 0) close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Asks the service to filter the first half of a segment into its second half
+int oil_client_filter(int sock, int segment, int width, int height, int depth, int Fs, int Fl, oil_reply *reply){
+	oil_request request = {OIL_REQUEST_FILTER, width, height, depth, Fs, Fl};
+	if ((oil_send_with_fd(sock, &request, sizeof(request), segment) != 0) || (oil_read_full(sock, reply, sizeof(oil_reply)) != 0)){
+		fprintf(stderr, "!!! The service did not answer.\n");
+		return -1;
+	}
+	return reply->status;
+}
+
+// Statistics or stop request
+int oil_client_request(int sock, int type, oil_reply *reply){
+	oil_request request = {type, 0, 0, 0, 0, 0};
+	if ((oil_write_full(sock, &request, sizeof(request)) != 0) || (oil_read_full(sock, reply, sizeof(oil_reply)) != 0)){
+		fprintf(stderr, "!!! The service did not answer.\n");
+		return -1;
+	}
+	return reply->status;
+}
+
+#endif
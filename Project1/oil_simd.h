@@ -0,0 +1,262 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_SIMD_H
+#define OIL_SIMD_H
+
+#include "oil_filter.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OIL_X86 1
+#include <immintrin.h>
+#else
+#define OIL_X86 0
+#endif
+
+/*=====================================================================================
+* Planar (one array per channel) layout of the image and the vectorized oil-filter kernel.
+* The AVX2 routines are compiled for AVX2 only and chosen at run time, the scalar
+* routines give the same results on any CPU.
+=====================================================================================*/
+
+// Structure
+// The planes are indexed by p = i*width + j
+typedef struct oil_planes oil_planes;
+struct oil_planes{
+	int width;
+	int height;
+	unsigned short *red;
+	unsigned short *green;
+	unsigned short *blue;
+	unsigned short *bins; // Intensity bin of every pixel
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int oil_cpu_has_avx2(void);
+/*==============*/
+void oil_bins_row(const unsigned short *red, const unsigned short *green, const unsigned short *blue, unsigned short *bins, int n, int Fl);
+void oil_divide_row(const double *num, const double *den, int *quot, int n);
+#if OIL_X86
+void oil_bins_row_avx2(const unsigned short *red, const unsigned short *green, const unsigned short *blue, unsigned short *bins, int n, int Fl);
+void oil_divide_row_avx2(const double *num, const double *den, int *quot, int n);
+#endif
+/*==============*/
+void oil_planes_init(oil_planes *planes, const oil_image *img, int Fl, int use_avx2);
+void oil_planes_free(oil_planes *planes);
+/*==============*/
+void oil_filter_planar(const oil_image *src, oil_image *dst, int Fs, int Fl, int use_avx2);
+
+
+/*=====================================================================================*/
+
+
+/*============== CPU detection ===================*/
+int oil_cpu_has_avx2(void){
+#if OIL_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+}
+
+
+/*============== Row routines, scalar ===================*/
+// Intensity bins of n pixels: (r+g+b)/(3*Fl)
+void oil_bins_row(const unsigned short *red, const unsigned short *green, const unsigned short *blue, unsigned short *bins, int n, int Fl){
+	int divisor = 3*Fl;
+	for (int j = 0; j < n; ++j){
+		bins[j] = (red[j] + green[j] + blue[j]) / divisor;
+	}
+}
+
+// Final division of the filter: quot = num/den for the 3 channels of n pixels.
+// num holds the 3 channels one after the other (num[c*n + j]), den is shared by the channels.
+void oil_divide_row(const double *num, const double *den, int *quot, int n){
+	for (int c = 0; c < 3; ++c){
+		for (int j = 0; j < n; ++j){
+			quot[c*n + j] = (long)num[c*n + j] / (long)den[j];
+		}
+	}
+}
+
+
+/*============== Row routines, AVX2 ===================*/
+#if OIL_X86
+// 16 pixels at a time. The sums are below 2^18, so the single precision quotient
+// truncates to the exact integer division.
+__attribute__((target("avx2")))
+void oil_bins_row_avx2(const unsigned short *red, const unsigned short *green, const unsigned short *blue, unsigned short *bins, int n, int Fl){
+	__m256 divisor = _mm256_set1_ps(3.0f*Fl);
+	int j = 0;
+	for (; j + 16 <= n; j += 16){
+		__m256i half[2];
+		for (int h = 0; h < 2; ++h){
+			__m256i r = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&red[j + 8*h]));
+			__m256i g = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&green[j + 8*h]));
+			__m256i b = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&blue[j + 8*h]));
+			__m256 sum = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_add_epi32(r, g), b));
+			half[h] = _mm256_cvttps_epi32(_mm256_div_ps(sum, divisor));
+		}
+		// packus works within 128-bit lanes, the permutation puts the 16 bins back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(half[0], half[1]), 0xD8);
+		_mm256_storeu_si256((__m256i *)&bins[j], packed);
+	}
+	oil_bins_row(&red[j], &green[j], &blue[j], &bins[j], n - j, Fl);
+}
+
+// 8 pixels (24 quotients) at a time. Both operands are integers below 2^53, so the
+// double precision quotient truncates to the exact integer division.
+__attribute__((target("avx2")))
+void oil_divide_row_avx2(const double *num, const double *den, int *quot, int n){
+	int j = 0;
+	for (; j + 8 <= n; j += 8){
+		__m256d d0 = _mm256_loadu_pd(&den[j]);
+		__m256d d1 = _mm256_loadu_pd(&den[j + 4]);
+		for (int c = 0; c < 3; ++c){
+			__m128i q0 = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_loadu_pd(&num[c*n + j]), d0));
+			__m128i q1 = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_loadu_pd(&num[c*n + j + 4]), d1));
+			_mm256_storeu_si256((__m256i *)&quot[c*n + j], _mm256_set_m128i(q1, q0));
+		}
+	}
+	for (; j < n; ++j){
+		for (int c = 0; c < 3; ++c) quot[c*n + j] = (long)num[c*n + j] / (long)den[j];
+	}
+}
+#endif
+
+
+/*============== Planar layout ===================*/
+// Splits the interleaved samples into one plane per channel and computes the intensity plane
+void oil_planes_init(oil_planes *planes, const oil_image *img, int Fl, int use_avx2){
+	int width = img->width, height = img->height;
+	long npixels = (long)width*height;
+	planes->width = width;
+	planes->height = height;
+	planes->red = malloc(sizeof(unsigned short) * npixels);
+	planes->green = malloc(sizeof(unsigned short) * npixels);
+	planes->blue = malloc(sizeof(unsigned short) * npixels);
+	planes->bins = malloc(sizeof(unsigned short) * npixels);
+
+	#pragma omp parallel for
+	for (int i = 0; i < height; ++i){
+		long row = (long)i*width;
+		if (img->pixels16 != NULL){
+			for (int j = 0; j < width; ++j){
+				planes->red[row + j] = img->pixels16[3*(row + j)];
+				planes->green[row + j] = img->pixels16[3*(row + j) + 1];
+				planes->blue[row + j] = img->pixels16[3*(row + j) + 2];
+			}
+		}
+		else{
+			for (int j = 0; j < width; ++j){
+				planes->red[row + j] = img->pixels[3*(row + j)];
+				planes->green[row + j] = img->pixels[3*(row + j) + 1];
+				planes->blue[row + j] = img->pixels[3*(row + j) + 2];
+			}
+		}
+#if OIL_X86
+		if (use_avx2) oil_bins_row_avx2(&planes->red[row], &planes->green[row], &planes->blue[row], &planes->bins[row], width, Fl);
+		else
+#endif
+		oil_bins_row(&planes->red[row], &planes->green[row], &planes->blue[row], &planes->bins[row], width, Fl);
+	}
+}
+
+void oil_planes_free(oil_planes *planes){
+	free(planes->red);
+	free(planes->green);
+	free(planes->blue);
+	free(planes->bins);
+}
+
+
+/*============== Planar kernel ===================*/
+static inline void oil_planes_add(oil_histogram *hist, const oil_planes *planes, long p){
+	oil_histogram_add(hist, planes->bins[p], planes->red[p], planes->green[p], planes->blue[p]);
+}
+
+static inline void oil_planes_remove(oil_histogram *hist, const oil_planes *planes, long p){
+	oil_histogram_remove(hist, planes->bins[p], planes->red[p], planes->green[p], planes->blue[p]);
+}
+
+// Same sliding window as oil_filter_sliding, reading the planar layout. The maxima of a
+// whole row are kept and divided together, then written back interleaved.
+// use_avx2 selects the vectorized row routines, the image is the same either way.
+void oil_filter_planar(const oil_image *src, oil_image *dst, int Fs, int Fl, int use_avx2){
+	int width = src->width, height = src->height;
+	int nbins = oil_nbins(src->depth, Fl);
+	oil_planes planes;
+	oil_planes_init(&planes, src, Fl, use_avx2);
+	oil_mask mask;
+	oil_mask_init(&mask, Fs);
+	int interior_first = Fs + 1;
+	int interior_last = width - Fs - 1;
+
+#pragma omp parallel
+	{
+		oil_histogram hist;
+		oil_histogram_init(&hist, nbins);
+		double *num = malloc(sizeof(double) * 3*width); // RGB maxima of the row, num[c*width + j]
+		double *den = malloc(sizeof(double) * width); // Count maxima of the row
+		int *quot = malloc(sizeof(int) * 3*width);
+		long RGB_max[3];
+
+		#pragma omp for
+		for (int i = 0; i < height; ++i){
+			int dy_first = (i - Fs < 0) ? -i : -Fs;
+			int dy_last = (i + Fs >= height) ? height - 1 - i : Fs;
+
+			// Fills the window of the first pixel of the row
+			oil_histogram_clear(&hist);
+			for (int dy = dy_first; dy <= dy_last; ++dy){
+				int w = mask.half_width[dy + Fs];
+				int last = (w >= width) ? width - 1 : w;
+				for (int x = 0; x <= last; ++x) oil_planes_add(&hist, &planes, (long)(i + dy)*width + x);
+			}
+
+			for (int j = 0; j < width; ++j){
+				// Slides it along the row
+				if (j > 0){
+					int clipped = (j < interior_first) || (j > interior_last);
+					for (int dy = dy_first; dy <= dy_last; ++dy){
+						int w = mask.half_width[dy + Fs];
+						long row = (long)(i + dy)*width;
+						if (!clipped || (j - 1 - w >= 0)) oil_planes_remove(&hist, &planes, row + j - 1 - w);
+						if (!clipped || (j + w < width)) oil_planes_add(&hist, &planes, row + j + w);
+					}
+				}
+				den[j] = oil_histogram_maxima(&hist, RGB_max);
+				num[j] = RGB_max[0];
+				num[width + j] = RGB_max[1];
+				num[2*width + j] = RGB_max[2];
+			}
+
+#if OIL_X86
+			if (use_avx2) oil_divide_row_avx2(num, den, quot, width);
+			else
+#endif
+			oil_divide_row(num, den, quot, width);
+
+			long row = (long)i*width;
+			for (int j = 0; j < width; ++j){
+				for (int c = 0; c < 3; ++c) oil_image_set(dst, 3*(row + j) + c, quot[c*width + j]);
+			}
+		}
+		free(num);
+		free(den);
+		free(quot);
+		oil_histogram_free(&hist);
+	}
+	oil_mask_free(&mask);
+	oil_planes_free(&planes);
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_STREAM_H
+#define OIL_STREAM_H
+
+#include <pthread.h>
+#include <omp.h>
+#include "oil_filter.h"
+#include "oil_queue.h"
+#include "ppm_io.h"
+
+/*=====================================================================================
+* Out-of-core filtering: the raw image is read, filtered and written by horizontal strips.
+* A strip buffer holds the rows it filters plus a halo of Fs rows on each side, the halo
+* shared with the previous strip is copied instead of being read again.
+* Three stages run at the same time: a thread reads the next strip, the OpenMP team
+* filters the current one and another thread writes the previous one. The memory used
+* only depends on the strip height, not on the image size.
+=====================================================================================*/
+
+#define OIL_STREAM_INPUTS 3 // Strip being read, strip being filtered, strip whose halo is copied
+#define OIL_STREAM_OUTPUTS 2 // Strip being filtered, strip being written
+
+// Structures
+typedef struct oil_strip oil_strip;
+struct oil_strip{
+	int first_row; // Row of the image held in the first row of the buffer
+	int nrows; // # of rows in the buffer, halos included
+	int out_first; // The rows [out_first, out_last) of the image come from this strip
+	int out_last;
+	unsigned char *raw; // Rows as stored in the file
+};
+
+typedef struct oil_stream oil_stream;
+struct oil_stream{
+	ppm_file input;
+	ppm_file output;
+	int Fs;
+	int strip_rows; // # of rows filtered per strip
+	int nstrips;
+	oil_strip inputs[OIL_STREAM_INPUTS];
+	oil_strip outputs[OIL_STREAM_OUTPUTS];
+	oil_queue free_inputs; // Input buffers ready to be read into
+	oil_queue read; // Strips ready to be filtered
+	oil_queue free_outputs;
+	oil_queue filtered; // Strips ready to be written
+	double read_time; // Time spent by each stage
+	double filter_time;
+	double write_time;
+	int error; // Set by the reader and the writer: read and written with __atomic builtins only
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+void *oil_stream_reader(void *arg);
+void *oil_stream_writer(void *arg);
+int oil_filter_stream(const char *filename, const char *oily_filename, int Fs, int Fl, int strip_rows);
+
+
+/*=====================================================================================*/
+
+
+/*============== Pipeline stages ===================*/
+// Reads the strips in order. The halo rows already held by the previous strip are copied.
+void *oil_stream_reader(void *arg){
+	oil_stream *stream = arg;
+	int height = stream->input.height;
+	long row_size = ppm_row_size(&stream->input);
+	oil_strip *previous = NULL;
+
+	for (int s = 0; s < stream->nstrips; ++s){
+		oil_strip *strip = oil_queue_pop(&stream->free_inputs);
+		double begin = omp_get_wtime();
+		strip->out_first = s*stream->strip_rows;
+		strip->out_last = (strip->out_first + stream->strip_rows < height) ? strip->out_first + stream->strip_rows : height;
+		strip->first_row = (strip->out_first - stream->Fs > 0) ? strip->out_first - stream->Fs : 0;
+		int last_row = (strip->out_last + stream->Fs < height) ? strip->out_last + stream->Fs : height;
+		strip->nrows = last_row - strip->first_row;
+
+		// The previous buffer is not recycled before this one is read, only this thread fills buffers
+		int copied = 0;
+		if (previous != NULL){
+			int previous_last = previous->first_row + previous->nrows;
+			copied = previous_last - strip->first_row;
+			if (copied > strip->nrows) copied = strip->nrows;
+			if (copied < 0) copied = 0;
+			memcpy(strip->raw, previous->raw + (strip->first_row - previous->first_row)*row_size, copied*row_size);
+		}
+		if (!__atomic_load_n(&stream->error, __ATOMIC_RELAXED) &&
+		    (ppm_read_rows(&stream->input, strip->raw + copied*row_size, strip->first_row + copied, strip->nrows - copied) != 0)){
+			__atomic_store_n(&stream->error, 1, __ATOMIC_RELAXED);
+		}
+		stream->read_time += omp_get_wtime() - begin;
+		oil_queue_push(&stream->read, strip);
+		previous = strip;
+	}
+	return NULL;
+}
+
+// Appends the filtered rows of each strip to the output file
+void *oil_stream_writer(void *arg){
+	oil_stream *stream = arg;
+	long row_size = ppm_row_size(&stream->output);
+
+	for (int s = 0; s < stream->nstrips; ++s){
+		oil_strip *strip = oil_queue_pop(&stream->filtered);
+		double begin = omp_get_wtime();
+		if (!__atomic_load_n(&stream->error, __ATOMIC_RELAXED) &&
+		    (ppm_append_rows(&stream->output, strip->raw + (strip->out_first - strip->first_row)*row_size, strip->out_last - strip->out_first) != 0)){
+			__atomic_store_n(&stream->error, 1, __ATOMIC_RELAXED);
+		}
+		stream->write_time += omp_get_wtime() - begin;
+		oil_queue_push(&stream->free_outputs, strip);
+	}
+	return NULL;
+}
+
+
+/*============== Streaming filter ===================*/
+// Filters a raw file into another one, strip_rows rows at a time.
+// Gives the same image as the in-memory kernels. Over the input, the output is written to
+// a temporary file renamed at the end, since the input is read until the last strip.
+int oil_filter_stream(const char *filename, const char *oily_filename, int Fs, int Fl, int strip_rows){
+	oil_stream stream;
+	memset(&stream, 0, sizeof(oil_stream));
+	if (ppm_open_rows(&stream.input, filename) != 0) return -1;
+	int width = stream.input.width, height = stream.input.height, depth = stream.input.maxval;
+	char *temp_filename = NULL;
+	if (ppm_same_file(filename, oily_filename) && ((temp_filename = ppm_temp_name(oily_filename)) == NULL)){
+		ppm_close(&stream.input);
+		return -1;
+	}
+	if (ppm_create_rows(&stream.output, (temp_filename != NULL) ? temp_filename : oily_filename, stream.input.magic, width, height, depth) != 0){
+		if (temp_filename != NULL) unlink(temp_filename);
+		free(temp_filename);
+		ppm_close(&stream.input);
+		return -1;
+	}
+	if (strip_rows > height) strip_rows = height;
+	stream.Fs = Fs;
+	stream.strip_rows = strip_rows;
+	stream.nstrips = (height + strip_rows - 1) / strip_rows;
+
+	// Buffers
+	int capacity = strip_rows + 2*Fs; // Rows of a strip, halos included
+	if (capacity > height) capacity = height;
+	long row_size = ppm_row_size(&stream.input);
+	oil_queue_init(&stream.free_inputs, OIL_STREAM_INPUTS);
+	oil_queue_init(&stream.read, OIL_STREAM_INPUTS);
+	oil_queue_init(&stream.free_outputs, OIL_STREAM_OUTPUTS);
+	oil_queue_init(&stream.filtered, OIL_STREAM_OUTPUTS);
+	for (int b = 0; b < OIL_STREAM_INPUTS; ++b){
+		stream.inputs[b].raw = malloc(capacity*row_size);
+		oil_queue_push(&stream.free_inputs, &stream.inputs[b]);
+	}
+	for (int b = 0; b < OIL_STREAM_OUTPUTS; ++b){
+		stream.outputs[b].raw = malloc(capacity*row_size);
+		oil_queue_push(&stream.free_outputs, &stream.outputs[b]);
+	}
+	// An 8-bit PPM strip is filtered in place, the other formats go through converted images
+	int in_place = (stream.input.magic == '6') && (depth < 256);
+	oil_image src, dst;
+	if (!in_place){
+		oil_image_init(&src, width, capacity, depth);
+		oil_image_init(&dst, width, capacity, depth);
+	}
+	unsigned short *bins = malloc(sizeof(unsigned short) * (long)capacity*width);
+	oil_mask mask;
+	oil_mask_init(&mask, Fs);
+	int nbins = oil_nbins(depth, Fl);
+	long memory = (OIL_STREAM_INPUTS + OIL_STREAM_OUTPUTS)*capacity*row_size + (long)capacity*width*sizeof(unsigned short);
+	if (!in_place) memory += 2*3*(long)capacity*width*((depth < 256) ? 1 : 2);
+	printf("Streaming %d strips of %d rows, buffers: %.1f MB\n", stream.nstrips, strip_rows, memory/1e6);
+
+	double begin = omp_get_wtime();
+	pthread_t reader, writer;
+	pthread_create(&reader, NULL, oil_stream_reader, &stream);
+	pthread_create(&writer, NULL, oil_stream_writer, &stream);
+
+	for (int s = 0; s < stream.nstrips; ++s){
+		oil_strip *strip = oil_queue_pop(&stream.read);
+		oil_strip *out = oil_queue_pop(&stream.free_outputs);
+		double filter_begin = omp_get_wtime();
+		out->first_row = strip->first_row;
+		out->nrows = strip->nrows;
+		out->out_first = strip->out_first;
+		out->out_last = strip->out_last;
+
+		// The strip is filtered as an image of its own: its halos hold every row the mask
+		// needs, and its first and last rows are the borders of the image only at the top and bottom
+		int first = strip->out_first - strip->first_row, last = strip->out_last - strip->first_row;
+		if (in_place){
+			oil_image_wrap(&src, width, strip->nrows, depth, strip->raw);
+			oil_image_wrap(&dst, width, strip->nrows, depth, out->raw);
+		}
+		else src.height = dst.height = strip->nrows;
+
+		#pragma omp parallel
+		{
+			if (!in_place){
+				#pragma omp for
+				for (int i = 0; i < strip->nrows; ++i) ppm_decode_rows(&stream.input, strip->raw, &src, i, i+1);
+			}
+			#pragma omp for
+			for (int i = 0; i < strip->nrows; ++i) oil_bin_rows(&src, Fl, bins, i, i+1);
+
+			oil_histogram hist;
+			oil_histogram_init(&hist, nbins);
+			#pragma omp for
+			for (int i = first; i < last; ++i) oil_sliding_row(&hist, &src, bins, &mask, &dst, i, 0, width - 1);
+			oil_histogram_free(&hist);
+
+			if (!in_place){
+				#pragma omp for
+				for (int i = first; i < last; ++i) ppm_encode_rows(&stream.output, &dst, out->raw, i, i+1);
+			}
+		}
+		stream.filter_time += omp_get_wtime() - filter_begin;
+		oil_queue_push(&stream.free_inputs, strip);
+		oil_queue_push(&stream.filtered, out);
+	}
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	double elapsed = omp_get_wtime() - begin;
+	printf("Read: %.4lf s, filter: %.4lf s, write: %.4lf s, total: %.4lf s\n", stream.read_time, stream.filter_time, stream.write_time, elapsed);
+
+	// Clean-up
+	for (int b = 0; b < OIL_STREAM_INPUTS; ++b) free(stream.inputs[b].raw);
+	for (int b = 0; b < OIL_STREAM_OUTPUTS; ++b) free(stream.outputs[b].raw);
+	if (!in_place){
+		oil_image_free(&src);
+		oil_image_free(&dst);
+	}
+	free(bins);
+	oil_mask_free(&mask);
+	oil_queue_free(&stream.free_inputs);
+	oil_queue_free(&stream.read);
+	oil_queue_free(&stream.free_outputs);
+	oil_queue_free(&stream.filtered);
+	ppm_close(&stream.input);
+	ppm_close(&stream.output);
+	int error = __atomic_load_n(&stream.error, __ATOMIC_RELAXED);
+	if (temp_filename != NULL){
+		if (error) unlink(temp_filename);
+		else if (rename(temp_filename, oily_filename) != 0){
+			fprintf(stderr, "!!! Could not rename %s to %s.\n", temp_filename, oily_filename);
+			error = 1;
+		}
+		free(temp_filename);
+	}
+	return error ? -1 : 0;
+}
+
+#endif
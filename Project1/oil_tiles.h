@@ -0,0 +1,187 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef OIL_TILES_H
+#define OIL_TILES_H
+
+#include <omp.h>
+#include "oil_filter.h"
+
+/*=====================================================================================
+* Tiled execution of the sliding-window filter.
+* The image is cut in tile_width x tile_height tiles, each one reading a halo of Fs
+* pixels around it. The tile rows are split in contiguous bands, one per thread: a
+* thread first-touches the output memory of its band, filters its own tiles first, then
+* steals the remaining tiles of the other threads. The input is not placed.
+=====================================================================================*/
+
+// Size of the cache the window of a tile should fit in
+#define OIL_CACHE_BYTES (256*1024)
+// The tile counters of two threads are kept on different cache lines
+#define OIL_COUNTER_STRIDE 16
+
+// Structure
+typedef struct oil_tiling oil_tiling;
+struct oil_tiling{
+	int width;
+	int height;
+	int halo; // Fs
+	int tile_width;
+	int tile_height;
+	int ntiles_x;
+	int ntiles_y;
+	int nthreads;
+	int *first_tile; // The thread t owns the tiles [first_tile[t], first_tile[t+1]), row-major
+	int *next_tile; // Next tile to hand out for each owner, next_tile[t*OIL_COUNTER_STRIDE]
+	int *stolen; // # of tiles each thread took from the others
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+void oil_tiling_init(oil_tiling *tiling, int width, int height, int Fs, int tile_width, int tile_height, int nthreads);
+void oil_tiling_rows(const oil_tiling *tiling, int thread, int *first_row, int *last_row);
+void oil_tiling_reset(oil_tiling *tiling);
+int oil_tiling_claim(oil_tiling *tiling, int thread);
+void oil_tiling_touch(const oil_tiling *tiling, oil_image *img);
+void oil_tiling_free(oil_tiling *tiling);
+/*==============*/
+void oil_filter_tiled(const oil_image *src, oil_image *dst, int Fs, int Fl, oil_tiling *tiling);
+
+
+/*=====================================================================================*/
+
+
+/*============== Tiling functions ===================*/
+// Cuts the image in tiles and hands the tile rows out to the threads.
+// A tile size <= 0 is chosen automatically: the window of a row of the tile,
+// 2*Fs+1 rows of tile_width+2*Fs pixels (3 samples and 1 bin each), fits in OIL_CACHE_BYTES.
+void oil_tiling_init(oil_tiling *tiling, int width, int height, int Fs, int tile_width, int tile_height, int nthreads){
+	if (tile_width <= 0){
+		tile_width = OIL_CACHE_BYTES / ((2*Fs + 1) * 8) - 2*Fs;
+		if (tile_width < 4*Fs) tile_width = 4*Fs; // Otherwise building the first window of each row dominates
+		if (tile_width < 64) tile_width = 64;
+	}
+	if (tile_width > width) tile_width = width;
+	if (tile_height <= 0) tile_height = 64;
+	if (tile_height > height) tile_height = height;
+
+	tiling->width = width;
+	tiling->height = height;
+	tiling->halo = Fs;
+	tiling->tile_width = tile_width;
+	tiling->tile_height = tile_height;
+	tiling->ntiles_x = (width + tile_width - 1) / tile_width;
+	tiling->ntiles_y = (height + tile_height - 1) / tile_height;
+	tiling->nthreads = nthreads;
+	tiling->first_tile = malloc(sizeof(int) * (nthreads + 1));
+	tiling->next_tile = malloc(sizeof(int) * nthreads*OIL_COUNTER_STRIDE);
+	tiling->stolen = malloc(sizeof(int) * nthreads);
+	for (int t = 0; t <= nthreads; ++t){
+		tiling->first_tile[t] = (int)((long)t*tiling->ntiles_y/nthreads) * tiling->ntiles_x;
+	}
+	oil_tiling_reset(tiling);
+}
+
+// Rows of the image owned by a thread, [first_row, last_row)
+void oil_tiling_rows(const oil_tiling *tiling, int thread, int *first_row, int *last_row){
+	*first_row = (tiling->first_tile[thread] / tiling->ntiles_x) * tiling->tile_height;
+	*last_row = (tiling->first_tile[thread+1] / tiling->ntiles_x) * tiling->tile_height;
+	if (*first_row > tiling->height) *first_row = tiling->height;
+	if (*last_row > tiling->height) *last_row = tiling->height;
+}
+
+// Makes every tile available again, before filtering another image
+void oil_tiling_reset(oil_tiling *tiling){
+	for (int t = 0; t < tiling->nthreads; ++t){
+		tiling->next_tile[t*OIL_COUNTER_STRIDE] = tiling->first_tile[t];
+		tiling->stolen[t] = 0;
+	}
+}
+
+// Hands out the next tile to a thread: its own tiles first, then the ones of the
+// following threads. Returns -1 once every tile is taken.
+int oil_tiling_claim(oil_tiling *tiling, int thread){
+	for (int s = 0; s < tiling->nthreads; ++s){
+		int owner = (thread + s) % tiling->nthreads;
+		int *next = &tiling->next_tile[owner*OIL_COUNTER_STRIDE];
+		int tile;
+		#pragma omp atomic read
+		tile = *next;
+		if (tile >= tiling->first_tile[owner+1]) continue; // Already exhausted, no need to write
+		#pragma omp atomic capture
+		tile = (*next)++;
+		if (tile < tiling->first_tile[owner+1]){
+			if (s > 0) tiling->stolen[thread]++;
+			return tile;
+		}
+	}
+	return -1;
+}
+
+// Writes the samples of each band from the thread owning it, so that the pages are
+// placed on the NUMA node of the thread that will filter them.
+// Only meant for the output: an 8-bit P6 input is a mapping of the file, whose pages sit
+// wherever the page cache put them (readahead from ppm_open, a previous run) and are not
+// moved by touching them, and the other inputs are placed by the threads decoding them.
+// Must be called from inside a parallel region with tiling->nthreads threads.
+void oil_tiling_touch(const oil_tiling *tiling, oil_image *img){
+	int first_row, last_row;
+	oil_tiling_rows(tiling, omp_get_thread_num(), &first_row, &last_row);
+	long first = 3*(long)first_row*img->width, last = 3*(long)last_row*img->width;
+	if (img->pixels16 != NULL) memset(&img->pixels16[first], 0, sizeof(unsigned short) * (last - first));
+	else memset(&img->pixels[first], 0, sizeof(unsigned char) * (last - first));
+}
+
+void oil_tiling_free(oil_tiling *tiling){
+	free(tiling->first_tile);
+	free(tiling->next_tile);
+	free(tiling->stolen);
+}
+
+
+/*============== Tiled kernel ===================*/
+// Sliding-window kernel run tile by tile. The team must have tiling->nthreads threads.
+// Gives the same image as oil_filter_naive.
+void oil_filter_tiled(const oil_image *src, oil_image *dst, int Fs, int Fl, oil_tiling *tiling){
+	int nbins = oil_nbins(src->depth, Fl);
+	unsigned short *bins = malloc(sizeof(unsigned short) * (long)src->width*src->height);
+	oil_mask mask;
+	oil_mask_init(&mask, Fs);
+	oil_tiling_reset(tiling);
+
+#pragma omp parallel num_threads(tiling->nthreads)
+	{
+		int thread = omp_get_thread_num();
+		// The runtime may give fewer threads than asked, the bands left are shared out
+		for (int t = thread; t < tiling->nthreads; t += omp_get_num_threads()){
+			int first_row, last_row;
+			oil_tiling_rows(tiling, t, &first_row, &last_row);
+			oil_bin_rows(src, Fl, bins, first_row, last_row);
+		}
+		oil_histogram hist;
+		oil_histogram_init(&hist, nbins);
+		#pragma omp barrier
+
+		int tile;
+		while ((tile = oil_tiling_claim(tiling, thread)) >= 0){
+			int x0 = (tile % tiling->ntiles_x) * tiling->tile_width;
+			int y0 = (tile / tiling->ntiles_x) * tiling->tile_height;
+			int x1 = (x0 + tiling->tile_width < src->width) ? x0 + tiling->tile_width : src->width;
+			int y1 = (y0 + tiling->tile_height < src->height) ? y0 + tiling->tile_height : src->height;
+			for (int i = y0; i < y1; ++i){
+				oil_sliding_row(&hist, src, bins, &mask, dst, i, x0, x1 - 1);
+			}
+		}
+		oil_histogram_free(&hist);
+	}
+	oil_mask_free(&mask);
+	free(bins);
+}
+
+#endif
@@ -0,0 +1,480 @@
+/*=======================================================================================
+*	This code was written by: Antonin Aumètre - antonin.aumetre@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 1
+*
+*	Under GNU General Public License 09/2018
+=======================================================================================*/
+
+#ifndef PPM_IO_H
+#define PPM_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "oil_filter.h"
+
+/*=====================================================================================
+* Reads and writes Netpbm images: PPM (P3 plain, P6 raw) and PGM (P2 plain, P5 raw),
+* 8 or 16 bits per sample, with comments in the header.
+* Files are memory-mapped: an 8-bit P6 raster is used in place by the filter, and raw
+* outputs are written straight into a mapped file of the final size.
+* Raw rasters can also be read and written a few rows at a time, for images that do
+* not fit in memory.
+* Reference: http://netpbm.sourceforge.net/doc/ppm.html
+=====================================================================================*/
+
+// Structures
+typedef struct ppm_file ppm_file;
+struct ppm_file{
+	char magic; // '2', '3', '5' or '6'
+	int channels; // 3 for PPM, 1 for PGM
+	int width;
+	int height;
+	int maxval;
+	int sample_size; // Bytes per sample in a raw raster, 1 or 2
+	long header_size; // # of bytes preceeding the raster
+	int fd;
+	unsigned char *map; // The whole file when it is mapped
+	long map_size;
+	unsigned char *raster; // First byte of the raster in the mapping
+	FILE *stream; // Used instead of the mapping for plain outputs
+};
+
+// Where the header parser takes its characters from: a memory area or a stream
+typedef struct ppm_source ppm_source;
+struct ppm_source{
+	const unsigned char *data;
+	long size;
+	long pos;
+	FILE *stream;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int ppm_getc(ppm_source *src);
+int ppm_read_int(ppm_source *src, int *value);
+int ppm_parse_header(ppm_source *src, ppm_file *file);
+long ppm_raster_size(const ppm_file *file);
+/*==============*/
+int ppm_open(ppm_file *file, const char *filename);
+int ppm_read_image(const ppm_file *file, oil_image *img);
+void ppm_decode_rows(const ppm_file *file, const unsigned char *raster, oil_image *img, int first_row, int last_row);
+/*==============*/
+int ppm_create(ppm_file *file, const char *filename, char magic, int width, int height, int maxval);
+int ppm_output_image(ppm_file *file, oil_image *img);
+void ppm_encode_rows(const ppm_file *file, const oil_image *img, unsigned char *raster, int first_row, int last_row);
+int ppm_write_image(ppm_file *file, const oil_image *img);
+/*==============*/
+long ppm_row_size(const ppm_file *file);
+int ppm_open_rows(ppm_file *file, const char *filename);
+int ppm_read_rows(const ppm_file *file, unsigned char *raw, int first_row, int nrows);
+int ppm_create_rows(ppm_file *file, const char *filename, char magic, int width, int height, int maxval);
+int ppm_append_rows(ppm_file *file, const unsigned char *raw, int nrows);
+/*==============*/
+void ppm_close(ppm_file *file);
+int ppm_same_file(const char *a, const char *b);
+char *ppm_temp_name(const char *filename);
+
+
+/*=====================================================================================*/
+
+
+/*============== Header parsing ===================*/
+// Next character of the source, EOF at the end
+int ppm_getc(ppm_source *src){
+	if (src->stream != NULL){
+		int c = getc(src->stream);
+		if (c != EOF) ++src->pos;
+		return c;
+	}
+	if (src->pos >= src->size) return EOF;
+	return src->data[src->pos++];
+}
+
+// Reads a decimal integer, skipping the whitespace and the comments in front of it
+// and consuming the single character that ends it
+int ppm_read_int(ppm_source *src, int *value){
+	int c = ppm_getc(src);
+	while (1){
+		if (c == '#'){ // Comment, up to the end of the line
+			while ((c != '\n') && (c != '\r') && (c != EOF)) c = ppm_getc(src);
+		}
+		else if ((c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\v') || (c == '\f')) c = ppm_getc(src);
+		else break;
+	}
+	if ((c < '0') || (c > '9')) return -1;
+	long result = 0;
+	while ((c >= '0') && (c <= '9')){
+		result = 10*result + (c - '0');
+		if (result > 1000000000L) return -1;
+		c = ppm_getc(src);
+	}
+	*value = result;
+	return 0;
+}
+
+// Parses "P<n> <width> <height> <maxval>" followed by a single whitespace.
+// After the call, src->pos is the size of the header.
+int ppm_parse_header(ppm_source *src, ppm_file *file){
+	if (ppm_getc(src) != 'P'){
+		fprintf(stderr, "!!! Not a Netpbm file.\n");
+		return -1;
+	}
+	file->magic = ppm_getc(src);
+	switch (file->magic){
+		case '2': case '5': file->channels = 1; break;
+		case '3': case '6': file->channels = 3; break;
+		default:
+			fprintf(stderr, "!!! Unsupported format P%c, only P2, P3, P5 and P6 are handled.\n", file->magic);
+			return -1;
+	}
+	if ((ppm_read_int(src, &file->width) != 0) || (ppm_read_int(src, &file->height) != 0) || (ppm_read_int(src, &file->maxval) != 0)){
+		fprintf(stderr, "!!! Malformed header.\n");
+		return -1;
+	}
+	if ((file->width <= 0) || (file->height <= 0) || (file->maxval <= 0) || (file->maxval > 65535)){
+		fprintf(stderr, "!!! Invalid image properties: %d x %d, maxval %d.\n", file->width, file->height, file->maxval);
+		return -1;
+	}
+	file->sample_size = (file->maxval < 256) ? 1 : 2;
+	file->header_size = src->pos;
+	return 0;
+}
+
+// Size of a raw raster in bytes
+long ppm_raster_size(const ppm_file *file){
+	return (long)file->width*file->height*file->channels*file->sample_size;
+}
+
+
+/*============== Reading ===================*/
+// Maps a file and reads its header
+int ppm_open(ppm_file *file, const char *filename){
+	memset(file, 0, sizeof(ppm_file));
+	file->fd = open(filename, O_RDONLY);
+	if (file->fd < 0){
+		fprintf(stderr, "!!! Error while opening %s.\n", filename);
+		return -1;
+	}
+	struct stat properties;
+	fstat(file->fd, &properties);
+	file->map_size = properties.st_size;
+	if (file->map_size > 0) file->map = mmap(NULL, file->map_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if ((file->map_size == 0) || (file->map == MAP_FAILED)){
+		fprintf(stderr, "!!! Could not map %s.\n", filename);
+		close(file->fd);
+		file->fd = -1;
+		file->map = NULL;
+		return -1;
+	}
+
+	ppm_source src = {file->map, file->map_size, 0, NULL};
+	if (ppm_parse_header(&src, file) != 0){
+		ppm_close(file);
+		return -1;
+	}
+	file->raster = file->map + file->header_size;
+	if (((file->magic == '5') || (file->magic == '6')) && (file->header_size + ppm_raster_size(file) > file->map_size)){
+		fprintf(stderr, "!!! %s is truncated.\n", filename);
+		ppm_close(file);
+		return -1;
+	}
+	posix_madvise(file->map, file->map_size, POSIX_MADV_WILLNEED);
+	return 0;
+}
+
+// Converts the raw rows [first_row, last_row) into interleaved RGB samples.
+// 16-bit samples are stored most significant byte first, gray samples are copied to the 3 channels.
+void ppm_decode_rows(const ppm_file *file, const unsigned char *raster, oil_image *img, int first_row, int last_row){
+	long first = (long)first_row*file->width, last = (long)last_row*file->width;
+	for (long p = first; p < last; ++p){
+		for (int c = 0; c < 3; ++c){
+			long index = p*file->channels + ((file->channels == 3) ? c : 0);
+			if (file->sample_size == 1) oil_image_set(img, 3*p + c, raster[index]);
+			else oil_image_set(img, 3*p + c, (raster[2*index] << 8) | raster[2*index + 1]);
+		}
+	}
+}
+
+// Gives the samples of an opened file as an RGB image. An 8-bit P6 raster is used
+// in place, the other formats are converted.
+int ppm_read_image(const ppm_file *file, oil_image *img){
+	if ((file->magic == '6') && (file->sample_size == 1)){
+		oil_image_wrap(img, file->width, file->height, file->maxval, file->raster);
+		return 0;
+	}
+	oil_image_init(img, file->width, file->height, file->maxval);
+
+	if ((file->magic == '5') || (file->magic == '6')){
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < file->height; ++i){
+			ppm_decode_rows(file, file->raster, img, i, i+1);
+		}
+		return 0;
+	}
+
+	// Plain formats: decimal samples separated by whitespace
+	ppm_source src = {file->map, file->map_size, file->header_size, NULL};
+	long npixels = (long)file->width*file->height;
+	for (long p = 0; p < npixels; ++p){
+		int value[3];
+		for (int c = 0; c < file->channels; ++c){
+			if ((ppm_read_int(&src, &value[c]) != 0) || (value[c] > file->maxval)){
+				fprintf(stderr, "!!! Invalid sample at pixel %ld.\n", p);
+				oil_image_free(img);
+				return -1;
+			}
+		}
+		for (int c = 0; c < 3; ++c) oil_image_set(img, 3*p + c, value[(file->channels == 3) ? c : 0]);
+	}
+	return 0;
+}
+
+
+/*============== Writing ===================*/
+// Creates an image file. For the raw formats the file is given its final size and mapped,
+// the raster is then written in place. The plain formats are written through a stream.
+int ppm_create(ppm_file *file, const char *filename, char magic, int width, int height, int maxval){
+	memset(file, 0, sizeof(ppm_file));
+	file->fd = -1;
+	char header[64];
+	file->magic = magic;
+	file->channels = ((magic == '3') || (magic == '6')) ? 3 : 1;
+	file->width = width;
+	file->height = height;
+	file->maxval = maxval;
+	file->sample_size = (maxval < 256) ? 1 : 2;
+	file->header_size = sprintf(header, "P%c\n%d %d\n%d\n", magic, width, height, maxval);
+
+	if ((magic == '2') || (magic == '3')){
+		file->fd = -1;
+		file->stream = fopen(filename, "w");
+		if (file->stream == NULL){
+			fprintf(stderr, "!!! Error while creating %s.\n", filename);
+			return -1;
+		}
+		fputs(header, file->stream);
+		return 0;
+	}
+
+	file->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file->fd < 0){
+		fprintf(stderr, "!!! Error while creating %s.\n", filename);
+		return -1;
+	}
+	file->map_size = file->header_size + ppm_raster_size(file);
+	if (ftruncate(file->fd, file->map_size) != 0){
+		fprintf(stderr, "!!! Could not allocate %ld bytes for %s.\n", file->map_size, filename);
+		close(file->fd);
+		file->fd = -1;
+		return -1;
+	}
+	file->map = mmap(NULL, file->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+	if (file->map == MAP_FAILED){
+		fprintf(stderr, "!!! Could not map %s.\n", filename);
+		file->map = NULL;
+		close(file->fd);
+		file->fd = -1;
+		return -1;
+	}
+	memcpy(file->map, header, file->header_size);
+	file->raster = file->map + file->header_size;
+	return 0;
+}
+
+// Prepares the image the filter writes to: the raster of an 8-bit P6 output itself,
+// or a separate image for the formats that need a conversion
+int ppm_output_image(ppm_file *file, oil_image *img){
+	if ((file->magic == '6') && (file->sample_size == 1) && (file->raster != NULL)){
+		oil_image_wrap(img, file->width, file->height, file->maxval, file->raster);
+		return 1;
+	}
+	oil_image_init(img, file->width, file->height, file->maxval);
+	return 0;
+}
+
+// Converts the interleaved RGB rows [first_row, last_row) into raw samples.
+// A gray output keeps the red channel.
+void ppm_encode_rows(const ppm_file *file, const oil_image *img, unsigned char *raster, int first_row, int last_row){
+	long first = (long)first_row*file->width, last = (long)last_row*file->width;
+	for (long p = first; p < last; ++p){
+		for (int c = 0; c < file->channels; ++c){
+			long index = p*file->channels + c;
+			int value = oil_image_get(img, 3*p + c);
+			if (file->sample_size == 1) raster[index] = value;
+			else {
+				raster[2*index] = value >> 8;
+				raster[2*index + 1] = value & 0xFF;
+			}
+		}
+	}
+}
+
+// Writes the samples of an image into a created file, nothing to do when the
+// filter already wrote in the mapped raster
+int ppm_write_image(ppm_file *file, const oil_image *img){
+	if ((img->pixels != NULL) && (img->pixels == file->raster)) return 0;
+
+	if (file->stream != NULL){
+		int line = 0;
+		long npixels = (long)file->width*file->height;
+		for (long p = 0; p < npixels; ++p){
+			for (int c = 0; c < file->channels; ++c){
+				line += fprintf(file->stream, "%d ", oil_image_get(img, 3*p + c));
+				if (line > 64){ // Lines should stay under 70 characters
+					fputc('\n', file->stream);
+					line = 0;
+				}
+			}
+		}
+		fputc('\n', file->stream);
+		return 0;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < file->height; ++i){
+		ppm_encode_rows(file, img, file->raster, i, i+1);
+	}
+	return 0;
+}
+
+
+/*============== Row by row I/O ===================*/
+// Size of a raw row in bytes
+long ppm_row_size(const ppm_file *file){
+	return (long)file->width*file->channels*file->sample_size;
+}
+
+// Reads the header of a raw file, without mapping it: the rows are then read with ppm_read_rows
+int ppm_open_rows(ppm_file *file, const char *filename){
+	memset(file, 0, sizeof(ppm_file));
+	file->fd = -1;
+	FILE *stream = fopen(filename, "rb");
+	if (stream == NULL){
+		fprintf(stderr, "!!! Error while opening %s.\n", filename);
+		return -1;
+	}
+	ppm_source src = {NULL, 0, 0, stream};
+	int status = ppm_parse_header(&src, file);
+	fclose(stream);
+	if (status != 0) return -1;
+	if ((file->magic != '5') && (file->magic != '6')){
+		fprintf(stderr, "!!! Only raw files (P5, P6) can be read by rows.\n");
+		return -1;
+	}
+
+	file->fd = open(filename, O_RDONLY);
+	struct stat properties;
+	if ((file->fd < 0) || (fstat(file->fd, &properties) != 0)){
+		fprintf(stderr, "!!! Error while opening %s.\n", filename);
+		ppm_close(file);
+		return -1;
+	}
+	if (file->header_size + ppm_raster_size(file) > properties.st_size){
+		fprintf(stderr, "!!! %s is truncated.\n", filename);
+		ppm_close(file);
+		return -1;
+	}
+	return 0;
+}
+
+// Reads the raw rows [first_row, first_row + nrows)
+int ppm_read_rows(const ppm_file *file, unsigned char *raw, int first_row, int nrows){
+	long size = nrows*ppm_row_size(file);
+	off_t offset = file->header_size + first_row*ppm_row_size(file);
+	long done = 0;
+	while (done < size){
+		ssize_t n = pread(file->fd, raw + done, size - done, offset + done);
+		if (n <= 0){
+			fprintf(stderr, "!!! Error while reading rows %d to %d.\n", first_row, first_row + nrows - 1);
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+// Creates a raw file and writes its header, the rows are then appended with ppm_append_rows
+int ppm_create_rows(ppm_file *file, const char *filename, char magic, int width, int height, int maxval){
+	memset(file, 0, sizeof(ppm_file));
+	file->magic = magic;
+	file->channels = (magic == '6') ? 3 : 1;
+	file->width = width;
+	file->height = height;
+	file->maxval = maxval;
+	file->sample_size = (maxval < 256) ? 1 : 2;
+	file->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file->fd < 0){
+		fprintf(stderr, "!!! Error while creating %s.\n", filename);
+		return -1;
+	}
+	char header[64];
+	file->header_size = sprintf(header, "P%c\n%d %d\n%d\n", magic, width, height, maxval);
+	if (write(file->fd, header, file->header_size) != file->header_size){
+		fprintf(stderr, "!!! Error while writing %s.\n", filename);
+		ppm_close(file);
+		return -1;
+	}
+	return 0;
+}
+
+// Appends nrows raw rows at the end of the file
+int ppm_append_rows(ppm_file *file, const unsigned char *raw, int nrows){
+	long size = nrows*ppm_row_size(file);
+	long done = 0;
+	while (done < size){
+		ssize_t n = write(file->fd, raw + done, size - done);
+		if (n <= 0){
+			fprintf(stderr, "!!! Error while writing %d rows.\n", nrows);
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+
+/*============== Closing ===================*/
+void ppm_close(ppm_file *file){
+	if (file->map != NULL) munmap(file->map, file->map_size);
+	if (file->fd >= 0) close(file->fd);
+	if (file->stream != NULL) fclose(file->stream);
+	file->map = NULL;
+	file->raster = NULL;
+	file->stream = NULL;
+	file->fd = -1;
+}
+
+
+/*============== Writing over the input ===================*/
+// 1 if both names are the same existing file: creating the output would truncate the input
+int ppm_same_file(const char *a, const char *b){
+	struct stat info_a, info_b;
+	if ((stat(a, &info_a) != 0) || (stat(b, &info_b) != 0)) return 0;
+	return (info_a.st_dev == info_b.st_dev) && (info_a.st_ino == info_b.st_ino);
+}
+
+// Creates an empty file named after filename, in the same directory, to be renamed over it
+// once written. Returns its name (free it), NULL on failure.
+char *ppm_temp_name(const char *filename){
+	size_t length = strlen(filename) + 8;
+	char *temp = malloc(length);
+	snprintf(temp, length, "%s.XXXXXX", filename);
+	int fd = mkstemp(temp);
+	if (fd < 0){
+		fprintf(stderr, "!!! Could not create a temporary file next to %s.\n", filename);
+		free(temp);
+		return NULL;
+	}
+	fchmod(fd, 0644);
+	close(fd);
+	return temp;
+}
+
+#endif
@@ -8,7 +8,12 @@
 *	Under GNU General Public License 11/2018
 =======================================================================================*/
 
+#ifndef CSR_BSR_H
+#define CSR_BSR_H
+
+#include <omp.h>
 #include "algorithms.h"
+#include "bsr_kernels.h"
 /*=====================================================================================
 * Contains all the necessary functions to handle BSR matrices and CSR vectors
 =====================================================================================*/
@@ -23,15 +28,21 @@ struct bsr_matrix{
   	int nnzb; // # of non-zero *blocks*
   	int n_elements_per_block;
   	unsigned int *block_row_offsets;
-  	unsigned int *block_columns;
-  	double *values;
+  	unsigned int *block_columns; // NULL if compressed
+  	double *values; // NULL if compressed
+  	bsr_compressed compressed; // Storage variants, see bsr_compress (all NULL for a plain matrix)
 };
 
+// Storage variants for bsr_compress, to be combined with |
+#define BSR_INDEX_DELTA16 1 // 16-bit block column deltas from the smallest one of each block row
+#define BSR_VALUES_SINGLE 2 // float values, summed in double
+
 typedef struct csr_vector csr_vector; 
 struct csr_vector{
 	int nrows;
   	int nnzb; // # of non-zero values
-  	unsigned int *rows;
+  	int capacity; // # of values rows and values can hold
+  	unsigned int *rows; // Increasing
   	double *values;
 };
 
@@ -42,15 +53,26 @@ void bsr_init(bsr_matrix *matrix, int nrows, int ncolumns, int block_size, int n
 double bsr_get(bsr_matrix *matrix, int i, int j);
 int natural_to_bsr(double *natural, bsr_matrix *matrix, int size, int block_size);
 void bsr_free(bsr_matrix *matrix);
+int bsr_compress(bsr_matrix *matrix, int storage, bsr_matrix *result);
+int bsr_require_plain(bsr_matrix *matrix);
+long bsr_storage_bytes(bsr_matrix *matrix);
 /*==============*/
 void csr_vector_init(csr_vector *vector, double *natural, int nrows);
+void csr_vector_alloc(csr_vector *vector, int nrows, int capacity);
 double csr_vector_get(csr_vector *vector, int index);
 void csr_vector_scale(csr_vector *vector, double scale);
-int csr_vector_sum(csr_vetor *P, csr_vector *Q, csr_vector *R);
+int csr_vector_axpy(double alpha, csr_vector *P, csr_vector *Q, csr_vector *R);
+int csr_vector_sum(csr_vector *P, csr_vector *Q, csr_vector *R);
 double csr_vector_scalar(csr_vector *P, csr_vector *Q);
 double csr_vector_norm(csr_vector *P);
+void csr_vector_scatter(csr_vector *P, double alpha, double *y);
+void csr_vector_gather(double *x, csr_vector *P);
+double csr_vector_dot_dense(csr_vector *P, double *x);
 void csr_vector_free(csr_vector *vector);
 /*==============*/
+void bsr_spmv_update(bsr_matrix *matrix, double *x, double *y, double *w, double alpha, double beta);
+void bsr_spmv(bsr_matrix *matrix, double *x, double *y, double alpha, double beta);
+void bsr_spmm(bsr_matrix *matrix, int k, double *X, double *Y, double alpha, double beta);
 int bsr_matrix_vector(bsr_matrix *matrix, csr_vector *vector, csr_vector *csr_result_vector);
 
 
@@ -69,6 +91,7 @@ void bsr_init(bsr_matrix *matrix, int nrows, int ncolumns, int block_size, int n
 	matrix->block_row_offsets = malloc(sizeof(int) * (nrows / block_size + 1));
 	matrix->block_columns = malloc(sizeof(int) * nnzb);
 	matrix->values = malloc(sizeof(double) * nnzb*block_size*block_size);
+	memset(&matrix->compressed, 0, sizeof(bsr_compressed));
 }
 
 // Fetches a value from the BSR matrix
@@ -102,17 +125,27 @@ double bsr_get(bsr_matrix *matrix, int i_, int j_) {
   return matrix->values[offset];
 }
 
+// Entry (i, j) of a size*size matrix padded with the identity
+static inline double natural_padded(double *natural, int size, int i, int j){
+	if (i < size && j < size) return natural[j + size*i];
+	return (i == j) ? 1.0 : 0.0;
+}
+
 // Takes a matrix written as a 1D array and stores it as a bsr matrix!
+// Scans the whole size*size array: for small matrices only, see bsr_assembly.h otherwise.
+// A size that is not a multiple of block_size is padded: the padded rows get a 1 on the
+// diagonal. See bsr_tuning.h to choose the block size.
 int natural_to_bsr(double *natural, bsr_matrix *matrix, int size, int block_size) {
 
-	if (size%block_size != 0){ // The block size is incompatible with the matrix size
-		printf("!!! The block size is incompatible with the matrix size.\n");
+	if (block_size < 1){
+		printf("!!! Invalid block size %d.\n", block_size);
 		return -1;
 	}
-	unsigned int b_size = size/block_size;
+	int padded_size = (size + block_size - 1)/block_size*block_size;
+	unsigned int b_size = padded_size/block_size;
 	unsigned int *temp_block_row_offsets = malloc(sizeof(int) * (b_size + 1));
 	unsigned int *temp_block_columns = malloc(sizeof(int) * (int)(b_size*b_size));
-	double *temp_values = malloc(sizeof(double) * size*size);
+	double *temp_values = malloc(sizeof(double) * padded_size*padded_size);
 	long value_index = 0, block_count = 0;
 	char *block_matrix = malloc(sizeof(char)*b_size*b_size);
 	int temp_row_index = 0;
@@ -121,14 +154,14 @@ int natural_to_bsr(double *natural, bsr_matrix *matrix, int size, int block_size
 	/*======== Creation of the CSR matrix for the block matrix =========*/
 	temp_block_row_offsets[0] = 0;
 	// Browse the natural matrix, block by block
-	for (int j=0 ; j<size ; j+=block_size){
-		for (int i=0 ; i<size ; i+=block_size){
+	for (int j=0 ; j<padded_size ; j+=block_size){
+		for (int i=0 ; i<padded_size ; i+=block_size){
 			// Looking at a sub-matrix of size block_size x block_size,
 			// check if there is at least one non-zero value
 			bool empty = true;
 			for (int l=0 ; l<block_size ; ++l){
 				for (int k=0 ; k<block_size ; ++k){
-					if (natural[i+k + size*(j+l)] != 0){
+					if (natural_padded(natural, size, j+l, i+k) != 0){
 						empty = false;
 						break;
 					} 
@@ -141,7 +174,7 @@ int natural_to_bsr(double *natural, bsr_matrix *matrix, int size, int block_size
 				// Non-empty case, append temp_values
 				for (int l=0 ; l<block_size ; ++l){
 					for (int k=0 ; k<block_size ; ++k){
-						temp_values[value_index] = natural[i+k + size*(j+l)];
+						temp_values[value_index] = natural_padded(natural, size, j+l, i+k);
 						++value_index;
 					}
 				}
@@ -157,21 +190,24 @@ int natural_to_bsr(double *natural, bsr_matrix *matrix, int size, int block_size
 		++temp_row_index;
 		temp_block_row_offsets[temp_row_index] = block_count;
 	}
-	temp_block_row_offsets[temp_row_index+1] = block_count;
 
 	/*======== Allocation of the BSR matrix =========*/
 	// Give the values to the receiving bsr matrix
-	bsr_init(matrix, size, size, block_size, block_count);
+	bsr_init(matrix, padded_size, padded_size, block_size, block_count);
 	for (int i=0 ; i<block_count*block_size*block_size ; ++i){
 		matrix->values[i] = temp_values[i];
 	}
 	for (int i = 0; i < b_size+1; ++i){
 		matrix->block_row_offsets[i] = temp_block_row_offsets[i];
 	}
-	printf("\n");
 	for (int i = 0; i < block_count; ++i){
 		matrix->block_columns[i] = temp_block_columns[i];
 	}
+	free(temp_block_row_offsets);
+	free(temp_block_columns);
+	free(temp_values);
+	free(block_matrix);
+	return 0;
 }
 
 // Frees the memory, fly away !
@@ -179,6 +215,103 @@ void bsr_free(bsr_matrix *matrix) {
 	free(matrix->block_row_offsets);
 	free(matrix->block_columns);
 	free(matrix->values);
+	free(matrix->compressed.bases);
+	free(matrix->compressed.deltas);
+	free(matrix->compressed.wide_columns);
+	free(matrix->compressed.values);
+}
+
+// Copies a plain matrix into result with less bytes to stream per SpMV (storage: see
+// BSR_INDEX_DELTA16 and BSR_VALUES_SINGLE). The block columns of a block row are stored
+// as 16-bit deltas from its smallest one, unless they span more than 65535 block columns:
+// that row keeps 32-bit columns. The deltas only save 2 bytes per block: a few % of the
+// bytes for 2x2 blocks, 1.6% for 3x3, less than the cost of decoding them unless SpMV is
+// bandwidth-bound. bsr_spmv, bsr_spmm and thus the solvers take the result;
+// the functions that read the blocks themselves (preconditioners, reorderings, bsr_save...)
+// need the plain matrix. result is allocated, free it with bsr_free.
+int bsr_compress(bsr_matrix *matrix, int storage, bsr_matrix *result){
+	if (bsr_require_plain(matrix) != 0) return -1;
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	long n_values = (long)matrix->nnzb*matrix->n_elements_per_block;
+	*result = *matrix;
+	memset(&result->compressed, 0, sizeof(bsr_compressed));
+	result->block_row_offsets = malloc(sizeof(int) * (n_block_rows + 1));
+	memcpy(result->block_row_offsets, matrix->block_row_offsets, sizeof(int) * (n_block_rows + 1));
+	unsigned int *offsets = matrix->block_row_offsets;
+
+	if (storage & BSR_INDEX_DELTA16){
+		bsr_compressed *compressed = &result->compressed;
+		compressed->bases = malloc(sizeof(int) * (n_block_rows > 0 ? n_block_rows : 1));
+		compressed->deltas = malloc(sizeof(short) * (matrix->nnzb > 0 ? matrix->nnzb : 1));
+		// Range of each block row, the wide ones get their place in wide_columns
+		unsigned int n_wide = 0;
+		for (int I = 0; I < n_block_rows; ++I){
+			unsigned int smallest = (offsets[I+1] > offsets[I]) ? matrix->block_columns[offsets[I]] : 0, largest = smallest;
+			for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+				if (matrix->block_columns[b] < smallest) smallest = matrix->block_columns[b];
+				if (matrix->block_columns[b] > largest) largest = matrix->block_columns[b];
+			}
+			if (largest - smallest <= 0xFFFF) compressed->bases[I] = smallest;
+			else{
+				compressed->bases[I] = BSR_WIDE_ROW | n_wide;
+				n_wide += offsets[I+1] - offsets[I];
+			}
+		}
+		compressed->wide_columns = malloc(sizeof(int) * (n_wide > 0 ? n_wide : 1));
+		#pragma omp parallel for schedule(static)
+		for (int I = 0; I < n_block_rows; ++I){
+			unsigned int base = compressed->bases[I];
+			for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+				if (base & BSR_WIDE_ROW){
+					compressed->wide_columns[(base & ~BSR_WIDE_ROW) + b - offsets[I]] = matrix->block_columns[b];
+					compressed->deltas[b] = 0;
+				}
+				else compressed->deltas[b] = (unsigned short)(matrix->block_columns[b] - base);
+			}
+		}
+		result->block_columns = NULL;
+	}
+	else{
+		result->block_columns = malloc(sizeof(int) * matrix->nnzb);
+		memcpy(result->block_columns, matrix->block_columns, sizeof(int) * matrix->nnzb);
+	}
+
+	if (storage & BSR_VALUES_SINGLE){
+		result->compressed.values = malloc(sizeof(float) * (n_values > 0 ? n_values : 1));
+		#pragma omp parallel for schedule(static)
+		for (long e = 0; e < n_values; ++e) result->compressed.values[e] = (float)matrix->values[e];
+		result->values = NULL;
+	}
+	else{
+		result->values = malloc(sizeof(double) * n_values);
+		memcpy(result->values, matrix->values, sizeof(double) * n_values);
+	}
+	return 0;
+}
+
+// 0 for a plain matrix, else -1 with a message
+int bsr_require_plain(bsr_matrix *matrix){
+	if ((matrix->block_columns == NULL) || (matrix->values == NULL)){
+		printf("!!! This needs a matrix with plain storage, not a compressed one (see bsr_compress).\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Bytes of the arrays streamed by a SpMV
+long bsr_storage_bytes(bsr_matrix *matrix){
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	long n_values = (long)matrix->nnzb*matrix->n_elements_per_block;
+	long bytes = sizeof(int) * (n_block_rows + 1L);
+	if (matrix->compressed.bases != NULL){
+		bytes += sizeof(int) * (long)n_block_rows + sizeof(short) * (long)matrix->nnzb;
+		for (int I = 0; I < n_block_rows; ++I){
+			if (matrix->compressed.bases[I] & BSR_WIDE_ROW) bytes += sizeof(int) * (long)(matrix->block_row_offsets[I+1] - matrix->block_row_offsets[I]);
+		}
+	}
+	else bytes += sizeof(int) * (long)matrix->nnzb;
+	bytes += (matrix->compressed.values != NULL) ? sizeof(float) * n_values : sizeof(double) * n_values;
+	return bytes;
 }
 
 
@@ -192,6 +325,7 @@ void csr_vector_init(csr_vector *vector, double *natural, int nrows){
 		if (natural[i] != 0)++temp_nnzb;
 	}
 	vector->nnzb = temp_nnzb;
+	vector->capacity = temp_nnzb;
 	vector->rows = malloc(sizeof(int) * temp_nnzb);
 	vector->values = malloc(sizeof(double) * temp_nnzb);
 	int index = 0;
@@ -204,18 +338,23 @@ void csr_vector_init(csr_vector *vector, double *natural, int nrows){
 	}
 }
 
-// TODO : implementation in O(ln(n)), taking the half each time
+// Empty vector of size nrows that can hold up to capacity values, e.g. the result of csr_vector_sum
+void csr_vector_alloc(csr_vector *vector, int nrows, int capacity){
+	vector->nrows = nrows;
+	vector->nnzb = 0;
+	vector->capacity = capacity;
+	vector->rows = malloc(sizeof(int) * (capacity > 0 ? capacity : 1));
+	vector->values = malloc(sizeof(double) * (capacity > 0 ? capacity : 1));
+}
+
+// Value at index, found by a binary search in O(log(nnzb))
 double csr_vector_get(csr_vector *vector, int index){
-	if (index >= vector->nrows){
+	if ((index < 0) || (index >= vector->nrows)){
 		printf("!!! Index out of bounds.\n");
 		return -1;
 	}
-
-	int looking_index = 0;
-	while ((looking_index < vector->nnzb) && vector->rows[looking_index] < index){
-		++looking_index;
-	}
-	if (vector->rows[looking_index] == index)return vector->values[looking_index];
+	int position = list_gallop(vector->rows, 0, vector->nnzb, index); // See algorithms.h
+	if ((position < vector->nnzb) && (vector->rows[position] == (unsigned int)index)) return vector->values[position];
 	else return 0;
 }
 
@@ -226,46 +365,70 @@ void csr_vector_scale(csr_vector *vector, double scaling_factor){
 	}
 }
 
-// Sums two CSR vectors and stores the result in a third vector
-// TODO : store the result ine the main for loop, as soon as it it computed
-int csr_vector_sum(csr_vetor *P, csr_vector *Q, csr_vector *R){
+// R = alpha*P + Q, merging the two lists of rows in O(P->nnzb + Q->nnzb) without any allocation.
+// R keeps every row of P or Q, even where the values cancel out. It needs room for the union
+// of the rows (P->nnzb + Q->nnzb is always enough) and may not be P or Q.
+int csr_vector_axpy(double alpha, csr_vector *P, csr_vector *Q, csr_vector *R){
 	if ((P->nrows != Q->nrows) || (P->nrows != R->nrows)){
 		printf("!!! Vector dimensions mismatch.\n");
 		return -1;
 	}
-
-	double *result = malloc(sizeof(double)*P->nrows);
-	int *adding_list = malloc(sizeof(int)*P->nrows);
-	int max_nnzb = 0;
-	int new_nnzb = 0;
-	if (P->nnzb > Q->nzzb)max_nnzb = P->nnzb;
-	else max_nnzb = Q->nzzb;
-
-	// Build the list of rows with non-zero values
-	for (int i = 0; i < max_nnzb; ++i){
-		/* code */
+	if ((R == P) || (R == Q)){
+		printf("!!! The result of a CSR vector sum may not be one of its terms.\n");
+		return -1;
+	}
+	// Only counted when the trivial bound does not fit, R is left untouched on failure
+	if ((R->capacity < P->nnzb + Q->nnzb) && (list_merge(P->rows, P->nnzb, Q->rows, Q->nnzb, NULL) > R->capacity)){
+		printf("!!! Not enough room in the result of a CSR vector sum.\n");
+		return -1;
 	}
 
-	// Do a manual initilization, as the rows and values are already computed
-	R->nrows = P->nrows;
-	R->nnzb = new_nnzb;
-	for (int i = 0; i < new_nnzb; ++i){
-		R->rows[i] = adding_list[i];
-		R->values[i] = result[i];
+	int p = 0, q = 0, r = 0;
+	while ((p < P->nnzb) && (q < Q->nnzb)){
+		if (P->rows[p] < Q->rows[q]){
+			R->rows[r] = P->rows[p];
+			R->values[r] = alpha*P->values[p++];
+		}
+		else if (P->rows[p] > Q->rows[q]){
+			R->rows[r] = Q->rows[q];
+			R->values[r] = Q->values[q++];
+		}
+		else{
+			R->rows[r] = P->rows[p];
+			R->values[r] = alpha*P->values[p++] + Q->values[q++];
+		}
+		++r;
+	}
+	for (; p < P->nnzb; ++p, ++r){
+		R->rows[r] = P->rows[p];
+		R->values[r] = alpha*P->values[p];
+	}
+	for (; q < Q->nnzb; ++q, ++r){
+		R->rows[r] = Q->rows[q];
+		R->values[r] = Q->values[q];
 	}
+	R->nnzb = r;
+	return 0;
+}
+
+// Sums two CSR vectors and stores the result in a third vector, see csr_vector_axpy
+int csr_vector_sum(csr_vector *P, csr_vector *Q, csr_vector *R){
+	return csr_vector_axpy(1.0, P, Q, R);
 }
 
-// Does a scalar product between two CSR vectors
+// Does a scalar product between two CSR vectors. The rows of the shorter one are looked for
+// in the longer one by galloping: O(n_short*log(n_long/n_short)) instead of O(n_short + n_long).
 double csr_vector_scalar(csr_vector *P, csr_vector *Q){
+	if (P->nnzb > Q->nnzb){
+		csr_vector *swap = P;
+		P = Q;
+		Q = swap;
+	}
 	double result = 0;
 	int index_Q = 0;
-
-	// Finding the intersection between the rows (non-zero values)
-	for (int i = 0; i < P->nnzb; ++i){
-		while (Q->rows[index_Q] < P->rows[i]){
-			++index_Q;
-		}
-		if (Q->rows[index_Q] == P->rows[i]){
+	for (int i = 0; (i < P->nnzb) && (index_Q < Q->nnzb); ++i){
+		index_Q = list_gallop(Q->rows, index_Q, Q->nnzb, P->rows[i]);
+		if ((index_Q < Q->nnzb) && (Q->rows[index_Q] == P->rows[i])){
 			result += P->values[i]*Q->values[index_Q];
 		}
 	}
@@ -277,6 +440,29 @@ double csr_vector_norm(csr_vector *P){
 	return sqrt(csr_vector_scalar(P,P));
 }
 
+// Scatter into a dense vector: y += alpha*P, only the rows of P are touched
+void csr_vector_scatter(csr_vector *P, double alpha, double *y){
+	for (int i = 0; i < P->nnzb; ++i){
+		y[P->rows[i]] += alpha*P->values[i];
+	}
+}
+
+// Gather from a dense vector: the values of P become those of x on the rows of P
+void csr_vector_gather(double *x, csr_vector *P){
+	for (int i = 0; i < P->nnzb; ++i){
+		P->values[i] = x[P->rows[i]];
+	}
+}
+
+// P.x with a dense x, in O(P->nnzb)
+double csr_vector_dot_dense(csr_vector *P, double *x){
+	double result = 0;
+	for (int i = 0; i < P->nnzb; ++i){
+		result += P->values[i]*x[P->rows[i]];
+	}
+	return result;
+}
+
 // Frees the memory
 void csr_vector_free(csr_vector *vector){
 	free(vector->rows);
@@ -285,26 +471,76 @@ void csr_vector_free(csr_vector *vector){
 
 
 /*============== BSR Matrix & CSR Vector functions ===================*/
+// Does w = alpha*A*x + beta*y with dense vectors, walking the blocks once: O(nnz), no allocation.
+// The block rows are shared between the threads, each one writes its own rows of w.
+// w may be y (see bsr_spmv) but not x. With beta = 0, y is not read.
+void bsr_spmv_update(bsr_matrix *matrix, double *x, double *y, double *w, double alpha, double beta){
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	if ((matrix->compressed.bases != NULL) || (matrix->compressed.values != NULL)){
+		bsr_compressed_kernel kernel = bsr_select_compressed_kernel(matrix->block_size, matrix->compressed.values != NULL);
+		#pragma omp parallel
+		{
+			int thread = omp_get_thread_num(), nthreads = omp_get_num_threads();
+			int first = (int)((long)thread*n_block_rows/nthreads);
+			int last = (int)((long)(thread + 1)*n_block_rows/nthreads);
+			kernel(first, last, matrix->block_size, matrix->block_row_offsets, matrix->block_columns, matrix->values, &matrix->compressed, x, y, w, alpha, beta);
+		}
+		return;
+	}
+	bsr_kernel kernel = bsr_select_kernel(matrix->block_size); // See bsr_kernels.h
+
+	#pragma omp parallel
+	{
+		// Same rows per thread as schedule(static), one kernel call each
+		int thread = omp_get_thread_num(), nthreads = omp_get_num_threads();
+		int first = (int)((long)thread*n_block_rows/nthreads);
+		int last = (int)((long)(thread + 1)*n_block_rows/nthreads);
+		kernel(first, last, matrix->block_size, matrix->block_row_offsets, matrix->block_columns, matrix->values, x, y, w, alpha, beta);
+	}
+}
+
+// Does y = alpha*A*x + beta*y. With beta = 0, y is only written (it may hold anything beforehand).
+void bsr_spmv(bsr_matrix *matrix, double *x, double *y, double alpha, double beta){
+	bsr_spmv_update(matrix, x, y, y, alpha, beta);
+}
+
+// Does Y = alpha*A*X + beta*Y for k vectors at once, stored row-major (X[i*k + j] is the
+// entry i of the vector j). Each block of A is loaded once for the k vectors: A is streamed
+// from memory once instead of k times. Y may not be X.
+void bsr_spmm(bsr_matrix *matrix, int k, double *X, double *Y, double alpha, double beta){
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	int compressed = (matrix->compressed.bases != NULL) || (matrix->compressed.values != NULL);
+	bsr_multi_kernel kernel = bsr_select_multi_kernel(); // See bsr_kernels.h
+
+	#pragma omp parallel
+	{
+		int thread = omp_get_thread_num(), nthreads = omp_get_num_threads();
+		int first = (int)((long)thread*n_block_rows/nthreads);
+		int last = (int)((long)(thread + 1)*n_block_rows/nthreads);
+		if (compressed) bsr_spmm_kernel_compressed(first, last, matrix->block_size, k, matrix->block_row_offsets, matrix->block_columns, matrix->values,
+		                                           &matrix->compressed, X, Y, alpha, beta);
+		else kernel(first, last, matrix->block_size, k, matrix->block_row_offsets, matrix->block_columns, matrix->values, X, Y, alpha, beta);
+	}
+}
+
 // Does a BSR matrix/vector product
 int bsr_matrix_vector(bsr_matrix *matrix, csr_vector *vector, csr_vector *csr_result_vector){
-	if (vector->nrows != matrix->nrows){
+	if (vector->nrows != matrix->ncolumns){
 		printf("!!! Matrix and vector dimensions mismatch.\n");
 		return -1;
 	}
-	
-	double *row_vector = malloc(sizeof(double)*matrix->nrows);
-	double *result_vector = malloc(sizeof(double)*matrix->nrows);
 
-	for (int i = 0; i < matrix->nrows; ++i){
-		// Extract vectors by row from the matrix
-		for (int j = 0; j<matrix->nrows; ++j){
-			row_vector[j] = bsr_get(matrix, i, j);
-		}
-		// Convert it to CSR vector
-		csr_vector csr_row_vector;
-		csr_vector_init(&csr_row_vector, row_vector, matrix->nrows);
-		// Do the scalar product
-		result_vector[i] = csr_vector_scalar(vector, &csr_row_vector);
+	// Dense copies of the vectors, the product itself is bsr_spmv
+	double *x = calloc(matrix->ncolumns, sizeof(double));
+	double *result_vector = malloc(sizeof(double)*matrix->nrows);
+	for (int i = 0; i < vector->nnzb; ++i){
+		x[vector->rows[i]] = vector->values[i];
 	}
+	bsr_spmv(matrix, x, result_vector, 1.0, 0.0);
 	csr_vector_init(csr_result_vector, result_vector, matrix->nrows);
-}
\ No newline at end of file
+	free(x);
+	free(result_vector);
+	return 0;
+}
+
+#endif
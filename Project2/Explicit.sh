@@ -0,0 +1,4 @@
+clear
+gcc -O2 -o explicit explicit.c -lm -std=c99 -fopenmp
+./explicit -m euler
+./explicit -m rk2
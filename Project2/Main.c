@@ -7,6 +7,7 @@
 *
 *	Under GNU General Public License 11/2018
 =======================================================================================*/
+#define _POSIX_C_SOURCE 200809L // mmap
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,8 +15,15 @@
 #include <time.h>
 #include <malloc.h>
 #include <stdbool.h>
+#include <omp.h>
 
 #include "CSR_BSR.h"
+#include "bsr_assembly.h"
+#include "bsr_io.h"
+#include "solvers.h"
+#include "preconditioners.h"
+#include "reordering.h"
+#include "bsr_tuning.h"
 
 #define DEBUG 0
 
@@ -132,10 +140,275 @@
 		
 
 	//======================= PRE-PROCESSING ============================//
+	// ./Main [<matrix.mtx> [<block_size> [<copy.bsr>]] | <matrix.bsr>]
+	// Without a file, a test operator with 3x3 blocks, 3 DOFs per node: a 2D grid of nodes
+	// where each edge is an element that adds [K -K; -K K] on its two nodes, plus a small
+	// mass term on the diagonal (badly conditioned, like a stiffness matrix). Assembled in
+	// parallel from triplets, the contributions of the edges meeting at a node are summed.
+	bsr_matrix A;
+	bsr_mapping mapping;
+	int mapped = 0;
+	long n_triplets = 0;
+	double begin = omp_get_wtime();
+	if (argc > 1){
+		int status;
+		size_t length = strlen(argv[1]);
+		if ((length > 4) && (strcmp(argv[1] + length - 4, ".bsr") == 0)){
+			status = bsr_map(argv[1], &A, &mapping);
+			mapped = 1;
+		}
+		else status = bsr_read_mtx(argv[1], &A, (argc > 2) ? atoi(argv[2]) : 3);
+		if (status != 0) return(1);
+	}
+	else{
+		int nx = 300, ny = 300, block_size = 3;
+		int n_nodes = nx*ny, size = n_nodes*block_size;
+		double K[9] = {2.0, 0.5, 0.25,   0.5, 2.0, 0.5,   0.25, 0.5, 2.0};
+		double minus_K[9], mass[9] = {0.01, 0.0, 0.0,   0.0, 0.01, 0.0,   0.0, 0.0, 0.01};
+		for (int k = 0; k < 9; ++k) minus_K[k] = -K[k];
+		bsr_assembly assembly;
+		bsr_assembly_init(&assembly, size, size, block_size);
+		#pragma omp parallel for
+		for (int node = 0; node < n_nodes; ++node){
+			bsr_assembly_add_block(&assembly, node, node, mass);
+			// Edges to the right and upper neighbours
+			int neighbours[2] = {(node%nx < nx - 1) ? node + 1 : -1, (node/nx < ny - 1) ? node + nx : -1};
+			for (int e = 0; e < 2; ++e){
+				int other = neighbours[e];
+				if (other < 0) continue;
+				bsr_assembly_add_block(&assembly, node, node, K);
+				bsr_assembly_add_block(&assembly, node, other, minus_K);
+				bsr_assembly_add_block(&assembly, other, node, minus_K);
+				bsr_assembly_add_block(&assembly, other, other, K);
+			}
+		}
+		n_triplets = bsr_assembly_count(&assembly);
+		bsr_assembly_build(&assembly, &A);
+		bsr_assembly_free(&assembly);
+	}
+	double load_time = omp_get_wtime() - begin;
+	if ((argc > 3) && !mapped) bsr_save(&A, argv[3]);
+	int size = A.nrows, block_size = A.block_size;
 
 	//======================= ALGORITHM =================================//
+	// y = A*x, timed over a few repetitions
+	double *x = malloc(sizeof(double)*A.ncolumns);
+	double *y = malloc(sizeof(double)*size);
+	for (int i = 0; i < A.ncolumns; ++i) x[i] = 1.0;
+	int repetitions = 100;
+	begin = omp_get_wtime();
+	for (int r = 0; r < repetitions; ++r) bsr_spmv(&A, x, y, 1.0, 0.0);
+	double elapsed = (omp_get_wtime() - begin) / repetitions;
+	// Same product with the generic block loop, for comparison with the kernel picked by bsr_spmv:
+	// same threads and same rows per thread as bsr_spmv_update, only the kernel differs
+	begin = omp_get_wtime();
+	for (int r = 0; r < repetitions; ++r){
+		#pragma omp parallel
+		{
+			int thread = omp_get_thread_num(), nthreads = omp_get_num_threads();
+			int first = (int)((long)thread*(A.nrows/block_size)/nthreads);
+			int last = (int)((long)(thread + 1)*(A.nrows/block_size)/nthreads);
+			bsr_kernel_generic(first, last, block_size, A.block_row_offsets, A.block_columns, A.values, x, y, y, 1.0, 0.0);
+		}
+	}
+	double elapsed_generic = (omp_get_wtime() - begin) / repetitions;
+
+	// Reorderings. The test operator is numbered along the grid already: a shuffled copy of it
+	// stands for a mesh with a poor numbering. A loaded matrix is reordered as it is.
+	int n_block_rows = A.nrows/block_size;
+	int reorder_status = -1;
+	long bandwidths[3], profiles[3];
+	double reorder_spmv[3], reorder_times[2];
+	const char *reorder_names[3] = {(argc > 1) ? "Original" : "Shuffled", "RCM", "Partition (64 parts)"};
+	if (A.nrows == A.ncolumns){
+		unsigned int *permutation = malloc(sizeof(int)*n_block_rows);
+		bsr_matrix shuffled, reordered;
+		bsr_matrix *source = &A;
+		if (argc <= 1){
+			for (int I = 0; I < n_block_rows; ++I) permutation[I] = I;
+			srand(2018);
+			for (int I = n_block_rows - 1; I > 0; --I){
+				int J = rand()%(I + 1);
+				unsigned int swap = permutation[I]; permutation[I] = permutation[J]; permutation[J] = swap;
+			}
+			bsr_permute(&A, permutation, &shuffled);
+			source = &shuffled;
+		}
+		for (int o = 0; o < 3; ++o){
+			bsr_matrix *matrix = source;
+			if (o > 0){
+				begin = omp_get_wtime();
+				if (o == 1) bsr_reorder_rcm(source, permutation);
+				else bsr_reorder_partition(source, 64, permutation);
+				bsr_permute(source, permutation, &reordered);
+				reorder_times[o-1] = omp_get_wtime() - begin;
+				matrix = &reordered;
+			}
+			bsr_bandwidth(matrix, &bandwidths[o], &profiles[o]);
+			begin = omp_get_wtime();
+			for (int r = 0; r < repetitions; ++r) bsr_spmv(matrix, x, y, 1.0, 0.0);
+			reorder_spmv[o] = (omp_get_wtime() - begin) / repetitions;
+			if (o > 0) bsr_free(&reordered);
+		}
+		if (argc <= 1) bsr_free(&shuffled);
+		free(permutation);
+		reorder_status = 0;
+	}
+
+	// Automatic block size: A as a scalar matrix, then the block size predicted from its fill
+	// ratios and the calibration of this machine (measured once, then read from a file). Each
+	// block size is timed too, to compare with the prediction.
+	const char *calibration_file = "bsr_calibration.txt";
+	bsr_calibration calibration;
+	int calibrated = 0;
+	if (bsr_calibration_load(&calibration, calibration_file) != 0){
+		bsr_calibrate(&calibration);
+		bsr_calibration_save(&calibration, calibration_file);
+		calibrated = 1;
+	}
+	bsr_matrix scalar, tuned;
+	bsr_tuning tuning;
+	double tuning_spmv[BSR_TUNING_MAX_BLOCK + 1];
+	bsr_reblock(&A, 1, &scalar);
+	begin = omp_get_wtime();
+	bsr_tune(&scalar, &calibration, 0.02, &tuning);
+	double tuning_time = omp_get_wtime() - begin;
+	double *x_tuned = malloc(sizeof(double)*(A.ncolumns + BSR_TUNING_MAX_BLOCK));
+	double *y_tuned = malloc(sizeof(double)*(A.nrows + BSR_TUNING_MAX_BLOCK));
+	for (int i = 0; i < A.ncolumns + BSR_TUNING_MAX_BLOCK; ++i) x_tuned[i] = 1.0;
+	for (int bs = 1; bs <= BSR_TUNING_MAX_BLOCK; ++bs){
+		bsr_reblock(&scalar, bs, &tuned);
+		begin = omp_get_wtime();
+		for (int r = 0; r < repetitions/5; ++r) bsr_spmv(&tuned, x_tuned, y_tuned, 1.0, 0.0);
+		tuning_spmv[bs] = (omp_get_wtime() - begin) / (repetitions/5);
+		bsr_free(&tuned);
+	}
+	bsr_free(&scalar);
+	free(x_tuned);
+	free(y_tuned);
+
+	// Preconditioners
+	block_jacobi jacobi;
+	block_ilu ilu;
+	begin = omp_get_wtime();
+	int jacobi_status = block_jacobi_init(&jacobi, &A);
+	double jacobi_time = omp_get_wtime() - begin;
+	begin = omp_get_wtime();
+	int ilu_status = block_ilu_init(&ilu, &A);
+	double ilu_time = omp_get_wtime() - begin;
+	preconditioner jacobi_M = {block_jacobi_apply, &jacobi};
+	preconditioner ilu_M = {block_ilu_apply, &ilu};
+
+	// A*u = b with b = A*u_exact, from u = 0
+	double *b = malloc(sizeof(double)*size);
+	double *u = malloc(sizeof(double)*A.ncolumns);
+	for (int i = 0; i < A.ncolumns; ++i) u[i] = cos(i);
+	bsr_spmv(&A, u, b, 1.0, 0.0);
+	int n_solves = 5;
+	const char *solve_names[5] = {"CG", "CG + block-Jacobi", "CG + block ILU(0)", "BiCGSTAB", "BiCGSTAB + block ILU(0)"};
+	preconditioner *solve_M[5] = {NULL, &jacobi_M, &ilu_M, NULL, &ilu_M};
+	int solve_done[5];
+	solver_stats solve_stats[5];
+	double solve_errors[5];
+	for (int s = 0; s < n_solves; ++s){
+		solve_done[s] = !((solve_M[s] == &jacobi_M && jacobi_status != 0) || (solve_M[s] == &ilu_M && ilu_status != 0));
+		if (!solve_done[s]) continue;
+		memset(u, 0, sizeof(double)*A.ncolumns);
+		if (s < 3) solver_cg(&A, b, u, 1e-8, 2000, solve_M[s], &solve_stats[s]);
+		else solver_bicgstab(&A, b, u, 1e-8, 2000, solve_M[s], &solve_stats[s]);
+		solve_errors[s] = 0;
+		for (int i = 0; i < A.ncolumns; ++i) solve_errors[s] = fmax(solve_errors[s], fabs(u[i] - cos(i)));
+	}
+
+	// Compressed storage: SpMV with each variant of bsr_compress, then the CG solve by
+	// iterative refinement, the iterations running on the 16-bit/float copy of A
+	const char *storage_names[4] = {"32-bit columns, double", "16-bit deltas, double", "32-bit columns, float", "16-bit deltas, float"};
+	double storage_spmv[4];
+	long storage_bytes[4];
+	bsr_matrix compressed;
+	for (int storage = 0; storage < 4; ++storage){
+		bsr_matrix *matrix = &A;
+		if (storage > 0){
+			bsr_compress(&A, storage, &compressed);
+			matrix = &compressed;
+		}
+		storage_bytes[storage] = bsr_storage_bytes(matrix);
+		begin = omp_get_wtime();
+		for (int r = 0; r < repetitions; ++r) bsr_spmv(matrix, x, y, 1.0, 0.0);
+		storage_spmv[storage] = (omp_get_wtime() - begin) / repetitions;
+		if (storage > 0 && storage < 3) bsr_free(&compressed);
+	}
+	solver_stats refine_stats;
+	memset(u, 0, sizeof(double)*A.ncolumns);
+	solver_refine(&A, &compressed, solver_cg, b, u, 1e-8, 1e-4, 2000, NULL, &refine_stats);
+	double refine_error = 0;
+	for (int i = 0; i < A.ncolumns; ++i) refine_error = fmax(refine_error, fabs(u[i] - cos(i)));
+	bsr_free(&compressed);
+
+	// k right-hand sides at once, stored row-major: SpMM against k SpMVs, then block CG
+	int k = 8;
+	double *U = malloc(sizeof(double)*A.ncolumns*k);
+	double *B = malloc(sizeof(double)*size*k);
+	for (int i = 0; i < A.ncolumns; ++i){
+		for (int j = 0; j < k; ++j) U[(long)i*k + j] = cos((1 + 0.1*j)*i);
+	}
+	begin = omp_get_wtime();
+	for (int r = 0; r < repetitions/10; ++r) bsr_spmm(&A, k, U, B, 1.0, 0.0);
+	double elapsed_spmm = (omp_get_wtime() - begin) / (repetitions/10);
+	solver_stats block_stats;
+	memset(U, 0, sizeof(double)*A.ncolumns*k);
+	solver_block_cg(&A, k, B, U, 1e-8, 2000, NULL, &block_stats);
+	double block_error = 0;
+	for (int i = 0; i < A.ncolumns; ++i){
+		for (int j = 0; j < k; ++j) block_error = fmax(block_error, fabs(U[(long)i*k + j] - cos((1 + 0.1*j)*i)));
+	}
 
 	//======================= POST-PROCESSING ===========================//
+	printf("Matrix: %d x %d, %d blocks of %d x %d\n", A.nrows, A.ncolumns, A.nnzb, block_size, block_size);
+	if (argc > 1) printf("Loaded %s in %.4f s%s\n", argv[1], load_time, (mapped) ? " (mapped)" : "");
+	else printf("Assembly: %ld triplets in %.4f s\n", n_triplets, load_time);
+	printf("SpMV: %.4f ms, %.2f GFlop/s, using %d threads\n", 1e3*elapsed, 2.0*A.nnzb*A.n_elements_per_block/elapsed/1e9, omp_get_max_threads());
+	printf("Generic kernel: %.4f ms, specialized kernel%s: x%.2f\n", 1e3*elapsed_generic, (bsr_cpu_has_avx2()) ? " (AVX2)" : "", elapsed_generic/elapsed);
+	if (reorder_status == 0){
+		for (int o = 0; o < 3; ++o){
+			printf("%-20s: bandwidth %ld, profile %ld blocks, SpMV %.4f ms (x%.2f)", reorder_names[o], bandwidths[o], profiles[o], 1e3*reorder_spmv[o], reorder_spmv[0]/reorder_spmv[o]);
+			if (o > 0) printf(", reordered in %.4f s", reorder_times[o-1]);
+			printf("\n");
+		}
+	}
+	printf("Block size analysis in %.4f s (calibration %s %s):\n", tuning_time, (calibrated) ? "measured, saved to" : "read from", calibration_file);
+	for (int bs = 1; bs <= BSR_TUNING_MAX_BLOCK; ++bs){
+		printf("    %d x %d: fill %.3f, SpMV predicted %.4f ms, measured %.4f ms%s\n", bs, bs, tuning.fill[bs], 1e3*tuning.predicted[bs],
+			1e3*tuning_spmv[bs], (bs == tuning.block_size) ? " <- chosen" : "");
+	}
+	if (jacobi_status == 0) printf("Block-Jacobi setup: %.4f s\n", jacobi_time);
+	if (ilu_status == 0) printf("Block ILU(0) setup: %.4f s, %d + %d levels for %d block rows\n", ilu_time, ilu.lower.nlevels, ilu.upper.nlevels, A.nrows/block_size);
+	for (int s = 0; s < n_solves; ++s){
+		if (!solve_done[s]) continue;
+		solver_stats_print(&solve_stats[s], solve_names[s]);
+		printf("    max error on u: %.3e\n", solve_errors[s]);
+		solver_stats_free(&solve_stats[s]);
+	}
+	for (int storage = 0; storage < 4; ++storage){
+		printf("%-22s: %.2f MB, SpMV %.4f ms (x%.2f)\n", storage_names[storage], storage_bytes[storage]/1e6, 1e3*storage_spmv[storage], storage_spmv[0]/storage_spmv[storage]);
+	}
+	solver_stats_print(&refine_stats, "CG, mixed-precision refinement");
+	printf("    max error on u: %.3e, x%.2f against CG\n", refine_error, solve_stats[0].time/refine_stats.time);
+	solver_stats_free(&refine_stats);
+	printf("SpMM with %d vectors: %.4f ms, x%.2f against %d SpMVs\n", k, 1e3*elapsed_spmm, k*elapsed/elapsed_spmm, k);
+	solver_stats_print(&block_stats, "Block CG");
+	printf("    %d right-hand sides, max error on U: %.3e, x%.2f against %d CG solves\n", k, block_error, k*solve_stats[0].time/block_stats.time, k);
+	solver_stats_free(&block_stats);
+	free(U);
+	free(B);
+	free(x);
+	free(y);
+	free(b);
+	free(u);
+	if (jacobi_status == 0) block_jacobi_free(&jacobi);
+	if (ilu_status == 0) block_ilu_free(&ilu);
+	if (mapped) bsr_unmap(&mapping);
+	else bsr_free(&A);
 	
 	//======================= END OF PROGRAM ============================//
 
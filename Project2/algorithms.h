@@ -8,11 +8,249 @@
 *	Under GNU General Public License 11/2018
 =======================================================================================*/
 
+#ifndef ALGORITHMS_H
+#define ALGORITHMS_H
+
+#include <string.h>
+
 /*=====================================================================================
 * Contains general purpose algorithms, can be used anywhere
+* The dense vector kernels are shared between the threads (static schedule, so that
+* a thread works on the same entries from one call to the next). The fused ones do
+* an update and the dot products of its result in a single pass over the vectors.
+* Multi-vectors are n x k, row-major (X[i*k + j] is the entry i of the vector j), with
+* k x k row-major coefficient matrices.
 =====================================================================================*/
 
-// Merges two lists and stores the result ... somewhere
-int list_merge(int list_A, int list_B){
+// Prototypes
+int list_merge(unsigned int *A, int n_A, unsigned int *B, int n_B, unsigned int *C);
+int list_gallop(unsigned int *list, int first, int n, unsigned int value);
+/*==============*/
+double vector_dot(int n, double *x, double *y);
+void vector_axpy(int n, double alpha, double *x, double *y);
+void vector_xpby(int n, double *x, double beta, double *y);
+double vector_waxpy_dot(int n, double alpha, double *x, double *y, double *w);
+void vector_dot2(int n, double *x, double *y, double *xy, double *xx);
+double vector_cg_update(int n, double alpha, double *p, double *Ap, double *x, double *r);
+void vector_bicg_direction(int n, double *r, double beta, double omega, double *v, double *p);
+void vector_bicg_update(int n, double alpha, double *p_hat, double omega, double *s_hat, double *s, double *t, double *x, double *r, double *r0, double *rr, double *r0r);
+/*==============*/
+void multivector_gram(int n, int k, double *X, double *Y, double *G);
+void multivector_gram2(int n, int k, double *X, double *Y, double *Z, double *G, double *H);
+void multivector_cg_update(int n, int k, double *alpha, double *P, double *Q, double *X, double *R, double *rr);
+void multivector_cg_direction(int n, int k, double *Z, double *beta, double *P);
+
+
+/*=====================================================================================*/
+
+
+/*============== Sorted lists ===================*/
+// Union of two increasing lists into C (room for n_A + n_B values), returns its length.
+// With C = NULL the union is only counted. C may not be A or B.
+int list_merge(unsigned int *A, int n_A, unsigned int *B, int n_B, unsigned int *C){
+	int a = 0, b = 0, c = 0;
+	while ((a < n_A) && (b < n_B)){
+		unsigned int value = (A[a] <= B[b]) ? A[a] : B[b];
+		if (A[a] == value) ++a;
+		if (B[b] == value) ++b;
+		if (C != NULL) C[c] = value;
+		++c;
+	}
+	for (; a < n_A; ++a, ++c) if (C != NULL) C[c] = A[a];
+	for (; b < n_B; ++b, ++c) if (C != NULL) C[c] = B[b];
+	return c;
+}
+
+// First position p >= first of an increasing list with list[p] >= value (n if none).
+// Galloping: steps of 1, 2, 4... then a binary search, O(log(p - first)).
+int list_gallop(unsigned int *list, int first, int n, unsigned int value){
+	if ((first >= n) || (list[first] >= value)) return first;
+	int low = first, step = 1; // list[low] < value
+	while ((low + step < n) && (list[low + step] < value)){
+		low += step;
+		step *= 2;
+	}
+	int high = (low + step < n) ? low + step : n; // list[high] >= value, or high = n
+	while (high - low > 1){
+		int middle = low + (high - low)/2;
+		if (list[middle] < value) low = middle;
+		else high = middle;
+	}
+	return high;
+}
+
+
+/*============== Dense vectors ===================*/
+// x.y
+double vector_dot(int n, double *x, double *y){
+	double sum = 0;
+	#pragma omp parallel for schedule(static) reduction(+:sum)
+	for (int i = 0; i < n; ++i) sum += x[i]*y[i];
+	return sum;
+}
+
+// y += alpha*x
+void vector_axpy(int n, double alpha, double *x, double *y){
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < n; ++i) y[i] += alpha*x[i];
+}
+
+// y = x + beta*y
+void vector_xpby(int n, double *x, double beta, double *y){
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < n; ++i) y[i] = x[i] + beta*y[i];
+}
+
+// w = y + alpha*x, returns w.w
+double vector_waxpy_dot(int n, double alpha, double *x, double *y, double *w){
+	double sum = 0;
+	#pragma omp parallel for schedule(static) reduction(+:sum)
+	for (int i = 0; i < n; ++i){
+		w[i] = y[i] + alpha*x[i];
+		sum += w[i]*w[i];
+	}
+	return sum;
+}
+
+// x.y and x.x in one pass
+void vector_dot2(int n, double *x, double *y, double *xy, double *xx){
+	double sum_xy = 0, sum_xx = 0;
+	#pragma omp parallel for schedule(static) reduction(+:sum_xy, sum_xx)
+	for (int i = 0; i < n; ++i){
+		sum_xy += x[i]*y[i];
+		sum_xx += x[i]*x[i];
+	}
+	*xy = sum_xy;
+	*xx = sum_xx;
+}
+
+// CG step: x += alpha*p, r -= alpha*Ap, returns r.r
+double vector_cg_update(int n, double alpha, double *p, double *Ap, double *x, double *r){
+	double sum = 0;
+	#pragma omp parallel for schedule(static) reduction(+:sum)
+	for (int i = 0; i < n; ++i){
+		x[i] += alpha*p[i];
+		r[i] -= alpha*Ap[i];
+		sum += r[i]*r[i];
+	}
+	return sum;
+}
+
+// BiCGSTAB direction: p = r + beta*(p - omega*v)
+void vector_bicg_direction(int n, double *r, double beta, double omega, double *v, double *p){
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < n; ++i) p[i] = r[i] + beta*(p[i] - omega*v[i]);
+}
+
+// BiCGSTAB step: x += alpha*p_hat + omega*s_hat, r = s - omega*t, with r.r and r0.r
+// (p_hat and s_hat are the preconditioned p and s, or p and s themselves)
+void vector_bicg_update(int n, double alpha, double *p_hat, double omega, double *s_hat, double *s, double *t, double *x, double *r, double *r0, double *rr, double *r0r){
+	double sum_rr = 0, sum_r0r = 0;
+	#pragma omp parallel for schedule(static) reduction(+:sum_rr, sum_r0r)
+	for (int i = 0; i < n; ++i){
+		x[i] += alpha*p_hat[i] + omega*s_hat[i];
+		r[i] = s[i] - omega*t[i];
+		sum_rr += r[i]*r[i];
+		sum_r0r += r0[i]*r[i];
+	}
+	*rr = sum_rr;
+	*r0r = sum_r0r;
+}
+
+
+/*============== Dense multi-vectors ===================*/
+// G = X^T*Y (k x k)
+void multivector_gram(int n, int k, double *X, double *Y, double *G){
+	memset(G, 0, sizeof(double) * k*k);
+	#pragma omp parallel
+	{
+		double local[k*k];
+		memset(local, 0, sizeof(double) * k*k);
+		#pragma omp for schedule(static)
+		for (int i = 0; i < n; ++i){
+			double *X_row = &X[(long)i*k], *Y_row = &Y[(long)i*k];
+			for (int a = 0; a < k; ++a){
+				double x = X_row[a];
+				#pragma omp simd
+				for (int b = 0; b < k; ++b) local[a*k + b] += x*Y_row[b];
+			}
+		}
+		#pragma omp critical
+		for (int e = 0; e < k*k; ++e) G[e] += local[e];
+	}
+}
+
+// G = X^T*Y and H = X^T*Z in one pass over X
+void multivector_gram2(int n, int k, double *X, double *Y, double *Z, double *G, double *H){
+	memset(G, 0, sizeof(double) * k*k);
+	memset(H, 0, sizeof(double) * k*k);
+	#pragma omp parallel
+	{
+		double local_G[k*k], local_H[k*k];
+		memset(local_G, 0, sizeof(double) * k*k);
+		memset(local_H, 0, sizeof(double) * k*k);
+		#pragma omp for schedule(static)
+		for (int i = 0; i < n; ++i){
+			double *X_row = &X[(long)i*k], *Y_row = &Y[(long)i*k], *Z_row = &Z[(long)i*k];
+			for (int a = 0; a < k; ++a){
+				double x = X_row[a];
+				#pragma omp simd
+				for (int b = 0; b < k; ++b){
+					local_G[a*k + b] += x*Y_row[b];
+					local_H[a*k + b] += x*Z_row[b];
+				}
+			}
+		}
+		#pragma omp critical
+		for (int e = 0; e < k*k; ++e){
+			G[e] += local_G[e];
+			H[e] += local_H[e];
+		}
+	}
+}
+
+// Block CG step: X += P*alpha, R -= Q*alpha, rr[j] = r_j.r_j
+void multivector_cg_update(int n, int k, double *alpha, double *P, double *Q, double *X, double *R, double *rr){
+	memset(rr, 0, sizeof(double) * k);
+	#pragma omp parallel
+	{
+		double local[k];
+		memset(local, 0, sizeof(double) * k);
+		#pragma omp for schedule(static)
+		for (int i = 0; i < n; ++i){
+			double *P_row = &P[(long)i*k], *Q_row = &Q[(long)i*k], *X_row = &X[(long)i*k], *R_row = &R[(long)i*k];
+			for (int a = 0; a < k; ++a){
+				double p = P_row[a], q = Q_row[a];
+				#pragma omp simd
+				for (int b = 0; b < k; ++b){
+					X_row[b] += p*alpha[a*k + b];
+					R_row[b] -= q*alpha[a*k + b];
+				}
+			}
+			for (int b = 0; b < k; ++b) local[b] += R_row[b]*R_row[b];
+		}
+		#pragma omp critical
+		for (int b = 0; b < k; ++b) rr[b] += local[b];
+	}
+}
+
+// Block CG direction: P = Z + P*beta
+void multivector_cg_direction(int n, int k, double *Z, double *beta, double *P){
+	#pragma omp parallel
+	{
+		double row[k];
+		#pragma omp for schedule(static)
+		for (int i = 0; i < n; ++i){
+			double *P_row = &P[(long)i*k];
+			memcpy(row, &Z[(long)i*k], sizeof(double) * k);
+			for (int a = 0; a < k; ++a){
+				double p = P_row[a];
+				#pragma omp simd
+				for (int b = 0; b < k; ++b) row[b] += p*beta[a*k + b];
+			}
+			memcpy(P_row, row, sizeof(double) * k);
+		}
+	}
+}
 
-}
\ No newline at end of file
+#endif
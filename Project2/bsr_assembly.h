@@ -0,0 +1,235 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef BSR_ASSEMBLY_H
+#define BSR_ASSEMBLY_H
+
+#include <limits.h>
+#include <string.h>
+#include <omp.h>
+#include "CSR_BSR.h"
+
+/*=====================================================================================
+* Builds a BSR matrix from (row, column, value) triplets, without any dense matrix.
+* Every OpenMP thread appends to its own list, so that elements can be assembled in a
+* parallel loop. Duplicates are summed. The build is a counting sort on the block rows
+* followed by a sort of each block row on the block columns: memory is O(# of triplets).
+=====================================================================================*/
+
+// Structures
+// Triplets added by one thread
+typedef struct bsr_triplets bsr_triplets;
+struct bsr_triplets{
+	long count;
+	long capacity;
+	unsigned int *rows;
+	unsigned int *columns;
+	double *values;
+};
+
+typedef struct bsr_assembly bsr_assembly;
+struct bsr_assembly{
+	int nrows;
+	int ncolumns;
+	int block_size;
+	int nlists; // One per thread
+	bsr_triplets *lists;
+};
+
+// Triplet sorted into its block row
+typedef struct bsr_entry bsr_entry;
+struct bsr_entry{
+	unsigned int block_column;
+	unsigned int position; // In the block, row-major
+	long source; // Order of addition, duplicates are summed in that order
+	double value;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int bsr_assembly_init(bsr_assembly *assembly, int nrows, int ncolumns, int block_size);
+int bsr_assembly_add(bsr_assembly *assembly, int row, int column, double value);
+int bsr_assembly_add_block(bsr_assembly *assembly, int block_row, int block_column, double *block);
+long bsr_assembly_count(bsr_assembly *assembly);
+int bsr_assembly_build(bsr_assembly *assembly, bsr_matrix *matrix);
+void bsr_assembly_free(bsr_assembly *assembly);
+
+
+/*=====================================================================================*/
+
+
+/*============== Triplets ===================*/
+// Empty assembly of a nrows x ncolumns matrix, for up to omp_get_max_threads() threads
+int bsr_assembly_init(bsr_assembly *assembly, int nrows, int ncolumns, int block_size){
+	if ((nrows%block_size != 0) || (ncolumns%block_size != 0)){
+		printf("!!! The block size is incompatible with the matrix size.\n");
+		return -1;
+	}
+	assembly->nrows = nrows;
+	assembly->ncolumns = ncolumns;
+	assembly->block_size = block_size;
+	assembly->nlists = omp_get_max_threads();
+	assembly->lists = calloc(assembly->nlists, sizeof(bsr_triplets));
+	return 0;
+}
+
+// Appends a triplet to the list of the calling thread, no lock needed
+int bsr_assembly_add(bsr_assembly *assembly, int row, int column, double value){
+	if ((row < 0) || (row >= assembly->nrows) || (column < 0) || (column >= assembly->ncolumns)){
+		printf("!!! Triplet (%d, %d) out of the matrix.\n", row, column);
+		return -1;
+	}
+	int thread = omp_get_thread_num();
+	if (thread >= assembly->nlists){
+		printf("!!! More threads than when the assembly was created.\n");
+		return -1;
+	}
+	bsr_triplets *list = &assembly->lists[thread];
+	if (list->count == list->capacity){
+		list->capacity = (list->capacity == 0) ? 1024 : 2*list->capacity;
+		list->rows = realloc(list->rows, sizeof(int) * list->capacity);
+		list->columns = realloc(list->columns, sizeof(int) * list->capacity);
+		list->values = realloc(list->values, sizeof(double) * list->capacity);
+	}
+	list->rows[list->count] = row;
+	list->columns[list->count] = column;
+	list->values[list->count] = value;
+	++list->count;
+	return 0;
+}
+
+// Appends a whole row-major block, e.g. a 3x3 block of an element matrix
+int bsr_assembly_add_block(bsr_assembly *assembly, int block_row, int block_column, double *block){
+	int block_size = assembly->block_size;
+	for (int k = 0; k < block_size; ++k){
+		for (int l = 0; l < block_size; ++l){
+			if (bsr_assembly_add(assembly, block_row*block_size + k, block_column*block_size + l, block[k*block_size + l]) != 0) return -1;
+		}
+	}
+	return 0;
+}
+
+// # of triplets added so far
+long bsr_assembly_count(bsr_assembly *assembly){
+	long count = 0;
+	for (int t = 0; t < assembly->nlists; ++t) count += assembly->lists[t].count;
+	return count;
+}
+
+
+/*============== Build ===================*/
+// Order of the entries of a block row: block column, then order of addition
+int bsr_entry_compare(const void *a, const void *b){
+	const bsr_entry *p = a, *q = b;
+	if (p->block_column != q->block_column) return (p->block_column < q->block_column) ? -1 : 1;
+	return (p->source < q->source) ? -1 : (p->source > q->source);
+}
+
+// Builds the BSR matrix from the triplets, the assembly may then be freed or extended.
+// Every block holding at least one triplet is stored, even if its values sum to 0.
+int bsr_assembly_build(bsr_assembly *assembly, bsr_matrix *matrix){
+	int block_size = assembly->block_size;
+	int n_block_rows = assembly->nrows / block_size;
+	int n_elements_per_block = block_size*block_size;
+	long count = bsr_assembly_count(assembly);
+	long *list_starts = malloc(sizeof(long) * (assembly->nlists + 1)); // Source of the first triplet of each list
+	list_starts[0] = 0;
+	for (int t = 0; t < assembly->nlists; ++t) list_starts[t+1] = list_starts[t] + assembly->lists[t].count;
+
+	// Pass 1: # of triplets per block row, then where each block row starts
+	long *row_starts = calloc(n_block_rows + 1, sizeof(long));
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int t = 0; t < assembly->nlists; ++t){
+		bsr_triplets *list = &assembly->lists[t];
+		for (long p = 0; p < list->count; ++p){
+			#pragma omp atomic
+			++row_starts[list->rows[p]/block_size + 1];
+		}
+	}
+	for (int I = 0; I < n_block_rows; ++I) row_starts[I+1] += row_starts[I];
+
+	// Pass 2: triplets scattered into their block row
+	bsr_entry *entries = malloc(sizeof(bsr_entry) * (count > 0 ? count : 1));
+	long *fill = malloc(sizeof(long) * (n_block_rows + 1));
+	memcpy(fill, row_starts, sizeof(long) * (n_block_rows + 1));
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int t = 0; t < assembly->nlists; ++t){
+		bsr_triplets *list = &assembly->lists[t];
+		for (long p = 0; p < list->count; ++p){
+			unsigned int row = list->rows[p], column = list->columns[p];
+			long slot;
+			#pragma omp atomic capture
+			slot = fill[row/block_size]++;
+			entries[slot].block_column = column/block_size;
+			entries[slot].position = (row%block_size)*block_size + column%block_size;
+			entries[slot].source = list_starts[t] + p;
+			entries[slot].value = list->values[p];
+		}
+	}
+	free(fill);
+	free(list_starts);
+
+	// Pass 3: each block row sorted, its distinct block columns counted
+	unsigned int *row_nnzb = malloc(sizeof(int) * (n_block_rows + 1));
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int I = 0; I < n_block_rows; ++I){
+		long first = row_starts[I], last = row_starts[I+1];
+		qsort(&entries[first], last - first, sizeof(bsr_entry), bsr_entry_compare);
+		unsigned int nnzb = 0;
+		for (long p = first; p < last; ++p){
+			if ((p == first) || (entries[p].block_column != entries[p-1].block_column)) ++nnzb;
+		}
+		row_nnzb[I] = nnzb;
+	}
+	long nnzb = 0;
+	for (int I = 0; I < n_block_rows; ++I) nnzb += row_nnzb[I];
+	if (nnzb > INT_MAX){
+		printf("!!! Too many blocks for the BSR matrix.\n");
+		free(row_nnzb);
+		free(entries);
+		free(row_starts);
+		return -1;
+	}
+
+	// Pass 4: blocks written, duplicates summed
+	bsr_init(matrix, assembly->nrows, assembly->ncolumns, block_size, (int)nnzb);
+	matrix->block_row_offsets[0] = 0;
+	for (int I = 0; I < n_block_rows; ++I) matrix->block_row_offsets[I+1] = matrix->block_row_offsets[I] + row_nnzb[I];
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int I = 0; I < n_block_rows; ++I){
+		long b = (long)matrix->block_row_offsets[I] - 1;
+		for (long p = row_starts[I]; p < row_starts[I+1]; ++p){
+			if ((p == row_starts[I]) || (entries[p].block_column != entries[p-1].block_column)){
+				++b;
+				matrix->block_columns[b] = entries[p].block_column;
+				memset(&matrix->values[b*n_elements_per_block], 0, sizeof(double) * n_elements_per_block);
+			}
+			matrix->values[b*n_elements_per_block + entries[p].position] += entries[p].value;
+		}
+	}
+
+	free(row_nnzb);
+	free(entries);
+	free(row_starts);
+	return 0;
+}
+
+// Frees the triplets
+void bsr_assembly_free(bsr_assembly *assembly){
+	for (int t = 0; t < assembly->nlists; ++t){
+		free(assembly->lists[t].rows);
+		free(assembly->lists[t].columns);
+		free(assembly->lists[t].values);
+	}
+	free(assembly->lists);
+}
+
+#endif
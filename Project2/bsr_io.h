@@ -0,0 +1,325 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef BSR_IO_H
+#define BSR_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+#include "CSR_BSR.h"
+#include "bsr_assembly.h"
+
+/*=====================================================================================
+* Loading and saving BSR matrices.
+* - Matrix Market (.mtx) coordinate files are parsed by every thread at once, each one
+*   on its own share of the lines, straight into a bsr_assembly.
+* - The binary format is a header followed by block_row_offsets, block_columns and values,
+*   each one starting on a 64-byte boundary. The file is mapped and the matrix points into
+*   the mapping: nothing is read or converted before the pages are used.
+=====================================================================================*/
+
+#define BSR_FILE_MAGIC "BSRMAT1"
+#define BSR_FILE_ALIGN 64
+
+// Structures
+// Header of a binary BSR file, in the byte order of the machine that wrote it
+typedef struct bsr_file_header bsr_file_header;
+struct bsr_file_header{
+	char magic[8];
+	int nrows;
+	int ncolumns;
+	int block_size;
+	int nnzb;
+	long offsets_position; // Byte positions of the arrays in the file
+	long columns_position;
+	long values_position;
+	long file_size;
+};
+
+// Mapping that a matrix loaded by bsr_map points into
+typedef struct bsr_mapping bsr_mapping;
+struct bsr_mapping{
+	void *address;
+	size_t length;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int bsr_read_mtx(const char *filename, bsr_matrix *matrix, int block_size);
+/*==============*/
+int bsr_save(bsr_matrix *matrix, const char *filename);
+int bsr_map(const char *filename, bsr_matrix *matrix, bsr_mapping *mapping);
+void bsr_unmap(bsr_mapping *mapping);
+
+
+/*=====================================================================================*/
+
+
+/*============== Matrix Market ===================*/
+// Copy of the line starting at position, NUL-terminated and without its newline. Free it.
+static char *bsr_mtx_line(const char *text, size_t length, size_t position){
+	size_t end = position;
+	while ((end < length) && (text[end] != '\n')) ++end;
+	char *line = malloc(end - position + 1);
+	memcpy(line, text + position, end - position);
+	line[end - position] = '\0';
+	return line;
+}
+
+// Reads a real, integer or pattern coordinate file, general, symmetric or skew-symmetric.
+// Sizes that are not a multiple of block_size are padded; padded rows of a square matrix
+// get a 1 on the diagonal so that the matrix stays invertible.
+int bsr_read_mtx(const char *filename, bsr_matrix *matrix, int block_size){
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0){
+		printf("!!! Error while opening %s.\n", filename);
+		return -1;
+	}
+	struct stat info;
+	fstat(fd, &info);
+	size_t length = info.st_size;
+	char *text = (length > 0) ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (text == MAP_FAILED){
+		printf("!!! Error while mapping %s.\n", filename);
+		return -1;
+	}
+
+	// Banner. The mapping is not NUL-terminated: the header lines are copied out before sscanf
+	char object[32] = "", format[32] = "", field[32] = "", symmetry[32] = "";
+	char *banner = bsr_mtx_line(text, length, 0);
+	int banner_fields = sscanf(banner, "%%%%MatrixMarket %31s %31s %31s %31s", object, format, field, symmetry);
+	free(banner);
+	if ((banner_fields != 4) || (strcmp(object, "matrix") != 0) || (strcmp(format, "coordinate") != 0)){
+		printf("!!! %s is not a Matrix Market coordinate file.\n", filename);
+		munmap(text, length);
+		return -1;
+	}
+	int pattern = (strcmp(field, "pattern") == 0);
+	int mirror = (strcmp(symmetry, "symmetric") == 0) ? 1 : (strcmp(symmetry, "skew-symmetric") == 0) ? -1 : 0;
+	if ((!pattern && (strcmp(field, "real") != 0) && (strcmp(field, "integer") != 0)) ||
+	    (mirror == 0 && strcmp(symmetry, "general") != 0)){
+		printf("!!! Unsupported Matrix Market field or symmetry: %s %s.\n", field, symmetry);
+		munmap(text, length);
+		return -1;
+	}
+
+	// Comments, then the size line
+	size_t position = 0;
+	while ((position < length) && (text[position] == '%' || text[position] == '\n')){
+		while ((position < length) && (text[position] != '\n')) ++position;
+		++position;
+	}
+	int nrows, ncolumns;
+	long nnz;
+	char *size_line = (position < length) ? bsr_mtx_line(text, length, position) : NULL;
+	int size_fields = (size_line != NULL) ? sscanf(size_line, "%d %d %ld", &nrows, &ncolumns, &nnz) : 0;
+	free(size_line);
+	if (size_fields != 3){
+		printf("!!! Missing size line in %s.\n", filename);
+		munmap(text, length);
+		return -1;
+	}
+	while ((position < length) && (text[position] != '\n')) ++position;
+	size_t body = position + 1;
+
+	int padded_rows = (nrows + block_size - 1)/block_size*block_size;
+	int padded_columns = (ncolumns + block_size - 1)/block_size*block_size;
+	bsr_assembly assembly;
+	bsr_assembly_init(&assembly, padded_rows, padded_columns, block_size);
+	long n_read = 0;
+	int failed = 0;
+
+	// Each thread parses the lines starting in its share of the bytes
+	#pragma omp parallel reduction(+:n_read) reduction(|:failed)
+	{
+		int thread = omp_get_thread_num(), nthreads = omp_get_num_threads();
+		size_t share = (length > body) ? length - body : 0;
+		size_t p = body + share*thread/nthreads;
+		size_t end = body + share*(thread + 1)/nthreads;
+		if ((p > body) && (text[p-1] != '\n')){
+			while ((p < length) && (text[p] != '\n')) ++p;
+			++p;
+		}
+		while (p < end){
+			// The numbers are parsed in the mapping, a number ending past the newline belongs
+			// to the next line. Only a last line without newline is copied, strtol must stop
+			// before the end of the mapping.
+			size_t line_end = p;
+			while ((line_end < length) && (text[line_end] != '\n')) ++line_end;
+			char *line = text + p, *copy = NULL;
+			if (line_end == length){
+				copy = malloc(line_end - p + 1);
+				memcpy(copy, text + p, line_end - p);
+				copy[line_end - p] = '\0';
+				line = copy;
+			}
+			char *limit = line + (line_end - p);
+			p = line_end + 1;
+
+			char *cursor = line, *next;
+			long i = strtol(cursor, &next, 10);
+			long j = 0;
+			double value = 1.0;
+			int valid = (next != cursor) && (next <= limit);
+			if (valid){
+				cursor = next;
+				j = strtol(cursor, &next, 10);
+				valid = (next != cursor) && (next <= limit);
+			}
+			if (valid && !pattern){
+				cursor = next;
+				value = strtod(cursor, &next);
+				valid = (next != cursor) && (next <= limit);
+			}
+			int blank = (cursor == line) && !valid;
+			free(copy);
+			if (blank) continue;
+			if (!valid || (i < 1) || (i > nrows) || (j < 1) || (j > ncolumns)){
+				failed = 1;
+				continue;
+			}
+			bsr_assembly_add(&assembly, i - 1, j - 1, value);
+			if (mirror != 0 && i != j) bsr_assembly_add(&assembly, j - 1, i - 1, mirror*value);
+			++n_read;
+		}
+	}
+	munmap(text, length);
+	if (failed || n_read != nnz){
+		printf("!!! Bad entries in %s (%ld read, %ld expected).\n", filename, n_read, nnz);
+		bsr_assembly_free(&assembly);
+		return -1;
+	}
+
+	if (nrows == ncolumns){
+		for (int i = nrows; i < padded_rows; ++i) bsr_assembly_add(&assembly, i, i, 1.0);
+	}
+	int status = bsr_assembly_build(&assembly, matrix);
+	bsr_assembly_free(&assembly);
+	return status;
+}
+
+
+/*============== Binary format ===================*/
+// Writes the header and the three arrays of a matrix
+int bsr_save(bsr_matrix *matrix, const char *filename){
+	if (bsr_require_plain(matrix) != 0) return -1;
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL){
+		printf("!!! Error while creating %s.\n", filename);
+		return -1;
+	}
+	long n_block_rows = matrix->nrows / matrix->block_size;
+	bsr_file_header header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, BSR_FILE_MAGIC);
+	header.nrows = matrix->nrows;
+	header.ncolumns = matrix->ncolumns;
+	header.block_size = matrix->block_size;
+	header.nnzb = matrix->nnzb;
+	// Each array starts on a 64-byte boundary
+	#define BSR_ALIGN_UP(x) (((x) + BSR_FILE_ALIGN - 1)/BSR_FILE_ALIGN*BSR_FILE_ALIGN)
+	header.offsets_position = BSR_ALIGN_UP((long)sizeof(header));
+	header.columns_position = BSR_ALIGN_UP(header.offsets_position + (long)sizeof(int)*(n_block_rows + 1));
+	header.values_position = BSR_ALIGN_UP(header.columns_position + (long)sizeof(int)*matrix->nnzb);
+	header.file_size = header.values_position + (long)sizeof(double)*matrix->nnzb*matrix->n_elements_per_block;
+	#undef BSR_ALIGN_UP
+
+	char zeros[BSR_FILE_ALIGN] = {0};
+	int status = (fwrite(&header, sizeof(header), 1, file) == 1);
+	status &= (fwrite(zeros, 1, header.offsets_position - sizeof(header), file) == (size_t)(header.offsets_position - sizeof(header)));
+	status &= (fwrite(matrix->block_row_offsets, sizeof(int), n_block_rows + 1, file) == (size_t)(n_block_rows + 1));
+	long written = header.offsets_position + (long)sizeof(int)*(n_block_rows + 1);
+	status &= (fwrite(zeros, 1, header.columns_position - written, file) == (size_t)(header.columns_position - written));
+	status &= (fwrite(matrix->block_columns, sizeof(int), matrix->nnzb, file) == (size_t)matrix->nnzb);
+	written = header.columns_position + (long)sizeof(int)*matrix->nnzb;
+	status &= (fwrite(zeros, 1, header.values_position - written, file) == (size_t)(header.values_position - written));
+	long n_values = (long)matrix->nnzb*matrix->n_elements_per_block;
+	status &= (fwrite(matrix->values, sizeof(double), n_values, file) == (size_t)n_values);
+	status &= (fclose(file) == 0);
+	if (!status){
+		printf("!!! Error while writing %s.\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+// Tells whether an array of count elements starting at position lies inside the file,
+// after the header and aligned for its elements
+static int bsr_file_array_fits(const bsr_file_header *header, long position, long count, long element){
+	return (position >= (long)sizeof(bsr_file_header)) && (position%element == 0) && (position <= header->file_size) &&
+	       (count >= 0) && (count <= (header->file_size - position)/element);
+}
+
+// Maps a binary file and points the matrix into it. The pages are private: the matrix may
+// be modified in place without changing the file. Free it with bsr_unmap, not bsr_free.
+int bsr_map(const char *filename, bsr_matrix *matrix, bsr_mapping *mapping){
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0){
+		printf("!!! Error while opening %s.\n", filename);
+		return -1;
+	}
+	struct stat info;
+	fstat(fd, &info);
+	bsr_file_header header;
+	if ((info.st_size < (off_t)sizeof(header)) || (read(fd, &header, sizeof(header)) != sizeof(header)) ||
+	    (memcmp(header.magic, BSR_FILE_MAGIC, sizeof(BSR_FILE_MAGIC)) != 0) || (header.file_size != info.st_size) ||
+	    (header.block_size <= 0) || (header.nrows < 0) || (header.ncolumns < 0) || (header.nnzb < 0) ||
+	    (header.nrows%header.block_size != 0) || (header.ncolumns%header.block_size != 0) ||
+	    ((long)header.block_size*header.block_size > INT_MAX) ||
+	    !bsr_file_array_fits(&header, header.offsets_position, header.nrows/header.block_size + 1L, sizeof(int)) ||
+	    !bsr_file_array_fits(&header, header.columns_position, header.nnzb, sizeof(int)) ||
+	    !bsr_file_array_fits(&header, header.values_position, (long)header.nnzb*header.block_size*header.block_size, sizeof(double))){
+		printf("!!! %s is not a BSR file.\n", filename);
+		close(fd);
+		return -1;
+	}
+	mapping->length = info.st_size;
+	mapping->address = mmap(NULL, mapping->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping->address == MAP_FAILED){
+		printf("!!! Error while mapping %s.\n", filename);
+		return -1;
+	}
+
+	// The block rows must cover the nnzb blocks exactly. The offsets in between and the
+	// columns are not checked, that would read the whole file before it is used.
+	char *base = mapping->address;
+	const unsigned int *offsets = (const unsigned int *)(base + header.offsets_position);
+	if ((offsets[0] != 0) || (offsets[header.nrows/header.block_size] != (unsigned int)header.nnzb)){
+		printf("!!! %s is not a BSR file.\n", filename);
+		munmap(mapping->address, mapping->length);
+		return -1;
+	}
+	matrix->nrows = header.nrows;
+	matrix->ncolumns = header.ncolumns;
+	matrix->block_size = header.block_size;
+	matrix->nnzb = header.nnzb;
+	matrix->n_elements_per_block = header.block_size*header.block_size;
+	matrix->block_row_offsets = (unsigned int *)(base + header.offsets_position);
+	matrix->block_columns = (unsigned int *)(base + header.columns_position);
+	matrix->values = (double *)(base + header.values_position);
+	memset(&matrix->compressed, 0, sizeof(bsr_compressed));
+	return 0;
+}
+
+void bsr_unmap(bsr_mapping *mapping){
+	munmap(mapping->address, mapping->length);
+}
+
+#endif
@@ -0,0 +1,639 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef BSR_KERNELS_H
+#define BSR_KERNELS_H
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BSR_X86 1
+#include <immintrin.h>
+#else
+#define BSR_X86 0
+#endif
+
+/*=====================================================================================
+* SpMV microkernels: w = alpha*A*x + beta*y over the block rows [first, last).
+* w may be y itself (each entry of y is read before being written), not x.
+* They work on the raw BSR arrays (row-major blocks) so that bsr_spmv can pick one
+* from the block size: block sizes 2, 3, 4 and 8 have kernels with the size known at
+* compile time, and AVX2/FMA versions chosen at run time. The vector kernels sum in
+* another order than the scalar ones, the results may differ in the last bits.
+* The multi-vector kernels (bsr_spmm) apply each block to several vectors at once.
+* The compressed kernels read the storage variants of bsr_compress: 16-bit block column
+* deltas and/or float values, the products being summed in double.
+=====================================================================================*/
+
+// Structure
+// Compressed storage of a bsr_matrix, see bsr_compress. NULL arrays for what is stored plainly.
+// A block row whose block columns span more than 16 bits keeps them in 32 bits (wide row).
+typedef struct bsr_compressed bsr_compressed;
+struct bsr_compressed{
+	unsigned int *bases; // Per block row: smallest block column, or BSR_WIDE_ROW | position of its columns in wide_columns
+	unsigned short *deltas; // Per block: block column - base of its block row
+	unsigned int *wide_columns; // Block columns of the wide rows, one after the other
+	float *values; // Single precision values
+};
+#define BSR_WIDE_ROW 0x80000000u
+
+// Kernel type
+typedef void (*bsr_kernel)(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                           double *values, double *x, double *y, double *w, double alpha, double beta);
+// Multi-vector kernel type, see bsr_spmm_kernel
+typedef void (*bsr_multi_kernel)(int first, int last, int block_size, int k, unsigned int *offsets, unsigned int *columns,
+                                 double *values, double *X, double *Y, double alpha, double beta);
+// Compressed kernel type: columns and values are used when compressed has no counterpart
+typedef void (*bsr_compressed_kernel)(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns, double *values,
+                                      bsr_compressed *compressed, double *x, double *y, double *w, double alpha, double beta);
+
+/*=====================================================================================*/
+
+// Prototypes
+int bsr_cpu_has_avx2(void);
+bsr_kernel bsr_select_kernel(int block_size);
+bsr_multi_kernel bsr_select_multi_kernel(void);
+bsr_compressed_kernel bsr_select_compressed_kernel(int block_size, int single);
+/*==============*/
+void bsr_kernel_generic(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                        double *values, double *x, double *y, double *w, double alpha, double beta);
+#if BSR_X86
+void bsr_kernel_2_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta);
+void bsr_kernel_3_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta);
+void bsr_kernel_4_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta);
+void bsr_kernel_8_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta);
+#endif
+/*==============*/
+void bsr_spmm_kernel(int first, int last, int block_size, int k, unsigned int *offsets, unsigned int *columns,
+                     double *values, double *X, double *Y, double alpha, double beta);
+#if BSR_X86
+void bsr_spmm_kernel_avx2(int first, int last, int block_size, int k, unsigned int *offsets, unsigned int *columns,
+                          double *values, double *X, double *Y, double alpha, double beta);
+#endif
+/*==============*/
+void bsr_kernel_compressed_generic(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns, double *values,
+                                   bsr_compressed *compressed, double *x, double *y, double *w, double alpha, double beta);
+void bsr_spmm_kernel_compressed(int first, int last, int block_size, int k, unsigned int *offsets, unsigned int *columns, double *values,
+                                bsr_compressed *compressed, double *X, double *Y, double alpha, double beta);
+
+
+/*=====================================================================================*/
+
+
+/*============== CPU detection ===================*/
+// 1 if the CPU runs AVX2 and FMA instructions
+int bsr_cpu_has_avx2(void){
+#if BSR_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+	return 0;
+#endif
+}
+
+
+/*============== Scalar kernels ===================*/
+// Block row kernel for any block size. Called with a constant block size,
+// the loops are unrolled by the compiler.
+static inline __attribute__((always_inline)) void bsr_kernel_rows(int first, int last, const int block_size, unsigned int *offsets, unsigned int *columns,
+                                                                     double *values, double *x, double *y, double *w, double alpha, double beta){
+	int n_elements_per_block = block_size*block_size;
+	for (int I = first; I < last; ++I){
+		double sum[block_size];
+		for (int k = 0; k < block_size; ++k) sum[k] = 0;
+
+		for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+			double *block = &values[(long)b*n_elements_per_block];
+			double *x_block = &x[(long)columns[b]*block_size];
+			for (int k = 0; k < block_size; ++k){
+				for (int l = 0; l < block_size; ++l) sum[k] += block[k*block_size + l]*x_block[l];
+			}
+		}
+
+		double *y_block = &y[(long)I*block_size];
+		double *w_block = &w[(long)I*block_size];
+		for (int k = 0; k < block_size; ++k){
+			w_block[k] = (beta == 0) ? alpha*sum[k] : alpha*sum[k] + beta*y_block[k];
+		}
+	}
+}
+
+void bsr_kernel_generic(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                        double *values, double *x, double *y, double *w, double alpha, double beta){
+	bsr_kernel_rows(first, last, block_size, offsets, columns, values, x, y, w, alpha, beta);
+}
+
+// One scalar kernel per block size. Like the AVX2 kernels, they keep the block_size
+// argument of the bsr_kernel signature without reading it.
+#define BSR_KERNEL_FIXED(BS) \
+static void bsr_kernel_##BS(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns, \
+                            double *values, double *x, double *y, double *w, double alpha, double beta){ \
+	(void)block_size; \
+	bsr_kernel_rows(first, last, BS, offsets, columns, values, x, y, w, alpha, beta); \
+}
+BSR_KERNEL_FIXED(2)
+BSR_KERNEL_FIXED(3)
+BSR_KERNEL_FIXED(4)
+BSR_KERNEL_FIXED(8)
+#undef BSR_KERNEL_FIXED
+
+
+/*============== AVX2 kernels ===================*/
+#if BSR_X86
+// Sums of each of the 4 vectors: {sum(a), sum(b), sum(c), sum(d)}
+__attribute__((target("avx2,fma"))) static inline __m256d bsr_hsum4(__m256d a, __m256d b, __m256d c, __m256d d){
+	__m256d ab = _mm256_hadd_pd(a, b); // {a0+a1, b0+b1, a2+a3, b2+b3}
+	__m256d cd = _mm256_hadd_pd(c, d);
+	return _mm256_add_pd(_mm256_permute2f128_pd(ab, cd, 0x21), _mm256_blend_pd(ab, cd, 0xC));
+}
+
+// w_block = alpha*sum + beta*y_block for n <= 4 rows
+__attribute__((target("avx2,fma"))) static inline void bsr_update4(double *w_block, double *y_block, __m256d sum, int n, double alpha, double beta){
+	double result[4];
+	_mm256_storeu_pd(result, _mm256_mul_pd(sum, _mm256_set1_pd(alpha)));
+	for (int k = 0; k < n; ++k) w_block[k] = (beta == 0) ? result[k] : result[k] + beta*y_block[k];
+}
+
+// 2x2 blocks: a whole block times {x0, x1, x0, x1} in one FMA
+__attribute__((target("avx2,fma")))
+void bsr_kernel_2_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta){
+	(void)block_size;
+	for (int I = first; I < last; ++I){
+		__m256d acc = _mm256_setzero_pd();
+		for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+			__m256d x_pair = _mm256_broadcast_pd((const __m128d *)&x[2*(long)columns[b]]);
+			acc = _mm256_fmadd_pd(_mm256_loadu_pd(&values[4*(long)b]), x_pair, acc);
+		}
+		__m128d sum = _mm_hadd_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+		double result[2];
+		_mm_storeu_pd(result, _mm_mul_pd(sum, _mm_set1_pd(alpha)));
+		for (int k = 0; k < 2; ++k) w[2*(long)I + k] = (beta == 0) ? result[k] : result[k] + beta*y[2*(long)I + k];
+	}
+}
+
+// 3x3 blocks: each row of the block is loaded as 4 lanes, the 4th one masked out
+__attribute__((target("avx2,fma")))
+void bsr_kernel_3_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta){
+	(void)block_size;
+	const __m256i mask = _mm256_set_epi64x(0, -1, -1, -1);
+	for (int I = first; I < last; ++I){
+		__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd(), acc2 = _mm256_setzero_pd();
+		for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+			double *block = &values[9*(long)b];
+			__m256d x_block = _mm256_maskload_pd(&x[3*(long)columns[b]], mask);
+			acc0 = _mm256_fmadd_pd(_mm256_maskload_pd(block, mask), x_block, acc0);
+			acc1 = _mm256_fmadd_pd(_mm256_maskload_pd(block + 3, mask), x_block, acc1);
+			acc2 = _mm256_fmadd_pd(_mm256_maskload_pd(block + 6, mask), x_block, acc2);
+		}
+		bsr_update4(&w[3*(long)I], &y[3*(long)I], bsr_hsum4(acc0, acc1, acc2, _mm256_setzero_pd()), 3, alpha, beta);
+	}
+}
+
+// 4x4 blocks: one accumulator per row, reduced once per block row
+__attribute__((target("avx2,fma")))
+void bsr_kernel_4_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta){
+	(void)block_size;
+	for (int I = first; I < last; ++I){
+		__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd(), acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+		for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+			double *block = &values[16*(long)b];
+			__m256d x_block = _mm256_loadu_pd(&x[4*(long)columns[b]]);
+			acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(block), x_block, acc0);
+			acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(block + 4), x_block, acc1);
+			acc2 = _mm256_fmadd_pd(_mm256_loadu_pd(block + 8), x_block, acc2);
+			acc3 = _mm256_fmadd_pd(_mm256_loadu_pd(block + 12), x_block, acc3);
+		}
+		bsr_update4(&w[4*(long)I], &y[4*(long)I], bsr_hsum4(acc0, acc1, acc2, acc3), 4, alpha, beta);
+	}
+}
+
+// 8x8 blocks: one accumulator per row, both halves of the row go in it
+__attribute__((target("avx2,fma")))
+void bsr_kernel_8_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns,
+                       double *values, double *x, double *y, double *w, double alpha, double beta){
+	(void)block_size;
+	for (int I = first; I < last; ++I){
+		__m256d acc[8];
+		for (int k = 0; k < 8; ++k) acc[k] = _mm256_setzero_pd();
+		for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+			double *block = &values[64*(long)b];
+			__m256d x_low = _mm256_loadu_pd(&x[8*(long)columns[b]]);
+			__m256d x_high = _mm256_loadu_pd(&x[8*(long)columns[b] + 4]);
+			for (int k = 0; k < 8; ++k){
+				acc[k] = _mm256_fmadd_pd(_mm256_loadu_pd(block + 8*k), x_low, acc[k]);
+				acc[k] = _mm256_fmadd_pd(_mm256_loadu_pd(block + 8*k + 4), x_high, acc[k]);
+			}
+		}
+		bsr_update4(&w[8*(long)I], &y[8*(long)I], bsr_hsum4(acc[0], acc[1], acc[2], acc[3]), 4, alpha, beta);
+		bsr_update4(&w[8*(long)I + 4], &y[8*(long)I + 4], bsr_hsum4(acc[4], acc[5], acc[6], acc[7]), 4, alpha, beta);
+	}
+}
+#endif
+
+
+/*============== Multi-vector kernels ===================*/
+// Y = alpha*A*X + beta*Y over the block rows [first, last), for k vectors stored row-major:
+// X[i*k + j] is the entry i of the vector j. The block column J of X is a contiguous
+// block_size x k slab. The k vectors are done by panels of 8, 4 and 1: the sums of a panel
+// stay in registers over the block row, whose blocks stay in cache from one panel to the
+// next, so A is read from memory once for the k vectors. Y may not be X.
+static inline __attribute__((always_inline)) void bsr_spmm_panel(int I, int first_vector, const int block_size, const int width, int k, unsigned int *offsets, unsigned int *columns,
+                                                                   double *values, double *X, double *Y, double alpha, double beta){
+	int n_elements_per_block = block_size*block_size;
+	double sum[block_size*width];
+	for (int e = 0; e < block_size*width; ++e) sum[e] = 0;
+
+	for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+		double *block = &values[(long)b*n_elements_per_block];
+		double *X_block = &X[(long)columns[b]*block_size*k + first_vector];
+		for (int r = 0; r < block_size; ++r){
+			for (int c = 0; c < block_size; ++c){
+				double a = block[r*block_size + c];
+				#pragma omp simd
+				for (int j = 0; j < width; ++j) sum[r*width + j] += a*X_block[c*k + j];
+			}
+		}
+	}
+
+	double *Y_block = &Y[(long)I*block_size*k + first_vector];
+	for (int r = 0; r < block_size; ++r){
+		for (int j = 0; j < width; ++j){
+			Y_block[r*k + j] = (beta == 0) ? alpha*sum[r*width + j] : alpha*sum[r*width + j] + beta*Y_block[r*k + j];
+		}
+	}
+}
+
+static inline __attribute__((always_inline)) void bsr_spmm_rows(int first, int last, const int block_size, int k, unsigned int *offsets, unsigned int *columns,
+                                                                  double *values, double *X, double *Y, double alpha, double beta){
+	for (int I = first; I < last; ++I){
+		int j = 0;
+		for (; j + 8 <= k; j += 8) bsr_spmm_panel(I, j, block_size, 8, k, offsets, columns, values, X, Y, alpha, beta);
+		for (; j + 4 <= k; j += 4) bsr_spmm_panel(I, j, block_size, 4, k, offsets, columns, values, X, Y, alpha, beta);
+		for (; j < k; ++j) bsr_spmm_panel(I, j, block_size, 1, k, offsets, columns, values, X, Y, alpha, beta);
+	}
+}
+
+#if BSR_X86
+// AVX2 panels of 8 vectors: two registers per row of the block row
+__attribute__((target("avx2,fma"))) static inline __attribute__((always_inline)) void bsr_spmm_rows_avx2(int first, int last, const int block_size, int k,
+                                                                   unsigned int *offsets, unsigned int *columns, double *values, double *X, double *Y, double alpha, double beta){
+	int n_elements_per_block = block_size*block_size;
+	__m256d alpha_4 = _mm256_set1_pd(alpha), beta_4 = _mm256_set1_pd(beta);
+	for (int I = first; I < last; ++I){
+		int j = 0;
+		for (; j + 8 <= k; j += 8){
+			__m256d low[block_size], high[block_size];
+			for (int r = 0; r < block_size; ++r) low[r] = high[r] = _mm256_setzero_pd();
+			for (unsigned int b = offsets[I]; b < offsets[I+1]; ++b){
+				double *block = &values[(long)b*n_elements_per_block];
+				double *X_block = &X[(long)columns[b]*block_size*k + j];
+				for (int c = 0; c < block_size; ++c){
+					__m256d x_low = _mm256_loadu_pd(&X_block[c*k]), x_high = _mm256_loadu_pd(&X_block[c*k + 4]);
+					for (int r = 0; r < block_size; ++r){
+						__m256d a = _mm256_broadcast_sd(&block[r*block_size + c]);
+						low[r] = _mm256_fmadd_pd(a, x_low, low[r]);
+						high[r] = _mm256_fmadd_pd(a, x_high, high[r]);
+					}
+				}
+			}
+			double *Y_block = &Y[(long)I*block_size*k + j];
+			for (int r = 0; r < block_size; ++r){
+				__m256d y_low = _mm256_mul_pd(alpha_4, low[r]), y_high = _mm256_mul_pd(alpha_4, high[r]);
+				if (beta != 0){
+					y_low = _mm256_fmadd_pd(beta_4, _mm256_loadu_pd(&Y_block[r*k]), y_low);
+					y_high = _mm256_fmadd_pd(beta_4, _mm256_loadu_pd(&Y_block[r*k + 4]), y_high);
+				}
+				_mm256_storeu_pd(&Y_block[r*k], y_low);
+				_mm256_storeu_pd(&Y_block[r*k + 4], y_high);
+			}
+		}
+		for (; j + 4 <= k; j += 4) bsr_spmm_panel(I, j, block_size, 4, k, offsets, columns, values, X, Y, alpha, beta);
+		for (; j < k; ++j) bsr_spmm_panel(I, j, block_size, 1, k, offsets, columns, values, X, Y, alpha, beta);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+void bsr_spmm_kernel_avx2(int first, int last, int block_size, int k, unsigned int *offsets, unsigned int *columns,
+                          double *values, double *X, double *Y, double alpha, double beta){
+	switch (block_size){
+		case 2: bsr_spmm_rows_avx2(first, last, 2, k, offsets, columns, values, X, Y, alpha, beta); break;
+		case 3: bsr_spmm_rows_avx2(first, last, 3, k, offsets, columns, values, X, Y, alpha, beta); break;
+		case 4: bsr_spmm_rows_avx2(first, last, 4, k, offsets, columns, values, X, Y, alpha, beta); break;
+		case 8: bsr_spmm_rows_avx2(first, last, 8, k, offsets, columns, values, X, Y, alpha, beta); break;
+		default: bsr_spmm_rows_avx2(first, last, block_size, k, offsets, columns, values, X, Y, alpha, beta);
+	}
+}
+#endif
+
+void bsr_spmm_kernel(int first, int last, int block_size, int k, unsigned int *offsets, unsigned int *columns,
+                     double *values, double *X, double *Y, double alpha, double beta){
+	switch (block_size){
+		case 2: bsr_spmm_rows(first, last, 2, k, offsets, columns, values, X, Y, alpha, beta); break;
+		case 3: bsr_spmm_rows(first, last, 3, k, offsets, columns, values, X, Y, alpha, beta); break;
+		case 4: bsr_spmm_rows(first, last, 4, k, offsets, columns, values, X, Y, alpha, beta); break;
+		case 8: bsr_spmm_rows(first, last, 8, k, offsets, columns, values, X, Y, alpha, beta); break;
+		default: bsr_spmm_rows(first, last, block_size, k, offsets, columns, values, X, Y, alpha, beta);
+	}
+}
+
+
+/*============== Compressed kernels ===================*/
+// 32-bit block columns of the block row I (plain or wide row), NULL if it stores deltas from *base
+static inline __attribute__((always_inline)) unsigned int *bsr_compressed_row(int I, unsigned int *offsets, unsigned int *columns,
+                                                                                bsr_compressed *compressed, unsigned int *base){
+	*base = 0;
+	if (compressed->bases == NULL) return &columns[offsets[I]];
+	*base = compressed->bases[I];
+	if (*base & BSR_WIDE_ROW) return &compressed->wide_columns[*base & ~BSR_WIDE_ROW];
+	return NULL;
+}
+
+// Same as bsr_kernel_rows. single is a constant too: the values are read as floats and
+// converted, the sums stay in double.
+static inline __attribute__((always_inline)) void bsr_compressed_rows(int first, int last, const int block_size, const int single, unsigned int *offsets, unsigned int *columns,
+                                                                        double *values, bsr_compressed *compressed, double *x, double *y, double *w, double alpha, double beta){
+	int n_elements_per_block = block_size*block_size;
+	for (int I = first; I < last; ++I){
+		double sum[block_size];
+		for (int k = 0; k < block_size; ++k) sum[k] = 0;
+		unsigned int base;
+		unsigned int *row_columns = bsr_compressed_row(I, offsets, columns, compressed, &base);
+		unsigned short *row_deltas = (compressed->deltas != NULL) ? &compressed->deltas[offsets[I]] : NULL;
+		unsigned int length = offsets[I+1] - offsets[I];
+
+		for (unsigned int e = 0; e < length; ++e){
+			unsigned int column = (row_columns != NULL) ? row_columns[e] : base + row_deltas[e];
+			long b = (long)offsets[I] + e;
+			double *x_block = &x[(long)column*block_size];
+			for (int k = 0; k < block_size; ++k){
+				for (int l = 0; l < block_size; ++l){
+					double a = (single) ? (double)compressed->values[b*n_elements_per_block + k*block_size + l] : values[b*n_elements_per_block + k*block_size + l];
+					sum[k] += a*x_block[l];
+				}
+			}
+		}
+
+		double *y_block = &y[(long)I*block_size];
+		double *w_block = &w[(long)I*block_size];
+		for (int k = 0; k < block_size; ++k){
+			w_block[k] = (beta == 0) ? alpha*sum[k] : alpha*sum[k] + beta*y_block[k];
+		}
+	}
+}
+
+void bsr_kernel_compressed_generic(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns, double *values,
+                                   bsr_compressed *compressed, double *x, double *y, double *w, double alpha, double beta){
+	if (compressed->values != NULL) bsr_compressed_rows(first, last, block_size, 1, offsets, columns, values, compressed, x, y, w, alpha, beta);
+	else bsr_compressed_rows(first, last, block_size, 0, offsets, columns, values, compressed, x, y, w, alpha, beta);
+}
+
+// One compressed kernel per block size and value precision
+#define BSR_COMPRESSED_FIXED(BS, SINGLE, NAME) \
+static void bsr_kernel_compressed_##BS##_##NAME(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns, double *values, \
+                                                bsr_compressed *compressed, double *x, double *y, double *w, double alpha, double beta){ \
+	(void)block_size; \
+	bsr_compressed_rows(first, last, BS, SINGLE, offsets, columns, values, compressed, x, y, w, alpha, beta); \
+}
+BSR_COMPRESSED_FIXED(2, 0, double)
+BSR_COMPRESSED_FIXED(3, 0, double)
+BSR_COMPRESSED_FIXED(4, 0, double)
+BSR_COMPRESSED_FIXED(8, 0, double)
+BSR_COMPRESSED_FIXED(2, 1, single)
+BSR_COMPRESSED_FIXED(3, 1, single)
+BSR_COMPRESSED_FIXED(4, 1, single)
+BSR_COMPRESSED_FIXED(8, 1, single)
+#undef BSR_COMPRESSED_FIXED
+
+#if BSR_X86
+// 4 consecutive values as doubles (the 4th one 0 if masked), read from float or double storage
+__attribute__((target("avx2,fma"))) static inline __attribute__((always_inline)) __m256d bsr_compressed_load(double *values, float *single_values, long offset,
+                                                                                                            const int single, const int masked){
+	if (single){
+		__m128 lanes = (masked) ? _mm_maskload_ps(&single_values[offset], _mm_set_epi32(0, -1, -1, -1)) : _mm_loadu_ps(&single_values[offset]);
+		return _mm256_cvtps_pd(lanes);
+	}
+	return (masked) ? _mm256_maskload_pd(&values[offset], _mm256_set_epi64x(0, -1, -1, -1)) : _mm256_loadu_pd(&values[offset]);
+}
+
+// AVX2 versions of the 2, 3, 4 and 8 kernels on the compressed storage, same lanes as the plain ones
+__attribute__((target("avx2,fma"))) static inline __attribute__((always_inline)) void bsr_compressed_rows_avx2(int first, int last, const int block_size, const int single,
+                                                                   unsigned int *offsets, unsigned int *columns, double *values, bsr_compressed *compressed,
+                                                                   double *x, double *y, double *w, double alpha, double beta){
+	const int n_elements_per_block = block_size*block_size;
+	const __m256i mask = _mm256_set_epi64x(0, -1, -1, -1);
+	for (int I = first; I < last; ++I){
+		__m256d acc[8];
+		#pragma GCC unroll 8
+		for (int k = 0; k < 8; ++k) acc[k] = _mm256_setzero_pd();
+		unsigned int base;
+		unsigned int *row_columns = bsr_compressed_row(I, offsets, columns, compressed, &base);
+		unsigned short *row_deltas = (compressed->deltas != NULL) ? &compressed->deltas[offsets[I]] : NULL;
+		unsigned int length = offsets[I+1] - offsets[I];
+
+		for (unsigned int e = 0; e < length; ++e){
+			unsigned int column = (row_columns != NULL) ? row_columns[e] : base + row_deltas[e];
+			long b = ((long)offsets[I] + e)*n_elements_per_block;
+			if (block_size == 2){
+				__m256d x_pair = _mm256_broadcast_pd((const __m128d *)&x[2*(long)column]);
+				acc[0] = _mm256_fmadd_pd(bsr_compressed_load(values, compressed->values, b, single, 0), x_pair, acc[0]);
+			}
+			else if (block_size == 3){
+				__m256d x_block = _mm256_maskload_pd(&x[3*(long)column], mask);
+				#pragma GCC unroll 8
+				for (int k = 0; k < 3; ++k) acc[k] = _mm256_fmadd_pd(bsr_compressed_load(values, compressed->values, b + 3*k, single, 1), x_block, acc[k]);
+			}
+			else if (block_size == 4){
+				__m256d x_block = _mm256_loadu_pd(&x[4*(long)column]);
+				#pragma GCC unroll 8
+				for (int k = 0; k < 4; ++k) acc[k] = _mm256_fmadd_pd(bsr_compressed_load(values, compressed->values, b + 4*k, single, 0), x_block, acc[k]);
+			}
+			else{
+				__m256d x_low = _mm256_loadu_pd(&x[8*(long)column]);
+				__m256d x_high = _mm256_loadu_pd(&x[8*(long)column + 4]);
+				#pragma GCC unroll 8
+				for (int k = 0; k < 8; ++k){
+					acc[k] = _mm256_fmadd_pd(bsr_compressed_load(values, compressed->values, b + 8*k, single, 0), x_low, acc[k]);
+					acc[k] = _mm256_fmadd_pd(bsr_compressed_load(values, compressed->values, b + 8*k + 4, single, 0), x_high, acc[k]);
+				}
+			}
+		}
+
+		if (block_size == 2){
+			__m128d sum = _mm_hadd_pd(_mm256_castpd256_pd128(acc[0]), _mm256_extractf128_pd(acc[0], 1));
+			double result[2];
+			_mm_storeu_pd(result, _mm_mul_pd(sum, _mm_set1_pd(alpha)));
+			for (int k = 0; k < 2; ++k) w[2*(long)I + k] = (beta == 0) ? result[k] : result[k] + beta*y[2*(long)I + k];
+		}
+		else if (block_size == 3) bsr_update4(&w[3*(long)I], &y[3*(long)I], bsr_hsum4(acc[0], acc[1], acc[2], _mm256_setzero_pd()), 3, alpha, beta);
+		else if (block_size == 4) bsr_update4(&w[4*(long)I], &y[4*(long)I], bsr_hsum4(acc[0], acc[1], acc[2], acc[3]), 4, alpha, beta);
+		else{
+			bsr_update4(&w[8*(long)I], &y[8*(long)I], bsr_hsum4(acc[0], acc[1], acc[2], acc[3]), 4, alpha, beta);
+			bsr_update4(&w[8*(long)I + 4], &y[8*(long)I + 4], bsr_hsum4(acc[4], acc[5], acc[6], acc[7]), 4, alpha, beta);
+		}
+	}
+}
+
+#define BSR_COMPRESSED_AVX2(BS, SINGLE, NAME) \
+__attribute__((target("avx2,fma"))) \
+static void bsr_kernel_compressed_##BS##_##NAME##_avx2(int first, int last, int block_size, unsigned int *offsets, unsigned int *columns, double *values, \
+                                                       bsr_compressed *compressed, double *x, double *y, double *w, double alpha, double beta){ \
+	(void)block_size; \
+	bsr_compressed_rows_avx2(first, last, BS, SINGLE, offsets, columns, values, compressed, x, y, w, alpha, beta); \
+}
+BSR_COMPRESSED_AVX2(2, 0, double)
+BSR_COMPRESSED_AVX2(3, 0, double)
+BSR_COMPRESSED_AVX2(4, 0, double)
+BSR_COMPRESSED_AVX2(8, 0, double)
+BSR_COMPRESSED_AVX2(2, 1, single)
+BSR_COMPRESSED_AVX2(3, 1, single)
+BSR_COMPRESSED_AVX2(4, 1, single)
+BSR_COMPRESSED_AVX2(8, 1, single)
+#undef BSR_COMPRESSED_AVX2
+#endif
+
+// Same as bsr_spmm_panel, on the compressed storage
+static inline __attribute__((always_inline)) void bsr_spmm_compressed_panel(int I, int first_vector, const int block_size, const int width, const int single, int k,
+                                                                              unsigned int *offsets, unsigned int *columns, double *values, bsr_compressed *compressed,
+                                                                              double *X, double *Y, double alpha, double beta){
+	int n_elements_per_block = block_size*block_size;
+	double sum[block_size*width];
+	for (int e = 0; e < block_size*width; ++e) sum[e] = 0;
+	unsigned int base;
+	unsigned int *row_columns = bsr_compressed_row(I, offsets, columns, compressed, &base);
+	unsigned short *row_deltas = (compressed->deltas != NULL) ? &compressed->deltas[offsets[I]] : NULL;
+	unsigned int length = offsets[I+1] - offsets[I];
+
+	for (unsigned int e = 0; e < length; ++e){
+		unsigned int column = (row_columns != NULL) ? row_columns[e] : base + row_deltas[e];
+		long b = (long)offsets[I] + e;
+		double *X_block = &X[(long)column*block_size*k + first_vector];
+		for (int r = 0; r < block_size; ++r){
+			for (int c = 0; c < block_size; ++c){
+				double a = (single) ? (double)compressed->values[b*n_elements_per_block + r*block_size + c] : values[b*n_elements_per_block + r*block_size + c];
+				#pragma omp simd
+				for (int j = 0; j < width; ++j) sum[r*width + j] += a*X_block[c*k + j];
+			}
+		}
+	}
+
+	double *Y_block = &Y[(long)I*block_size*k + first_vector];
+	for (int r = 0; r < block_size; ++r){
+		for (int j = 0; j < width; ++j){
+			Y_block[r*k + j] = (beta == 0) ? alpha*sum[r*width + j] : alpha*sum[r*width + j] + beta*Y_block[r*k + j];
+		}
+	}
+}
+
+static inline __attribute__((always_inline)) void bsr_spmm_compressed_rows(int first, int last, const int block_size, const int single, int k, unsigned int *offsets,
+                                                                             unsigned int *columns, double *values, bsr_compressed *compressed,
+                                                                             double *X, double *Y, double alpha, double beta){
+	for (int I = first; I < last; ++I){
+		int j = 0;
+		for (; j + 8 <= k; j += 8) bsr_spmm_compressed_panel(I, j, block_size, 8, single, k, offsets, columns, values, compressed, X, Y, alpha, beta);
+		for (; j < k; ++j) bsr_spmm_compressed_panel(I, j, block_size, 1, single, k, offsets, columns, values, compressed, X, Y, alpha, beta);
+	}
+}
+
+void bsr_spmm_kernel_compressed(int first, int last, int block_size, int k, unsigned int *offsets, unsigned int *columns, double *values,
+                                bsr_compressed *compressed, double *X, double *Y, double alpha, double beta){
+	if (compressed->values != NULL){
+		switch (block_size){
+			case 2: bsr_spmm_compressed_rows(first, last, 2, 1, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			case 3: bsr_spmm_compressed_rows(first, last, 3, 1, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			case 4: bsr_spmm_compressed_rows(first, last, 4, 1, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			case 8: bsr_spmm_compressed_rows(first, last, 8, 1, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			default: bsr_spmm_compressed_rows(first, last, block_size, 1, k, offsets, columns, values, compressed, X, Y, alpha, beta);
+		}
+	}
+	else{
+		switch (block_size){
+			case 2: bsr_spmm_compressed_rows(first, last, 2, 0, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			case 3: bsr_spmm_compressed_rows(first, last, 3, 0, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			case 4: bsr_spmm_compressed_rows(first, last, 4, 0, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			case 8: bsr_spmm_compressed_rows(first, last, 8, 0, k, offsets, columns, values, compressed, X, Y, alpha, beta); break;
+			default: bsr_spmm_compressed_rows(first, last, block_size, 0, k, offsets, columns, values, compressed, X, Y, alpha, beta);
+		}
+	}
+}
+
+
+/*============== Dispatch ===================*/
+// Fastest kernel for a block size on this CPU
+bsr_kernel bsr_select_kernel(int block_size){
+	static int use_avx2 = -1;
+	if (use_avx2 < 0) use_avx2 = bsr_cpu_has_avx2();
+#if BSR_X86
+	if (use_avx2){
+		switch (block_size){
+			case 2: return bsr_kernel_2_avx2;
+			case 3: return bsr_kernel_3_avx2;
+			case 4: return bsr_kernel_4_avx2;
+			case 8: return bsr_kernel_8_avx2;
+		}
+	}
+#endif
+	switch (block_size){
+		case 2: return bsr_kernel_2;
+		case 3: return bsr_kernel_3;
+		case 4: return bsr_kernel_4;
+		case 8: return bsr_kernel_8;
+	}
+	return bsr_kernel_generic;
+}
+
+// Fastest multi-vector kernel on this CPU
+bsr_multi_kernel bsr_select_multi_kernel(void){
+	static int use_avx2 = -1;
+	if (use_avx2 < 0) use_avx2 = bsr_cpu_has_avx2();
+#if BSR_X86
+	if (use_avx2) return bsr_spmm_kernel_avx2;
+#endif
+	return bsr_spmm_kernel;
+}
+
+// Compressed kernel for a block size, with float values (single = 1) or double ones
+bsr_compressed_kernel bsr_select_compressed_kernel(int block_size, int single){
+	static int use_avx2 = -1;
+	if (use_avx2 < 0) use_avx2 = bsr_cpu_has_avx2();
+#if BSR_X86
+	if (use_avx2){
+		switch (block_size){
+			case 2: return (single) ? bsr_kernel_compressed_2_single_avx2 : bsr_kernel_compressed_2_double_avx2;
+			case 3: return (single) ? bsr_kernel_compressed_3_single_avx2 : bsr_kernel_compressed_3_double_avx2;
+			case 4: return (single) ? bsr_kernel_compressed_4_single_avx2 : bsr_kernel_compressed_4_double_avx2;
+			case 8: return (single) ? bsr_kernel_compressed_8_single_avx2 : bsr_kernel_compressed_8_double_avx2;
+		}
+	}
+#endif
+	if (single){
+		switch (block_size){
+			case 2: return bsr_kernel_compressed_2_single;
+			case 3: return bsr_kernel_compressed_3_single;
+			case 4: return bsr_kernel_compressed_4_single;
+			case 8: return bsr_kernel_compressed_8_single;
+		}
+	}
+	else{
+		switch (block_size){
+			case 2: return bsr_kernel_compressed_2_double;
+			case 3: return bsr_kernel_compressed_3_double;
+			case 4: return bsr_kernel_compressed_4_double;
+			case 8: return bsr_kernel_compressed_8_double;
+		}
+	}
+	return bsr_kernel_compressed_generic;
+}
+
+#endif
@@ -0,0 +1,316 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef BSR_TUNING_H
+#define BSR_TUNING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+#include "CSR_BSR.h"
+
+/*=====================================================================================
+* Automatic block size. A block size that does not match the matrix stores explicit
+* zeros in its blocks (fill), one that is too small leaves register blocking unused.
+* The choice is made as follows:
+* - Fill ratio: stored entries / nonzeros, estimated on a sample of the block rows.
+* - Calibration, once per machine: the time of bsr_spmv per stored block, measured on a
+*   dense matrix for each block size, so that kernels without a specialized version
+*   (1, 5, 6, 7) are accounted for. It can be saved to a file and read back.
+* - Prediction: nonzeros * fill / block_size^2 blocks, times the time per block.
+* bsr_reblock then builds the matrix with the best block size. Any size works: the last
+* block row/column is padded, padded rows of a square matrix get a 1 on the diagonal.
+* The source is any bsr_matrix, typically with 1x1 blocks (bsr_read_mtx(file, &A, 1)).
+* In a source with larger blocks, the entries that are exactly 0 are taken as fill.
+=====================================================================================*/
+
+#define BSR_TUNING_MAX_BLOCK 8
+
+// Structures
+// Time of bsr_spmv per stored block, in seconds, for each block size (index 0 unused)
+typedef struct bsr_calibration bsr_calibration;
+struct bsr_calibration{
+	double block_time[BSR_TUNING_MAX_BLOCK + 1];
+};
+
+// Outcome of bsr_tune, per block size (index 0 unused)
+typedef struct bsr_tuning bsr_tuning;
+struct bsr_tuning{
+	int block_size;	// Fastest predicted
+	long nnz;		// Nonzeros of the source
+	double fill[BSR_TUNING_MAX_BLOCK + 1];
+	double predicted[BSR_TUNING_MAX_BLOCK + 1];	// Predicted SpMV time, in seconds
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int bsr_calibrate(bsr_calibration *calibration);
+int bsr_calibration_save(bsr_calibration *calibration, const char *filename);
+int bsr_calibration_load(bsr_calibration *calibration, const char *filename);
+/*==============*/
+double bsr_fill_ratio(bsr_matrix *source, int r, int c, double fraction);
+int bsr_tune(bsr_matrix *source, bsr_calibration *calibration, double fraction, bsr_tuning *tuning);
+int bsr_reblock(bsr_matrix *source, int block_size, bsr_matrix *result);
+
+
+/*=====================================================================================*/
+
+
+/*============== Scalar rows of a source ===================*/
+// Longest scalar row of the source, as a bound for bsr_tuning_row
+static int bsr_tuning_max_row(bsr_matrix *source){
+	int n_block_rows = source->nrows / source->block_size;
+	unsigned int longest = 0;
+	for (int I = 0; I < n_block_rows; ++I){
+		unsigned int length = source->block_row_offsets[I+1] - source->block_row_offsets[I];
+		if (length > longest) longest = length;
+	}
+	return (int)longest*source->block_size;
+}
+
+// Entries of the scalar row i, in the order of the blocks: returns their number.
+// values may be NULL.
+static int bsr_tuning_row(bsr_matrix *source, int i, unsigned int *columns, double *values){
+	int sb = source->block_size, I = i/sb, r = i%sb, n = 0;
+	for (unsigned int b = source->block_row_offsets[I]; b < source->block_row_offsets[I+1]; ++b){
+		double *row = &source->values[(long)b*source->n_elements_per_block + r*sb];
+		for (int c = 0; c < sb; ++c){
+			if ((sb > 1) && (row[c] == 0)) continue;
+			columns[n] = source->block_columns[b]*sb + c;
+			if (values != NULL) values[n] = row[c];
+			++n;
+		}
+	}
+	return n;
+}
+
+int bsr_tuning_column_compare(const void *a, const void *b){
+	unsigned int p = *(const unsigned int *)a, q = *(const unsigned int *)b;
+	return (p > q) - (p < q);
+}
+
+
+/*============== Calibration ===================*/
+// Times bsr_spmv on a dense 1680 x 1680 matrix (22 MB, out of cache, 1680 is a multiple
+// of all the block sizes) for each block size, the best of a few runs.
+int bsr_calibrate(bsr_calibration *calibration){
+	const int size = 1680, repetitions = 10;
+	double *x = malloc(sizeof(double) * size);
+	double *y = malloc(sizeof(double) * size);
+	for (int i = 0; i < size; ++i) x[i] = 1.0/(i + 1);
+	calibration->block_time[0] = 0;
+	for (int bs = 1; bs <= BSR_TUNING_MAX_BLOCK; ++bs){
+		int n_blocks = size/bs;
+		bsr_matrix dense;
+		bsr_init(&dense, size, size, bs, n_blocks*n_blocks);
+		for (int I = 0; I <= n_blocks; ++I) dense.block_row_offsets[I] = I*n_blocks;
+		for (long b = 0; b < (long)n_blocks*n_blocks; ++b) dense.block_columns[b] = b%n_blocks;
+		for (long e = 0; e < (long)size*size; ++e) dense.values[e] = 1.0/(e%97 + 1);
+		bsr_spmv(&dense, x, y, 1.0, 0.0); // Warm-up
+		double best = 1e30;
+		for (int r = 0; r < repetitions; ++r){
+			double begin = omp_get_wtime();
+			bsr_spmv(&dense, x, y, 1.0, 0.0);
+			double elapsed = omp_get_wtime() - begin;
+			if (elapsed < best) best = elapsed;
+		}
+		calibration->block_time[bs] = best/dense.nnzb;
+		bsr_free(&dense);
+	}
+	free(x);
+	free(y);
+	return 0;
+}
+
+// One line per block size: "<block size> <seconds per block>"
+int bsr_calibration_save(bsr_calibration *calibration, const char *filename){
+	FILE *file = fopen(filename, "w");
+	if (file == NULL){
+		printf("!!! Error while opening %s.\n", filename);
+		return -1;
+	}
+	for (int bs = 1; bs <= BSR_TUNING_MAX_BLOCK; ++bs) fprintf(file, "%d %.6e\n", bs, calibration->block_time[bs]);
+	fclose(file);
+	return 0;
+}
+
+// Fails quietly if the file does not exist, so that the caller can calibrate instead
+int bsr_calibration_load(bsr_calibration *calibration, const char *filename){
+	FILE *file = fopen(filename, "r");
+	if (file == NULL) return -1;
+	calibration->block_time[0] = 0;
+	int status = 0;
+	for (int bs = 1; bs <= BSR_TUNING_MAX_BLOCK; ++bs){
+		int read_bs;
+		if ((fscanf(file, "%d %lf", &read_bs, &calibration->block_time[bs]) != 2) || (read_bs != bs) ||
+		    !(calibration->block_time[bs] > 0)){
+			printf("!!! %s is not a calibration file.\n", filename);
+			status = -1;
+			break;
+		}
+	}
+	fclose(file);
+	return status;
+}
+
+
+/*============== Fill ratio ===================*/
+// Stored entries / nonzeros with r x c blocks, over a fraction of the block rows spread
+// evenly through the matrix (all of them with fraction = 1). Rectangular shapes are
+// estimated as well, even though a bsr_matrix only stores square blocks.
+double bsr_fill_ratio(bsr_matrix *source, int r, int c, double fraction){
+	int n_block_rows = (source->nrows + r - 1)/r;
+	int n_block_columns = (source->ncolumns + c - 1)/c;
+	int n_samples = (int)(fraction*n_block_rows);
+	if (n_samples < 1) n_samples = 1;
+	if (n_samples > n_block_rows) n_samples = n_block_rows;
+
+	// marker[J] holds the last block row where the block column J was seen
+	int *marker = malloc(sizeof(int) * n_block_columns);
+	for (int J = 0; J < n_block_columns; ++J) marker[J] = -1;
+	unsigned int *columns = malloc(sizeof(int) * (bsr_tuning_max_row(source) + 1));
+	long entries = 0, blocks = 0;
+	for (int s = 0; s < n_samples; ++s){
+		int I = (int)((long)s*n_block_rows/n_samples);
+		int last = (I + 1)*r < source->nrows ? (I + 1)*r : source->nrows;
+		for (int i = I*r; i < last; ++i){
+			int length = bsr_tuning_row(source, i, columns, NULL);
+			entries += length;
+			for (int e = 0; e < length; ++e){
+				int J = columns[e]/c;
+				if (marker[J] != I){
+					marker[J] = I;
+					++blocks;
+				}
+			}
+		}
+	}
+	free(marker);
+	free(columns);
+	return (entries > 0) ? (double)blocks*r*c/entries : 1.0;
+}
+
+
+/*============== Choice of the block size ===================*/
+// Predicts the SpMV time of the source for the square block sizes 1..BSR_TUNING_MAX_BLOCK
+// and picks the fastest. fraction is the share of block rows sampled (0.02 is plenty).
+int bsr_tune(bsr_matrix *source, bsr_calibration *calibration, double fraction, bsr_tuning *tuning){
+	if (bsr_require_plain(source) != 0) return -1;
+	if (!(fraction > 0) || fraction > 1){
+		printf("!!! The sampled fraction must be in (0, 1].\n");
+		return -1;
+	}
+	// Exact number of nonzeros, cheap next to the conversion
+	long nnz = 0;
+	if (source->block_size == 1) nnz = source->nnzb;
+	else{
+		for (long e = 0; e < (long)source->nnzb*source->n_elements_per_block; ++e) nnz += (source->values[e] != 0);
+	}
+	tuning->nnz = nnz;
+	tuning->block_size = 1;
+	tuning->fill[0] = tuning->predicted[0] = 0;
+	for (int bs = 1; bs <= BSR_TUNING_MAX_BLOCK; ++bs){
+		tuning->fill[bs] = bsr_fill_ratio(source, bs, bs, fraction);
+		tuning->predicted[bs] = nnz*tuning->fill[bs]/(bs*bs)*calibration->block_time[bs];
+		if (tuning->predicted[bs] < tuning->predicted[tuning->block_size]) tuning->block_size = bs;
+	}
+	return 0;
+}
+
+
+/*============== Conversion ===================*/
+// Copies the source into result with blocks of block_size, padding the last block row and
+// column. Two passes over the block rows, shared between the threads: count the blocks,
+// then place the entries. result is allocated, free it with bsr_free.
+int bsr_reblock(bsr_matrix *source, int block_size, bsr_matrix *result){
+	if (bsr_require_plain(source) != 0) return -1;
+	if (block_size < 1){
+		printf("!!! Invalid block size %d.\n", block_size);
+		return -1;
+	}
+	int bs = block_size, nrows = source->nrows, ncolumns = source->ncolumns;
+	int n_block_rows = (nrows + bs - 1)/bs, n_block_columns = (ncolumns + bs - 1)/bs;
+	int square = (nrows == ncolumns);
+	int max_row = bsr_tuning_max_row(source) + 1;
+	unsigned int *offsets = malloc(sizeof(int) * (n_block_rows + 1));
+	offsets[0] = 0;
+
+	for (int pass = 0; pass < 2; ++pass){
+		#pragma omp parallel
+		{
+			// marker[J]: -1 if the block column J is not in the block row yet, else its position
+			int *marker = malloc(sizeof(int) * n_block_columns);
+			for (int J = 0; J < n_block_columns; ++J) marker[J] = -1;
+			unsigned int *columns = malloc(sizeof(int) * max_row);
+			double *values = malloc(sizeof(double) * max_row);
+			unsigned int *row_blocks = malloc(sizeof(int) * ((n_block_columns < bs*max_row ? n_block_columns : bs*max_row) + 1));
+
+			#pragma omp for schedule(dynamic, 256)
+			for (int I = 0; I < n_block_rows; ++I){
+				int last = (I + 1)*bs < nrows ? (I + 1)*bs : nrows;
+				int n_blocks = 0;
+				// Distinct block columns of the block row, and the diagonal block if padded
+				for (int i = I*bs; i < last; ++i){
+					int length = bsr_tuning_row(source, i, columns, NULL);
+					for (int e = 0; e < length; ++e){
+						int J = columns[e]/bs;
+						if (marker[J] < 0){
+							marker[J] = 0;
+							row_blocks[n_blocks++] = J;
+						}
+					}
+				}
+				if (square && (last < (I + 1)*bs) && (marker[I] < 0)){
+					marker[I] = 0;
+					row_blocks[n_blocks++] = I;
+				}
+
+				if (pass == 0) offsets[I+1] = n_blocks;
+				else{
+					qsort(row_blocks, n_blocks, sizeof(int), bsr_tuning_column_compare);
+					for (int b = 0; b < n_blocks; ++b){
+						marker[row_blocks[b]] = offsets[I] + b;
+						result->block_columns[offsets[I] + b] = row_blocks[b];
+					}
+					double *block_values = &result->values[(long)offsets[I]*result->n_elements_per_block];
+					for (long e = 0; e < (long)n_blocks*result->n_elements_per_block; ++e) block_values[e] = 0;
+					for (int i = I*bs; i < last; ++i){
+						int length = bsr_tuning_row(source, i, columns, values);
+						for (int e = 0; e < length; ++e){
+							int J = columns[e]/bs;
+							result->values[(long)marker[J]*result->n_elements_per_block + (i - I*bs)*bs + columns[e] - J*bs] += values[e];
+						}
+					}
+					if (square){
+						for (int i = last; i < (I + 1)*bs; ++i){
+							result->values[(long)marker[I]*result->n_elements_per_block + (i - I*bs)*(bs + 1)] = 1.0;
+						}
+					}
+				}
+				for (int b = 0; b < n_blocks; ++b) marker[row_blocks[b]] = -1;
+			}
+			free(marker);
+			free(columns);
+			free(values);
+			free(row_blocks);
+		}
+
+		if (pass == 0){
+			for (int I = 0; I < n_block_rows; ++I) offsets[I+1] += offsets[I];
+			bsr_init(result, n_block_rows*bs, n_block_columns*bs, bs, offsets[n_block_rows]);
+			for (int I = 0; I <= n_block_rows; ++I) result->block_row_offsets[I] = offsets[I];
+		}
+	}
+	free(offsets);
+	return 0;
+}
+
+#endif
@@ -1 +1,126 @@
-//je fais un test de git
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+#define _POSIX_C_SOURCE 200809L // getopt
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "CSR_BSR.h"
+#include "explicit.h"
+
+/*=====================================================================================
+* Explicit diffusion of 3 coupled fields on a N x N grid, time stepped twice from the
+* same state: with the operator stored as a BSR matrix, and with the matrix-free stencil.
+*	./explicit [-m euler|rk2] [-s steps] [-c checkpoint_every] [-p prefix] [-g N] [-r checkpoint]
+=====================================================================================*/
+
+// Runs the stepper on a copy of u0 and prints its timings
+static int run(const char *name, explicit_operator *op, double *u0, double *u, double dt, int first_step, int nsteps, int method, int checkpoint_every, const char *prefix){
+	char checkpoint_prefix[512];
+	snprintf(checkpoint_prefix, sizeof(checkpoint_prefix), "%s_%s", prefix, name);
+	memcpy(u, u0, sizeof(double) * op->n);
+	explicit_stats stats;
+	int status = explicit_run(op, u, dt, first_step, nsteps, method, checkpoint_every, checkpoint_prefix, &stats);
+	printf("%-8s: %d steps in %.4f s (%.4f ms per step), %d checkpoints in %.4f s\n", name, stats.steps, stats.time,
+		1e3*stats.time_per_step, stats.checkpoints, stats.checkpoint_time);
+	return status;
+}
+
+int main(int argc, char **argv){
+	int method = EXPLICIT_EULER, nsteps = 500, checkpoint_every = 100, N = 300;
+	const char *prefix = "checkpoint", *restart = NULL;
+	int option;
+	while ((option = getopt(argc, argv, "m:s:c:p:g:r:")) != -1){
+		switch (option){
+			case 'm':
+				if (strcmp(optarg, "euler") == 0) method = EXPLICIT_EULER;
+				else if (strcmp(optarg, "rk2") == 0) method = EXPLICIT_RK2;
+				else{
+					printf("!!! Unknown method %s (euler or rk2).\n", optarg);
+					return -1;
+				}
+				break;
+			case 's': nsteps = atoi(optarg); break;
+			case 'c': checkpoint_every = atoi(optarg); break;
+			case 'p': prefix = optarg; break;
+			case 'g': N = atoi(optarg); break;
+			case 'r': restart = optarg; break;
+			default:
+				printf("Usage: %s [-m euler|rk2] [-s steps] [-c checkpoint_every] [-p prefix] [-g N] [-r checkpoint]\n", argv[0]);
+				return -1;
+		}
+	}
+	if (N < 2 || nsteps < 0){
+		printf("!!! Invalid grid size or number of steps.\n");
+		return -1;
+	}
+
+	// Operator: coupled diffusion, h = 1/(N+1)
+	double K[9] = {2.0, 0.5, 0.25,
+	               0.5, 2.0, 0.5,
+	               0.25, 0.5, 2.0};
+	double h = 1.0/(N + 1);
+	explicit_stencil stencil = {N, N, 3, 1.0/(h*h), K};
+	int n = N*N*3;
+	// Stable for both methods: dt*scale*8*max eigenvalue of K (2.75 by Gershgorin) < 2
+	double dt = 0.2*h*h/2.75;
+
+	bsr_matrix matrix;
+	double start = omp_get_wtime();
+	explicit_stencil_to_bsr(&stencil, &matrix);
+	printf("%d x %d grid, %d unknowns, %d blocks, BSR built in %.4f s\n", N, N, n, matrix.nnzb, omp_get_wtime() - start);
+
+	// Initial state: a bump in the middle of the domain, or a checkpoint
+	double *u0 = malloc(sizeof(double) * n);
+	int first_step = 0;
+	if (restart != NULL){
+		double time;
+		if (explicit_checkpoint_read(restart, &first_step, &time, n, u0) != 0){
+			bsr_free(&matrix);
+			free(u0);
+			return -1;
+		}
+		printf("Restarting from step %d (t = %.4e)\n", first_step, time);
+	}
+	else{
+		for (int j = 0; j < N; ++j){
+			for (int i = 0; i < N; ++i){
+				double x = (i + 1)*h - 0.5, y = (j + 1)*h - 0.5;
+				double bump = exp(-100*(x*x + y*y));
+				for (int k = 0; k < 3; ++k) u0[((long)j*N + i)*3 + k] = (k + 1)*bump;
+			}
+		}
+	}
+	printf("%s, dt = %.4e, %d steps from step %d\n", (method == EXPLICIT_EULER) ? "Forward Euler" : "RK2", dt, nsteps, first_step);
+
+	explicit_operator bsr_operator = {n, explicit_bsr_apply, &matrix};
+	explicit_operator stencil_operator = {n, explicit_stencil_apply, &stencil};
+	double *u_bsr = malloc(sizeof(double) * n);
+	double *u_stencil = malloc(sizeof(double) * n);
+	int status = run("bsr", &bsr_operator, u0, u_bsr, dt, first_step, nsteps, method, checkpoint_every, prefix);
+	status |= run("stencil", &stencil_operator, u0, u_stencil, dt, first_step, nsteps, method, checkpoint_every, prefix);
+
+	double difference = 0, norm = 0;
+	for (int i = 0; i < n; ++i){
+		difference = fmax(difference, fabs(u_bsr[i] - u_stencil[i]));
+		norm = fmax(norm, fabs(u_stencil[i]));
+	}
+	printf("max |u| = %.6e, max |u_bsr - u_stencil| = %.3e\n", norm, difference);
+
+	bsr_free(&matrix);
+	free(u0);
+	free(u_bsr);
+	free(u_stencil);
+	return (status != 0) ? -1 : 0;
+}
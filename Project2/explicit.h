@@ -0,0 +1,261 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef EXPLICIT_H
+#define EXPLICIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "CSR_BSR.h"
+
+/*=====================================================================================
+* Explicit time integration of du/dt = A*u:
+*	forward Euler	u_{n+1} = u_n + dt*A*u_n
+*	RK2 (midpoint)	u_{n+1/2} = u_n + dt/2*A*u_n,  u_{n+1} = u_n + dt*A*u_{n+1/2}
+* Every stage is a single pass w = alpha*A*x + beta*y of the operator, the product and
+* the update fused. The state ping-pongs between two buffers, nothing is copied per step.
+* The operator is either a bsr_matrix or the matrix-free stencil of a structured grid.
+=====================================================================================*/
+
+#define EXPLICIT_EULER 0
+#define EXPLICIT_RK2 1
+#define EXPLICIT_CHECKPOINT_MAGIC "EXPCKP1"
+
+// Structures
+// Operator of size n: w = alpha*A*x + beta*y, w may be y but not x
+typedef struct explicit_operator explicit_operator;
+struct explicit_operator{
+	int n;
+	void (*apply)(void *data, double *x, double *y, double *w, double alpha, double beta);
+	void *data;
+};
+
+// Diffusion on a nx x ny grid of nodes with dofs unknowns each, zero outside of the grid:
+// (A*u)_node = scale * K * (sum of the 4 neighbours - 4*u_node), K is dofs x dofs row-major
+typedef struct explicit_stencil explicit_stencil;
+struct explicit_stencil{
+	int nx;
+	int ny;
+	int dofs;
+	double scale;
+	double *K;
+};
+
+typedef struct explicit_stats explicit_stats;
+struct explicit_stats{
+	int steps;
+	int checkpoints;
+	double time; // Time stepping only, in seconds
+	double time_per_step;
+	double checkpoint_time;
+};
+
+// Header of a checkpoint file, followed by the n values of u
+typedef struct explicit_checkpoint explicit_checkpoint;
+struct explicit_checkpoint{
+	char magic[8];
+	int step;
+	int n;
+	double time;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+void explicit_bsr_apply(void *data, double *x, double *y, double *w, double alpha, double beta);
+void explicit_stencil_apply(void *data, double *x, double *y, double *w, double alpha, double beta);
+void explicit_stencil_to_bsr(explicit_stencil *stencil, bsr_matrix *matrix);
+/*==============*/
+int explicit_checkpoint_write(const char *prefix, int step, double time, int n, double *u);
+int explicit_checkpoint_read(const char *filename, int *step, double *time, int n, double *u);
+/*==============*/
+int explicit_run(explicit_operator *op, double *u, double dt, int first_step, int nsteps, int method, int checkpoint_every, const char *checkpoint_prefix, explicit_stats *stats);
+
+
+/*=====================================================================================*/
+
+
+/*============== Operators ===================*/
+void explicit_bsr_apply(void *data, double *x, double *y, double *w, double alpha, double beta){
+	bsr_spmv_update((bsr_matrix *)data, x, y, w, alpha, beta);
+}
+
+// Stencil on the rows [first, last) of the grid, for a number of dofs known at compile time
+static inline __attribute__((always_inline)) void explicit_stencil_rows(explicit_stencil *stencil, const int dofs, int first, int last,
+                                                                          double *x, double *y, double *w, double alpha, double beta){
+	int nx = stencil->nx, ny = stencil->ny;
+	double K[dofs*dofs];
+	for (int k = 0; k < dofs*dofs; ++k) K[k] = alpha*stencil->scale*stencil->K[k];
+	for (int j = first; j < last; ++j){
+		for (int i = 0; i < nx; ++i){
+			long node = (long)j*nx + i;
+			double *center = &x[node*dofs];
+			double laplacian[dofs];
+			for (int k = 0; k < dofs; ++k){
+				double sum = -4.0*center[k];
+				if (i > 0) sum += center[k - dofs];
+				if (i < nx - 1) sum += center[k + dofs];
+				if (j > 0) sum += center[k - (long)nx*dofs];
+				if (j < ny - 1) sum += center[k + (long)nx*dofs];
+				laplacian[k] = sum;
+			}
+			for (int k = 0; k < dofs; ++k){
+				double value = 0;
+				for (int l = 0; l < dofs; ++l) value += K[k*dofs + l]*laplacian[l];
+				w[node*dofs + k] = (beta == 0) ? value : value + beta*y[node*dofs + k];
+			}
+		}
+	}
+}
+
+static inline __attribute__((always_inline)) void explicit_stencil_solve(explicit_stencil *stencil, const int dofs, double *x, double *y, double *w, double alpha, double beta){
+	#pragma omp parallel
+	{
+		int thread = omp_get_thread_num(), nthreads = omp_get_num_threads();
+		int first = (int)((long)thread*stencil->ny/nthreads);
+		int last = (int)((long)(thread + 1)*stencil->ny/nthreads);
+		explicit_stencil_rows(stencil, dofs, first, last, x, y, w, alpha, beta);
+	}
+}
+
+// Matrix-free w = alpha*A*x + beta*y: only x, y and w are read or written
+void explicit_stencil_apply(void *data, double *x, double *y, double *w, double alpha, double beta){
+	explicit_stencil *stencil = data;
+	switch (stencil->dofs){
+		case 1: explicit_stencil_solve(stencil, 1, x, y, w, alpha, beta); break;
+		case 2: explicit_stencil_solve(stencil, 2, x, y, w, alpha, beta); break;
+		case 3: explicit_stencil_solve(stencil, 3, x, y, w, alpha, beta); break;
+		default: explicit_stencil_solve(stencil, stencil->dofs, x, y, w, alpha, beta);
+	}
+}
+
+// Same operator as a BSR matrix, one block row per node
+void explicit_stencil_to_bsr(explicit_stencil *stencil, bsr_matrix *matrix){
+	int nx = stencil->nx, ny = stencil->ny, dofs = stencil->dofs;
+	int n_nodes = nx*ny;
+	int n_elements_per_block = dofs*dofs;
+	// Each node couples with itself and its neighbours inside the grid
+	bsr_init(matrix, n_nodes*dofs, n_nodes*dofs, dofs, n_nodes + 2*((nx - 1)*ny + nx*(ny - 1)));
+	matrix->block_row_offsets[0] = 0;
+	for (int node = 0; node < n_nodes; ++node){
+		int i = node%nx, j = node/nx;
+		int count = 1 + (i > 0) + (i < nx - 1) + (j > 0) + (j < ny - 1);
+		matrix->block_row_offsets[node+1] = matrix->block_row_offsets[node] + count;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (int node = 0; node < n_nodes; ++node){
+		int i = node%nx, j = node/nx;
+		// Sorted block columns: below, left, itself, right, above
+		int neighbours[5] = {(j > 0) ? node - nx : -1, (i > 0) ? node - 1 : -1, node, (i < nx - 1) ? node + 1 : -1, (j < ny - 1) ? node + nx : -1};
+		unsigned int b = matrix->block_row_offsets[node];
+		for (int e = 0; e < 5; ++e){
+			if (neighbours[e] < 0) continue;
+			double factor = (neighbours[e] == node) ? -4.0*stencil->scale : stencil->scale;
+			matrix->block_columns[b] = neighbours[e];
+			for (int k = 0; k < n_elements_per_block; ++k) matrix->values[(long)b*n_elements_per_block + k] = factor*stencil->K[k];
+			++b;
+		}
+	}
+}
+
+
+/*============== Checkpoints ===================*/
+// Writes u to <prefix>_<step>.bin
+int explicit_checkpoint_write(const char *prefix, int step, double time, int n, double *u){
+	char filename[512];
+	snprintf(filename, sizeof(filename), "%s_%06d.bin", prefix, step);
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL){
+		printf("!!! Error while creating %s.\n", filename);
+		return -1;
+	}
+	explicit_checkpoint header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, EXPLICIT_CHECKPOINT_MAGIC);
+	header.step = step;
+	header.n = n;
+	header.time = time;
+	int status = (fwrite(&header, sizeof(header), 1, file) == 1) && (fwrite(u, sizeof(double), n, file) == (size_t)n);
+	status &= (fclose(file) == 0);
+	if (!status){
+		printf("!!! Error while writing %s.\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+// Reads back a checkpoint of n values, to restart from it
+int explicit_checkpoint_read(const char *filename, int *step, double *time, int n, double *u){
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL){
+		printf("!!! Error while opening %s.\n", filename);
+		return -1;
+	}
+	explicit_checkpoint header;
+	int status = (fread(&header, sizeof(header), 1, file) == 1) && (memcmp(header.magic, EXPLICIT_CHECKPOINT_MAGIC, sizeof(header.magic)) == 0) && (header.n == n);
+	status = status && (fread(u, sizeof(double), n, file) == (size_t)n);
+	fclose(file);
+	if (!status){
+		printf("!!! %s is not a checkpoint of %d values.\n", filename, n);
+		return -1;
+	}
+	*step = header.step;
+	*time = header.time;
+	return 0;
+}
+
+
+/*============== Time stepping ===================*/
+// Advances u (the initial state, then the final one) by nsteps steps of dt. The steps are
+// numbered from first_step + 1 (first_step is 0, or the step of the checkpoint u comes from).
+// With checkpoint_every > 0, u is written every checkpoint_every steps.
+int explicit_run(explicit_operator *op, double *u, double dt, int first_step, int nsteps, int method, int checkpoint_every, const char *checkpoint_prefix, explicit_stats *stats){
+	int n = op->n;
+	double *buffers[2] = {u, malloc(sizeof(double) * n)};
+	double *stage = (method == EXPLICIT_RK2) ? malloc(sizeof(double) * n) : NULL;
+	int current = 0, status = 0;
+	stats->steps = 0;
+	stats->checkpoints = 0;
+	stats->checkpoint_time = 0;
+	double begin = omp_get_wtime();
+
+	for (int step = 1; step <= nsteps; ++step){
+		double *u_now = buffers[current], *u_next = buffers[1 - current];
+		if (method == EXPLICIT_EULER) op->apply(op->data, u_now, u_now, u_next, dt, 1.0);
+		else{
+			op->apply(op->data, u_now, u_now, stage, 0.5*dt, 1.0);
+			op->apply(op->data, stage, u_now, u_next, dt, 1.0);
+		}
+		current = 1 - current;
+		stats->steps = step;
+
+		if ((checkpoint_every > 0) && ((first_step + step)%checkpoint_every == 0)){
+			double start = omp_get_wtime();
+			if (explicit_checkpoint_write(checkpoint_prefix, first_step + step, (first_step + step)*dt, n, buffers[current]) != 0){
+				status = -1;
+				break;
+			}
+			++stats->checkpoints;
+			stats->checkpoint_time += omp_get_wtime() - start;
+		}
+	}
+
+	stats->time = omp_get_wtime() - begin - stats->checkpoint_time;
+	stats->time_per_step = (stats->steps > 0) ? stats->time/stats->steps : 0;
+	if (current == 1) memcpy(u, buffers[1], sizeof(double) * n);
+	free(buffers[1]);
+	free(stage);
+	return status;
+}
+
+#endif
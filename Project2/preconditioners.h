@@ -0,0 +1,435 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef PRECONDITIONERS_H
+#define PRECONDITIONERS_H
+
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "CSR_BSR.h"
+#include "solvers.h"
+
+/*=====================================================================================
+* Preconditioners built on the blocks of a bsr_matrix, to be given to the solvers as
+*	preconditioner M = {block_jacobi_apply, &jacobi};
+* - Block-Jacobi: each diagonal block is inverted once, applying it is one small dense
+*   product per block row.
+* - Block ILU(0): incomplete LU with the sparsity of A, blocks of U on the diagonal kept
+*   inverted. The block rows are grouped in levels: a row only depends on rows of lower
+*   levels, so the rows of a level are factorized and solved in parallel. L and U are
+*   then stored in the order of their levels, a solve reads them contiguously.
+* The block columns of each block row must be sorted (bsr_assembly and natural_to_bsr do so).
+=====================================================================================*/
+
+// Structures
+typedef struct block_jacobi block_jacobi;
+struct block_jacobi{
+	int n_block_rows;
+	int block_size;
+	double *inverses; // Inverse of each diagonal block, row-major
+};
+
+// One triangle of the factorization, its block rows stored in the order of their levels
+// so that a solve reads the blocks contiguously
+typedef struct block_triangle block_triangle;
+struct block_triangle{
+	int nlevels;
+	int *level_offsets; // Positions of level l: level_offsets[l] to level_offsets[l+1] - 1
+	int *rows; // Block row at each position
+	unsigned int *block_offsets; // Blocks at position p: block_offsets[p] to block_offsets[p+1] - 1
+	unsigned int *block_columns;
+	double *blocks;
+	double *diagonal_inverses; // U only: inverse of the diagonal block at each position
+};
+
+typedef struct block_ilu block_ilu;
+struct block_ilu{
+	int n_block_rows;
+	int block_size;
+	block_triangle lower; // Blocks of L below the diagonal (unit diagonal, not stored), levels go up
+	block_triangle upper; // Blocks of U above the diagonal, levels go down
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int block_invert(int block_size, double *A, double *A_inverse);
+void block_multiply(int block_size, double *A, double *B, double *C);
+void block_multiply_sub(int block_size, double *A, double *B, double *C);
+/*==============*/
+int bsr_find_diagonal(bsr_matrix *matrix, unsigned int *diagonal);
+/*==============*/
+int block_jacobi_init(block_jacobi *jacobi, bsr_matrix *matrix);
+void block_jacobi_apply(void *data, double *r, double *z);
+void block_jacobi_free(block_jacobi *jacobi);
+/*==============*/
+int block_ilu_init(block_ilu *ilu, bsr_matrix *matrix);
+void block_ilu_apply(void *data, double *r, double *z);
+void block_ilu_free(block_ilu *ilu);
+
+
+/*=====================================================================================*/
+
+
+/*============== Dense blocks ===================*/
+// Gauss-Jordan with partial pivoting, returns -1 if the block is singular
+int block_invert(int block_size, double *A, double *A_inverse){
+	int n = block_size;
+	double work[n*n];
+	memcpy(work, A, sizeof(double) * n*n);
+	for (int i = 0; i < n*n; ++i) A_inverse[i] = (i/n == i%n) ? 1.0 : 0.0;
+
+	for (int column = 0; column < n; ++column){
+		int pivot = column;
+		for (int i = column + 1; i < n; ++i){
+			if (fabs(work[i*n + column]) > fabs(work[pivot*n + column])) pivot = i;
+		}
+		if (work[pivot*n + column] == 0) return -1;
+		if (pivot != column){
+			for (int j = 0; j < n; ++j){
+				double swap = work[column*n + j]; work[column*n + j] = work[pivot*n + j]; work[pivot*n + j] = swap;
+				swap = A_inverse[column*n + j]; A_inverse[column*n + j] = A_inverse[pivot*n + j]; A_inverse[pivot*n + j] = swap;
+			}
+		}
+		double scale = 1.0/work[column*n + column];
+		for (int j = 0; j < n; ++j){
+			work[column*n + j] *= scale;
+			A_inverse[column*n + j] *= scale;
+		}
+		for (int i = 0; i < n; ++i){
+			if (i == column) continue;
+			double factor = work[i*n + column];
+			if (factor == 0) continue;
+			for (int j = 0; j < n; ++j){
+				work[i*n + j] -= factor*work[column*n + j];
+				A_inverse[i*n + j] -= factor*A_inverse[column*n + j];
+			}
+		}
+	}
+	return 0;
+}
+
+// C = A*B
+void block_multiply(int block_size, double *A, double *B, double *C){
+	for (int i = 0; i < block_size; ++i){
+		for (int j = 0; j < block_size; ++j){
+			double sum = 0;
+			for (int k = 0; k < block_size; ++k) sum += A[i*block_size + k]*B[k*block_size + j];
+			C[i*block_size + j] = sum;
+		}
+	}
+}
+
+// C -= A*B
+void block_multiply_sub(int block_size, double *A, double *B, double *C){
+	for (int i = 0; i < block_size; ++i){
+		for (int j = 0; j < block_size; ++j){
+			double sum = 0;
+			for (int k = 0; k < block_size; ++k) sum += A[i*block_size + k]*B[k*block_size + j];
+			C[i*block_size + j] -= sum;
+		}
+	}
+}
+
+// Index of the diagonal block of each block row, -1 if one is missing
+int bsr_find_diagonal(bsr_matrix *matrix, unsigned int *diagonal){
+	if (bsr_require_plain(matrix) != 0) return -1;
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	int missing = -1;
+	#pragma omp parallel for reduction(max:missing)
+	for (int I = 0; I < n_block_rows; ++I){
+		diagonal[I] = matrix->block_row_offsets[I+1];
+		for (unsigned int b = matrix->block_row_offsets[I]; b < matrix->block_row_offsets[I+1]; ++b){
+			if (matrix->block_columns[b] == (unsigned int)I) diagonal[I] = b;
+		}
+		if (diagonal[I] == matrix->block_row_offsets[I+1]) missing = (I > missing) ? I : missing;
+	}
+	if (missing >= 0){
+		printf("!!! Missing diagonal block in block row %d.\n", missing);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*============== Block-Jacobi ===================*/
+int block_jacobi_init(block_jacobi *jacobi, bsr_matrix *matrix){
+	int block_size = matrix->block_size;
+	int n_block_rows = matrix->nrows / block_size;
+	unsigned int *diagonal = malloc(sizeof(int) * n_block_rows);
+	if (bsr_find_diagonal(matrix, diagonal) != 0){
+		free(diagonal);
+		return -1;
+	}
+	jacobi->n_block_rows = n_block_rows;
+	jacobi->block_size = block_size;
+	jacobi->inverses = malloc(sizeof(double) * (long)n_block_rows*matrix->n_elements_per_block);
+
+	int singular = -1;
+	#pragma omp parallel for reduction(max:singular)
+	for (int I = 0; I < n_block_rows; ++I){
+		long offset = (long)I*matrix->n_elements_per_block;
+		if (block_invert(block_size, &matrix->values[(long)diagonal[I]*matrix->n_elements_per_block], &jacobi->inverses[offset]) != 0){
+			singular = (I > singular) ? I : singular;
+		}
+	}
+	free(diagonal);
+	if (singular >= 0){
+		printf("!!! Singular diagonal block in block row %d.\n", singular);
+		free(jacobi->inverses);
+		return -1;
+	}
+	return 0;
+}
+
+// z = D^-1 r for one block size
+static inline __attribute__((always_inline)) void block_jacobi_solve(block_jacobi *jacobi, const int block_size, double *r, double *z){
+	#pragma omp parallel for schedule(static)
+	for (int I = 0; I < jacobi->n_block_rows; ++I){
+		double *inverse = &jacobi->inverses[(long)I*block_size*block_size];
+		for (int k = 0; k < block_size; ++k){
+			double sum = 0;
+			for (int l = 0; l < block_size; ++l) sum += inverse[k*block_size + l]*r[(long)I*block_size + l];
+			z[(long)I*block_size + k] = sum;
+		}
+	}
+}
+
+// z = D^-1 r, with the loops unrolled for the usual block sizes
+void block_jacobi_apply(void *data, double *r, double *z){
+	block_jacobi *jacobi = data;
+	switch (jacobi->block_size){
+		case 2: block_jacobi_solve(jacobi, 2, r, z); break;
+		case 3: block_jacobi_solve(jacobi, 3, r, z); break;
+		case 4: block_jacobi_solve(jacobi, 4, r, z); break;
+		case 8: block_jacobi_solve(jacobi, 8, r, z); break;
+		default: block_jacobi_solve(jacobi, jacobi->block_size, r, z);
+	}
+}
+
+void block_jacobi_free(block_jacobi *jacobi){
+	free(jacobi->inverses);
+}
+
+
+/*============== Block ILU(0) ===================*/
+// Levels of the block rows for the lower (lower = 1) or upper triangle
+static void block_triangle_levels(block_triangle *triangle, bsr_matrix *matrix, unsigned int *diagonal, int lower){
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	int *level = malloc(sizeof(int) * n_block_rows);
+	triangle->nlevels = 0;
+	for (int step = 0; step < n_block_rows; ++step){
+		int I = (lower) ? step : n_block_rows - 1 - step;
+		unsigned int first = (lower) ? matrix->block_row_offsets[I] : diagonal[I] + 1;
+		unsigned int last = (lower) ? diagonal[I] : matrix->block_row_offsets[I+1];
+		level[I] = 0;
+		for (unsigned int b = first; b < last; ++b){
+			int depends = level[matrix->block_columns[b]] + 1;
+			if (depends > level[I]) level[I] = depends;
+		}
+		if (level[I] + 1 > triangle->nlevels) triangle->nlevels = level[I] + 1;
+	}
+
+	// Counting sort of the rows on their level
+	triangle->level_offsets = calloc(triangle->nlevels + 1, sizeof(int));
+	triangle->rows = malloc(sizeof(int) * n_block_rows);
+	for (int I = 0; I < n_block_rows; ++I) ++triangle->level_offsets[level[I] + 1];
+	for (int l = 0; l < triangle->nlevels; ++l) triangle->level_offsets[l+1] += triangle->level_offsets[l];
+	int *fill = malloc(sizeof(int) * triangle->nlevels);
+	memcpy(fill, triangle->level_offsets, sizeof(int) * triangle->nlevels);
+	for (int I = 0; I < n_block_rows; ++I) triangle->rows[fill[level[I]]++] = I;
+	free(fill);
+	free(level);
+}
+
+// Copies the blocks of the triangle from the factors, in level order
+static void block_triangle_fill(block_triangle *triangle, bsr_matrix *matrix, unsigned int *diagonal, double *factors, double *diagonal_inverses, int lower){
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	int n_elements_per_block = matrix->n_elements_per_block;
+	triangle->block_offsets = malloc(sizeof(int) * (n_block_rows + 1));
+	triangle->block_offsets[0] = 0;
+	for (int p = 0; p < n_block_rows; ++p){
+		int I = triangle->rows[p];
+		unsigned int count = (lower) ? diagonal[I] - matrix->block_row_offsets[I] : matrix->block_row_offsets[I+1] - diagonal[I] - 1;
+		triangle->block_offsets[p+1] = triangle->block_offsets[p] + count;
+	}
+	unsigned int nnzb = triangle->block_offsets[n_block_rows];
+	triangle->block_columns = malloc(sizeof(int) * (nnzb > 0 ? nnzb : 1));
+	triangle->blocks = malloc(sizeof(double) * ((long)nnzb*n_elements_per_block > 0 ? (long)nnzb*n_elements_per_block : 1));
+	triangle->diagonal_inverses = (lower) ? NULL : malloc(sizeof(double) * (long)n_block_rows*n_elements_per_block);
+
+	#pragma omp parallel for schedule(static)
+	for (int p = 0; p < n_block_rows; ++p){
+		int I = triangle->rows[p];
+		unsigned int first = (lower) ? matrix->block_row_offsets[I] : diagonal[I] + 1;
+		unsigned int count = triangle->block_offsets[p+1] - triangle->block_offsets[p];
+		memcpy(&triangle->block_columns[triangle->block_offsets[p]], &matrix->block_columns[first], sizeof(int) * count);
+		memcpy(&triangle->blocks[(long)triangle->block_offsets[p]*n_elements_per_block], &factors[(long)first*n_elements_per_block], sizeof(double) * count*n_elements_per_block);
+		if (!lower) memcpy(&triangle->diagonal_inverses[(long)p*n_elements_per_block], &diagonal_inverses[(long)I*n_elements_per_block], sizeof(double) * n_elements_per_block);
+	}
+}
+
+static void block_triangle_free(block_triangle *triangle){
+	free(triangle->level_offsets);
+	free(triangle->rows);
+	free(triangle->block_offsets);
+	free(triangle->block_columns);
+	free(triangle->blocks);
+	free(triangle->diagonal_inverses);
+}
+
+// Factorizes block row I in place, once the rows it depends on are done
+static int block_ilu_row(bsr_matrix *matrix, unsigned int *diagonal, double *factors, double *diagonal_inverses, int I){
+	int block_size = matrix->block_size;
+	int n_elements_per_block = matrix->n_elements_per_block;
+	unsigned int *columns = matrix->block_columns;
+	double L[n_elements_per_block];
+
+	for (unsigned int b = matrix->block_row_offsets[I]; b < diagonal[I]; ++b){
+		// L_IK = A_IK * U_KK^-1
+		unsigned int K = columns[b];
+		block_multiply(block_size, &factors[(long)b*n_elements_per_block], &diagonal_inverses[(long)K*n_elements_per_block], L);
+		memcpy(&factors[(long)b*n_elements_per_block], L, sizeof(double) * n_elements_per_block);
+
+		// A_IJ -= L_IK * U_KJ for the J > K present in both rows, both rows being sorted
+		unsigned int c = diagonal[K] + 1;
+		for (unsigned int a = b + 1; (a < matrix->block_row_offsets[I+1]) && (c < matrix->block_row_offsets[K+1]); ){
+			if (columns[a] < columns[c]) ++a;
+			else if (columns[a] > columns[c]) ++c;
+			else{
+				block_multiply_sub(block_size, L, &factors[(long)c*n_elements_per_block], &factors[(long)a*n_elements_per_block]);
+				++a;
+				++c;
+			}
+		}
+	}
+	return block_invert(block_size, &factors[(long)diagonal[I]*n_elements_per_block], &diagonal_inverses[(long)I*n_elements_per_block]);
+}
+
+int block_ilu_init(block_ilu *ilu, bsr_matrix *matrix){
+	if (bsr_require_plain(matrix) != 0) return -1;
+	int n_block_rows = matrix->nrows / matrix->block_size;
+	for (int I = 0; I < n_block_rows; ++I){
+		for (unsigned int b = matrix->block_row_offsets[I] + 1; b < matrix->block_row_offsets[I+1]; ++b){
+			if (matrix->block_columns[b] <= matrix->block_columns[b-1]){
+				printf("!!! The block columns of block row %d are not sorted.\n", I);
+				return -1;
+			}
+		}
+	}
+	unsigned int *diagonal = malloc(sizeof(int) * n_block_rows);
+	if (bsr_find_diagonal(matrix, diagonal) != 0){
+		free(diagonal);
+		return -1;
+	}
+	ilu->n_block_rows = n_block_rows;
+	ilu->block_size = matrix->block_size;
+	long n_values = (long)matrix->nnzb*matrix->n_elements_per_block;
+	double *factors = malloc(sizeof(double) * n_values);
+	memcpy(factors, matrix->values, sizeof(double) * n_values);
+	double *diagonal_inverses = malloc(sizeof(double) * (long)n_block_rows*matrix->n_elements_per_block);
+	block_triangle_levels(&ilu->lower, matrix, diagonal, 1);
+	block_triangle_levels(&ilu->upper, matrix, diagonal, 0);
+
+	// Row I only reads the rows of L's lower levels: the factorization follows the same levels
+	int singular = -1;
+	#pragma omp parallel
+	for (int l = 0; l < ilu->lower.nlevels; ++l){
+		#pragma omp for schedule(dynamic, 16) reduction(max:singular)
+		for (int p = ilu->lower.level_offsets[l]; p < ilu->lower.level_offsets[l+1]; ++p){
+			int I = ilu->lower.rows[p];
+			if (block_ilu_row(matrix, diagonal, factors, diagonal_inverses, I) != 0) singular = (I > singular) ? I : singular;
+		}
+	}
+	if (singular >= 0){
+		printf("!!! Zero pivot block in block row %d.\n", singular);
+		free(ilu->lower.level_offsets);
+		free(ilu->lower.rows);
+		free(ilu->upper.level_offsets);
+		free(ilu->upper.rows);
+	}
+	else{
+		block_triangle_fill(&ilu->lower, matrix, diagonal, factors, diagonal_inverses, 1);
+		block_triangle_fill(&ilu->upper, matrix, diagonal, factors, diagonal_inverses, 0);
+	}
+	free(factors);
+	free(diagonal_inverses);
+	free(diagonal);
+	return (singular >= 0) ? -1 : 0;
+}
+
+// Rows of the level l of L z = r (unit diagonal), then of U z = z in place
+static inline __attribute__((always_inline)) void block_ilu_lower_level(block_triangle *L, const int block_size, int l, double *r, double *z){
+	#pragma omp for schedule(static)
+	for (int p = L->level_offsets[l]; p < L->level_offsets[l+1]; ++p){
+		long I = L->rows[p];
+		double sum[block_size];
+		for (int k = 0; k < block_size; ++k) sum[k] = r[I*block_size + k];
+		for (unsigned int b = L->block_offsets[p]; b < L->block_offsets[p+1]; ++b){
+			double *block = &L->blocks[(long)b*block_size*block_size];
+			double *x_block = &z[(long)L->block_columns[b]*block_size];
+			for (int k = 0; k < block_size; ++k){
+				for (int j = 0; j < block_size; ++j) sum[k] -= block[k*block_size + j]*x_block[j];
+			}
+		}
+		for (int k = 0; k < block_size; ++k) z[I*block_size + k] = sum[k];
+	}
+}
+
+static inline __attribute__((always_inline)) void block_ilu_upper_level(block_triangle *U, const int block_size, int l, double *z){
+	#pragma omp for schedule(static)
+	for (int p = U->level_offsets[l]; p < U->level_offsets[l+1]; ++p){
+		long I = U->rows[p];
+		double sum[block_size];
+		for (int k = 0; k < block_size; ++k) sum[k] = z[I*block_size + k];
+		for (unsigned int b = U->block_offsets[p]; b < U->block_offsets[p+1]; ++b){
+			double *block = &U->blocks[(long)b*block_size*block_size];
+			double *x_block = &z[(long)U->block_columns[b]*block_size];
+			for (int k = 0; k < block_size; ++k){
+				for (int j = 0; j < block_size; ++j) sum[k] -= block[k*block_size + j]*x_block[j];
+			}
+		}
+		double *inverse = &U->diagonal_inverses[(long)p*block_size*block_size];
+		for (int k = 0; k < block_size; ++k){
+			double value = 0;
+			for (int j = 0; j < block_size; ++j) value += inverse[k*block_size + j]*sum[j];
+			z[I*block_size + k] = value;
+		}
+	}
+}
+
+// Both solves for one block size, level after level
+static inline __attribute__((always_inline)) void block_ilu_solve(block_ilu *ilu, const int block_size, double *r, double *z){
+	#pragma omp parallel
+	{
+		for (int l = 0; l < ilu->lower.nlevels; ++l) block_ilu_lower_level(&ilu->lower, block_size, l, r, z);
+		for (int l = 0; l < ilu->upper.nlevels; ++l) block_ilu_upper_level(&ilu->upper, block_size, l, z);
+	}
+}
+
+// z = U^-1 L^-1 r, with the loops unrolled for the usual block sizes
+void block_ilu_apply(void *data, double *r, double *z){
+	block_ilu *ilu = data;
+	switch (ilu->block_size){
+		case 2: block_ilu_solve(ilu, 2, r, z); break;
+		case 3: block_ilu_solve(ilu, 3, r, z); break;
+		case 4: block_ilu_solve(ilu, 4, r, z); break;
+		case 8: block_ilu_solve(ilu, 8, r, z); break;
+		default: block_ilu_solve(ilu, ilu->block_size, r, z);
+	}
+}
+
+void block_ilu_free(block_ilu *ilu){
+	block_triangle_free(&ilu->lower);
+	block_triangle_free(&ilu->upper);
+}
+
+#endif
@@ -0,0 +1,362 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef REORDERING_H
+#define REORDERING_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "CSR_BSR.h"
+
+/*=====================================================================================
+* Symmetric reorderings of a square bsr_matrix, on the graph of its blocks (one node per
+* block row, an edge where A_IJ or A_JI is stored). Neighbouring block rows end up close
+* to each other, so that the x blocks read by a block row are close in memory too.
+* - Reverse Cuthill-McKee: breadth-first search from a pseudo-peripheral node, small
+*   bandwidth and profile.
+* - Partition ordering: recursive bisection of the graph (each half being the nodes the
+*   closest to one end of it), the parts numbered one after the other.
+* A permutation gives, for each new block row, the old one: B = P*A*P^T with
+* B_IJ = A_{permutation[I], permutation[J]}. Vectors go along with vector_permute.
+=====================================================================================*/
+
+// Structures
+// Block graph, without self-loops: neighbours of node I in neighbours[offsets[I]..offsets[I+1])
+typedef struct block_graph block_graph;
+struct block_graph{
+	int n;
+	unsigned int *offsets;
+	unsigned int *neighbours;
+};
+
+/*=====================================================================================*/
+
+// Prototypes
+int block_graph_init(block_graph *graph, bsr_matrix *matrix);
+void block_graph_free(block_graph *graph);
+/*==============*/
+int bsr_reorder_rcm(bsr_matrix *matrix, unsigned int *permutation);
+int bsr_reorder_partition(bsr_matrix *matrix, int n_parts, unsigned int *permutation);
+/*==============*/
+int bsr_permute(bsr_matrix *matrix, unsigned int *permutation, bsr_matrix *result);
+void vector_permute(int n_blocks, int block_size, unsigned int *permutation, double *x, double *y);
+void vector_unpermute(int n_blocks, int block_size, unsigned int *permutation, double *y, double *x);
+void bsr_bandwidth(bsr_matrix *matrix, long *bandwidth, long *profile);
+
+
+/*=====================================================================================*/
+
+
+/*============== Block graph ===================*/
+// Graph of the pattern of A + A^T, the neighbours of each node sorted
+int block_graph_init(block_graph *graph, bsr_matrix *matrix){
+	if (bsr_require_plain(matrix) != 0) return -1;
+	if (matrix->nrows != matrix->ncolumns){
+		printf("!!! Only square matrices can be reordered.\n");
+		return -1;
+	}
+	int n = matrix->nrows / matrix->block_size;
+	graph->n = n;
+	// Both directions of every off-diagonal block, duplicates removed afterwards
+	unsigned int *counts = calloc(n + 1, sizeof(int));
+	for (int I = 0; I < n; ++I){
+		for (unsigned int b = matrix->block_row_offsets[I]; b < matrix->block_row_offsets[I+1]; ++b){
+			unsigned int J = matrix->block_columns[b];
+			if (J == (unsigned int)I) continue;
+			++counts[I+1];
+			++counts[J+1];
+		}
+	}
+	for (int I = 0; I < n; ++I) counts[I+1] += counts[I];
+	unsigned int *edges = malloc(sizeof(int) * (counts[n] > 0 ? counts[n] : 1));
+	unsigned int *fill = malloc(sizeof(int) * n);
+	memcpy(fill, counts, sizeof(int) * n);
+	for (int I = 0; I < n; ++I){
+		for (unsigned int b = matrix->block_row_offsets[I]; b < matrix->block_row_offsets[I+1]; ++b){
+			unsigned int J = matrix->block_columns[b];
+			if (J == (unsigned int)I) continue;
+			edges[fill[I]++] = J;
+			edges[fill[J]++] = I;
+		}
+	}
+	free(fill);
+
+	graph->offsets = malloc(sizeof(int) * (n + 1));
+	graph->neighbours = edges; // Compacted in place
+	graph->offsets[0] = 0;
+	for (int I = 0; I < n; ++I){
+		unsigned int *list = &edges[counts[I]];
+		int length = counts[I+1] - counts[I];
+		// Insertion sort, the lists are short
+		for (int p = 1; p < length; ++p){
+			unsigned int value = list[p];
+			int q = p - 1;
+			while ((q >= 0) && (list[q] > value)){
+				list[q+1] = list[q];
+				--q;
+			}
+			list[q+1] = value;
+		}
+		unsigned int position = graph->offsets[I];
+		for (int p = 0; p < length; ++p){
+			if ((p > 0) && (list[p] == list[p-1])) continue;
+			edges[position++] = list[p];
+		}
+		graph->offsets[I+1] = position;
+	}
+	free(counts);
+	return 0;
+}
+
+void block_graph_free(block_graph *graph){
+	free(graph->offsets);
+	free(graph->neighbours);
+}
+
+// Breadth-first search from start over the nodes with labels[node] == label, the
+// neighbours of a node taken by increasing degree (Cuthill-McKee). levels[] must be -1 on
+// these nodes; they get their distance to start. Fills queue, returns the # of nodes reached.
+static int block_graph_bfs(block_graph *graph, int start, int label, int *labels, int *levels, unsigned int *queue){
+	int head = 0, tail = 0;
+	queue[tail++] = start;
+	levels[start] = 0;
+	while (head < tail){
+		int node = queue[head++];
+		int first = tail;
+		for (unsigned int e = graph->offsets[node]; e < graph->offsets[node+1]; ++e){
+			unsigned int other = graph->neighbours[e];
+			if ((labels[other] != label) || (levels[other] >= 0)) continue;
+			levels[other] = levels[node] + 1;
+			// Sorted into the new nodes by degree
+			unsigned int degree = graph->offsets[other+1] - graph->offsets[other];
+			int q = tail++;
+			while ((q > first) && (graph->offsets[queue[q-1]+1] - graph->offsets[queue[q-1]] > degree)){
+				queue[q] = queue[q-1];
+				--q;
+			}
+			queue[q] = other;
+		}
+	}
+	return tail;
+}
+
+// Pseudo-peripheral node of the component of start (George & Liu): BFS again from the
+// node of smallest degree in the last level, as long as the eccentricity grows.
+// Leaves levels[] at -1 on the component.
+static int block_graph_peripheral(block_graph *graph, int start, int label, int *labels, int *levels, unsigned int *queue){
+	int eccentricity = -1;
+	while (1){
+		int count = block_graph_bfs(graph, start, label, labels, levels, queue);
+		int last_level = levels[queue[count-1]];
+		int candidate = queue[count-1];
+		for (int p = count - 1; (p >= 0) && (levels[queue[p]] == last_level); --p){
+			unsigned int degree = graph->offsets[queue[p]+1] - graph->offsets[queue[p]];
+			if (degree <= graph->offsets[candidate+1] - graph->offsets[candidate]) candidate = queue[p];
+		}
+		for (int p = 0; p < count; ++p) levels[queue[p]] = -1;
+		if (last_level <= eccentricity) return start;
+		eccentricity = last_level;
+		start = candidate;
+	}
+}
+
+// Cuthill-McKee order of the nodes labelled label among nodes[0..count), written back into
+// nodes (one component after the other). levels[] is -1 on these nodes before and after.
+static void block_graph_cuthill_mckee(block_graph *graph, unsigned int *nodes, int count, int label, int *labels, int *levels, unsigned int *queue){
+	int done = 0;
+	unsigned int *order = malloc(sizeof(int) * (count > 0 ? count : 1));
+	for (int p = 0; p < count; ++p){
+		int node = nodes[p];
+		if (levels[node] >= 0) continue; // Already in a component
+		int start = block_graph_peripheral(graph, node, label, labels, levels, queue);
+		int reached = block_graph_bfs(graph, start, label, labels, levels, queue);
+		memcpy(&order[done], queue, sizeof(int) * reached);
+		done += reached;
+	}
+	for (int p = 0; p < count; ++p) levels[order[p]] = -1;
+	memcpy(nodes, order, sizeof(int) * count);
+	free(order);
+}
+
+
+/*============== Orderings ===================*/
+// Reverse Cuthill-McKee permutation of the block rows
+int bsr_reorder_rcm(bsr_matrix *matrix, unsigned int *permutation){
+	block_graph graph;
+	if (block_graph_init(&graph, matrix) != 0) return -1;
+	int n = graph.n;
+	int *labels = calloc(n, sizeof(int));
+	int *levels = malloc(sizeof(int) * n);
+	unsigned int *queue = malloc(sizeof(int) * (n > 0 ? n : 1));
+	for (int I = 0; I < n; ++I){
+		levels[I] = -1;
+		permutation[I] = I;
+	}
+	block_graph_cuthill_mckee(&graph, permutation, n, 0, labels, levels, queue);
+	for (int I = 0; I < n/2; ++I){
+		unsigned int swap = permutation[I];
+		permutation[I] = permutation[n - 1 - I];
+		permutation[n - 1 - I] = swap;
+	}
+	free(labels);
+	free(levels);
+	free(queue);
+	block_graph_free(&graph);
+	return 0;
+}
+
+// Splits nodes[0..count) (all labelled label) into parts of nodes close to each other
+static void block_graph_bisect(block_graph *graph, unsigned int *nodes, int count, int label, int depth, int *next_label,
+                               int *labels, int *levels, unsigned int *queue){
+	// Nodes by distance from a pseudo-peripheral node: each half is a connected slice
+	block_graph_cuthill_mckee(graph, nodes, count, label, labels, levels, queue);
+	if ((depth == 0) || (count < 2)) return;
+	int half = count/2;
+	int labels_halves[2] = {(*next_label)++, (*next_label)++};
+	for (int p = 0; p < count; ++p) labels[nodes[p]] = labels_halves[p >= half];
+	block_graph_bisect(graph, nodes, half, labels_halves[0], depth - 1, next_label, labels, levels, queue);
+	block_graph_bisect(graph, nodes + half, count - half, labels_halves[1], depth - 1, next_label, labels, levels, queue);
+}
+
+// Partition ordering: n_parts (rounded up to a power of 2) parts from recursive bisection,
+// numbered one after the other, each one in Cuthill-McKee order
+int bsr_reorder_partition(bsr_matrix *matrix, int n_parts, unsigned int *permutation){
+	block_graph graph;
+	if (block_graph_init(&graph, matrix) != 0) return -1;
+	int n = graph.n;
+	int depth = 0;
+	while ((1 << depth) < n_parts) ++depth;
+	int *labels = calloc(n, sizeof(int));
+	int *levels = malloc(sizeof(int) * n);
+	unsigned int *queue = malloc(sizeof(int) * (n > 0 ? n : 1));
+	for (int I = 0; I < n; ++I){
+		levels[I] = -1;
+		permutation[I] = I;
+	}
+	int next_label = 1;
+	block_graph_bisect(&graph, permutation, n, 0, depth, &next_label, labels, levels, queue);
+	free(labels);
+	free(levels);
+	free(queue);
+	block_graph_free(&graph);
+	return 0;
+}
+
+
+/*============== Applying a permutation ===================*/
+// Block column and position of a block, to sort the permuted block rows
+typedef struct block_position block_position;
+struct block_position{
+	unsigned int block_column;
+	unsigned int block;
+};
+
+int block_position_compare(const void *a, const void *b){
+	const block_position *p = a, *q = b;
+	return (p->block_column > q->block_column) - (p->block_column < q->block_column);
+}
+
+// result = P*A*P^T, with its block rows sorted. result is allocated, free it with bsr_free.
+int bsr_permute(bsr_matrix *matrix, unsigned int *permutation, bsr_matrix *result){
+	if (bsr_require_plain(matrix) != 0) return -1;
+	if (matrix->nrows != matrix->ncolumns){
+		printf("!!! Only square matrices can be reordered.\n");
+		return -1;
+	}
+	int n = matrix->nrows / matrix->block_size;
+	int n_elements_per_block = matrix->n_elements_per_block;
+	unsigned int *inverse = malloc(sizeof(int) * n);
+	for (int I = 0; I < n; ++I) inverse[I] = n;
+	for (int I = 0; I < n; ++I){
+		if ((permutation[I] >= (unsigned int)n) || (inverse[permutation[I]] != (unsigned int)n)){
+			printf("!!! Not a permutation of the %d block rows.\n", n);
+			free(inverse);
+			return -1;
+		}
+		inverse[permutation[I]] = I;
+	}
+
+	bsr_init(result, matrix->nrows, matrix->ncolumns, matrix->block_size, matrix->nnzb);
+	result->block_row_offsets[0] = 0;
+	for (int I = 0; I < n; ++I){
+		unsigned int old = permutation[I];
+		result->block_row_offsets[I+1] = result->block_row_offsets[I] + matrix->block_row_offsets[old+1] - matrix->block_row_offsets[old];
+	}
+
+	#pragma omp parallel
+	{
+		int capacity = 0;
+		block_position *row = NULL;
+		#pragma omp for schedule(dynamic, 64)
+		for (int I = 0; I < n; ++I){
+			unsigned int old = permutation[I];
+			unsigned int first = matrix->block_row_offsets[old];
+			int length = matrix->block_row_offsets[old+1] - first;
+			if (length > capacity){
+				capacity = 2*length;
+				row = realloc(row, sizeof(block_position) * capacity);
+			}
+			for (int p = 0; p < length; ++p){
+				row[p].block_column = inverse[matrix->block_columns[first + p]];
+				row[p].block = first + p;
+			}
+			qsort(row, length, sizeof(block_position), block_position_compare);
+			unsigned int b = result->block_row_offsets[I];
+			for (int p = 0; p < length; ++p, ++b){
+				result->block_columns[b] = row[p].block_column;
+				memcpy(&result->values[(long)b*n_elements_per_block], &matrix->values[(long)row[p].block*n_elements_per_block], sizeof(double) * n_elements_per_block);
+			}
+		}
+		free(row);
+	}
+	free(inverse);
+	return 0;
+}
+
+// y = P*x: block I of y is block permutation[I] of x
+void vector_permute(int n_blocks, int block_size, unsigned int *permutation, double *x, double *y){
+	#pragma omp parallel for schedule(static)
+	for (int I = 0; I < n_blocks; ++I){
+		memcpy(&y[(long)I*block_size], &x[(long)permutation[I]*block_size], sizeof(double) * block_size);
+	}
+}
+
+// x = P^T*y, back to the original numbering
+void vector_unpermute(int n_blocks, int block_size, unsigned int *permutation, double *y, double *x){
+	#pragma omp parallel for schedule(static)
+	for (int I = 0; I < n_blocks; ++I){
+		memcpy(&x[(long)permutation[I]*block_size], &y[(long)I*block_size], sizeof(double) * block_size);
+	}
+}
+
+
+/*============== Statistics ===================*/
+// In blocks: bandwidth = max |I - J| over the stored blocks, profile = sum over the block
+// rows of the distance from the first stored block to the diagonal
+void bsr_bandwidth(bsr_matrix *matrix, long *bandwidth, long *profile){
+	int n = matrix->nrows / matrix->block_size;
+	long max_distance = 0, sum = 0;
+	#pragma omp parallel for schedule(static) reduction(max:max_distance) reduction(+:sum)
+	for (int I = 0; I < n; ++I){
+		long lowest = I;
+		for (unsigned int b = matrix->block_row_offsets[I]; b < matrix->block_row_offsets[I+1]; ++b){
+			long J = matrix->block_columns[b];
+			long distance = (J > I) ? J - I : I - J;
+			if (distance > max_distance) max_distance = distance;
+			if (J < lowest) lowest = J;
+		}
+		sum += I - lowest;
+	}
+	*bandwidth = max_distance;
+	*profile = sum;
+}
+
+#endif
@@ -0,0 +1,370 @@
+/*=======================================================================================
+*	This code was written by:
+*								Antonin Aumètre - antonin.aumetre@gmail.com
+*								Céline Moureau -  cemoureau@gmail.com
+*	For: High Performance Scientific course at ULiège, 2018-19
+*	Project 2
+*
+*	Under GNU General Public License 11/2018
+=======================================================================================*/
+
+#ifndef SOLVERS_H
+#define SOLVERS_H
+
+#include <omp.h>
+#include "algorithms.h"
+#include "CSR_BSR.h"
+
+/*=====================================================================================
+* Krylov solvers for A*x = b with a bsr_matrix: CG (A symmetric positive definite) and
+* BiCGSTAB (any invertible A). x holds the initial guess and gets the solution. The work
+* vectors are allocated once per solve; each iteration is made of SpMVs and of the fused
+* vector kernels of algorithms.h. Convergence is on the residual relative to ||b||.
+* Block CG solves k systems with the same A at once, see solver_block_cg.
+* Mixed-precision iterative refinement (solver_refine) runs the Krylov iterations on a
+* compressed copy of A (see bsr_compress) and corrects with residuals computed with A.
+=====================================================================================*/
+
+// Structures
+// Preconditioner: z = M^-1 r. A NULL preconditioner is the identity.
+typedef struct preconditioner preconditioner;
+struct preconditioner{
+	void (*apply)(void *data, double *r, double *z);
+	void *data;
+};
+
+// What a solve did, free the history with solver_stats_free
+typedef struct solver_stats solver_stats;
+struct solver_stats{
+	int iterations;
+	int converged;
+	double residual; // Final ||b - A*x|| / ||b||
+	double *history; // Relative residual before the 1st iteration and after each one
+	double time; // Wall time of the solve, in seconds
+	double time_per_iteration;
+};
+
+// Inner solver of solver_refine: solver_cg or solver_bicgstab
+typedef int (*solver_function)(bsr_matrix *A, double *b, double *x, double tolerance, int max_iterations, preconditioner *M, solver_stats *stats);
+
+/*=====================================================================================*/
+
+// Prototypes
+int solver_cg(bsr_matrix *A, double *b, double *x, double tolerance, int max_iterations, preconditioner *M, solver_stats *stats);
+int solver_bicgstab(bsr_matrix *A, double *b, double *x, double tolerance, int max_iterations, preconditioner *M, solver_stats *stats);
+int solver_block_cg(bsr_matrix *A, int k, double *B, double *X, double tolerance, int max_iterations, preconditioner *M, solver_stats *stats);
+int solver_refine(bsr_matrix *A, bsr_matrix *A_low, solver_function inner, double *b, double *x, double tolerance, double inner_tolerance,
+                  int max_iterations, preconditioner *M, solver_stats *stats);
+/*==============*/
+void solver_stats_print(solver_stats *stats, const char *name);
+void solver_stats_free(solver_stats *stats);
+
+
+/*=====================================================================================*/
+
+
+/*============== Helpers ===================*/
+// r = b - A*x, returns ||b|| (1 if b = 0, so that the residual stays absolute)
+static double solver_residual(bsr_matrix *A, double *b, double *x, double *r){
+	int n = A->nrows;
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < n; ++i) r[i] = b[i];
+	bsr_spmv(A, x, r, -1.0, 1.0);
+	double b_norm = sqrt(vector_dot(n, b, b));
+	return (b_norm > 0) ? b_norm : 1.0;
+}
+
+// Cholesky factorization G = L*L^T of a k x k matrix, in place (L in the lower triangle).
+// Returns -1 if G is not positive definite, i.e. its vectors are linearly dependent.
+static int solver_small_cholesky(int k, double *G){
+	for (int j = 0; j < k; ++j){
+		double diagonal = G[j*k + j];
+		for (int l = 0; l < j; ++l) diagonal -= G[j*k + l]*G[j*k + l];
+		if (diagonal <= 0) return -1;
+		G[j*k + j] = sqrt(diagonal);
+		for (int i = j + 1; i < k; ++i){
+			double sum = G[i*k + j];
+			for (int l = 0; l < j; ++l) sum -= G[i*k + l]*G[j*k + l];
+			G[i*k + j] = sum/G[j*k + j];
+		}
+	}
+	return 0;
+}
+
+// C = G^-1 C with G = L*L^T factored by solver_small_cholesky, C is k x k
+static void solver_small_cholesky_solve(int k, double *L, double *C){
+	for (int j = 0; j < k; ++j){
+		for (int i = 0; i < k; ++i){
+			double sum = C[i*k + j];
+			for (int l = 0; l < i; ++l) sum -= L[i*k + l]*C[l*k + j];
+			C[i*k + j] = sum/L[i*k + i];
+		}
+		for (int i = k - 1; i >= 0; --i){
+			double sum = C[i*k + j];
+			for (int l = i + 1; l < k; ++l) sum -= L[l*k + i]*C[l*k + j];
+			C[i*k + j] = sum/L[i*k + i];
+		}
+	}
+}
+
+// Z = M^-1 R for the k columns of a multi-vector, through the single-vector preconditioner
+static void solver_block_precondition(preconditioner *M, int n, int k, double *R, double *Z, double *r, double *z){
+	for (int j = 0; j < k; ++j){
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < n; ++i) r[i] = R[(long)i*k + j];
+		M->apply(M->data, r, z);
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < n; ++i) Z[(long)i*k + j] = z[i];
+	}
+}
+
+static void solver_stats_init(solver_stats *stats, int max_iterations){
+	stats->iterations = 0;
+	stats->converged = 0;
+	stats->history = malloc(sizeof(double) * (max_iterations + 1));
+}
+
+static int solver_stats_end(solver_stats *stats, double tolerance, double begin, const char *name){
+	stats->time = omp_get_wtime() - begin;
+	stats->residual = stats->history[stats->iterations];
+	stats->converged = (stats->residual <= tolerance);
+	stats->time_per_iteration = (stats->iterations > 0) ? stats->time/stats->iterations : 0;
+	if (!stats->converged){
+		printf("!!! %s did not converge: relative residual %.3e after %d iterations.\n", name, stats->residual, stats->iterations);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*============== Solvers ===================*/
+// Preconditioned conjugate gradient
+int solver_cg(bsr_matrix *A, double *b, double *x, double tolerance, int max_iterations, preconditioner *M, solver_stats *stats){
+	double begin = omp_get_wtime();
+	int n = A->nrows;
+	double *r = malloc(sizeof(double) * n);
+	double *p = malloc(sizeof(double) * n);
+	double *Ap = malloc(sizeof(double) * n);
+	double *z = (M != NULL) ? malloc(sizeof(double) * n) : r;
+	solver_stats_init(stats, max_iterations);
+
+	double b_norm = solver_residual(A, b, x, r);
+	double rr = vector_dot(n, r, r);
+	stats->history[0] = sqrt(rr)/b_norm;
+	if (M != NULL) M->apply(M->data, r, z);
+	double rz = (M != NULL) ? vector_dot(n, r, z) : rr;
+	memcpy(p, z, sizeof(double) * n);
+
+	int k = 0;
+	while ((k < max_iterations) && (stats->history[k] > tolerance)){
+		bsr_spmv(A, p, Ap, 1.0, 0.0);
+		double pAp = vector_dot(n, p, Ap);
+		if (pAp <= 0) break; // A is not positive definite
+		double alpha = rz/pAp;
+		rr = vector_cg_update(n, alpha, p, Ap, x, r);
+		++k;
+		stats->history[k] = sqrt(rr)/b_norm;
+
+		if (M != NULL) M->apply(M->data, r, z);
+		double rz_new = (M != NULL) ? vector_dot(n, r, z) : rr;
+		vector_xpby(n, z, rz_new/rz, p);
+		rz = rz_new;
+	}
+	stats->iterations = k;
+
+	free(r);
+	free(p);
+	free(Ap);
+	if (M != NULL) free(z);
+	return solver_stats_end(stats, tolerance, begin, "CG");
+}
+
+// Preconditioned (on the right) BiCGSTAB
+int solver_bicgstab(bsr_matrix *A, double *b, double *x, double tolerance, int max_iterations, preconditioner *M, solver_stats *stats){
+	double begin = omp_get_wtime();
+	int n = A->nrows;
+	double *r = malloc(sizeof(double) * n);
+	double *r0 = malloc(sizeof(double) * n); // Shadow residual
+	double *p = malloc(sizeof(double) * n);
+	double *v = malloc(sizeof(double) * n);
+	double *s = malloc(sizeof(double) * n);
+	double *t = malloc(sizeof(double) * n);
+	double *p_hat = (M != NULL) ? malloc(sizeof(double) * n) : p;
+	double *s_hat = (M != NULL) ? malloc(sizeof(double) * n) : s;
+	solver_stats_init(stats, max_iterations);
+
+	double b_norm = solver_residual(A, b, x, r);
+	double rr = vector_dot(n, r, r);
+	stats->history[0] = sqrt(rr)/b_norm;
+	memcpy(r0, r, sizeof(double) * n);
+	memcpy(p, r, sizeof(double) * n);
+	double rho = rr;
+
+	int k = 0;
+	while ((k < max_iterations) && (stats->history[k] > tolerance)){
+		if (M != NULL) M->apply(M->data, p, p_hat);
+		bsr_spmv(A, p_hat, v, 1.0, 0.0);
+		double r0v = vector_dot(n, r0, v);
+		if (r0v == 0) break; // Breakdown
+		double alpha = rho/r0v;
+		double ss = vector_waxpy_dot(n, -alpha, v, r, s);
+		if (sqrt(ss)/b_norm <= tolerance){
+			// Half a step is enough
+			vector_axpy(n, alpha, p_hat, x);
+			++k;
+			stats->history[k] = sqrt(ss)/b_norm;
+			break;
+		}
+
+		if (M != NULL) M->apply(M->data, s, s_hat);
+		bsr_spmv(A, s_hat, t, 1.0, 0.0);
+		double ts, tt;
+		vector_dot2(n, t, s, &ts, &tt);
+		double omega = ts/tt;
+		double r0r;
+		vector_bicg_update(n, alpha, p_hat, omega, s_hat, s, t, x, r, r0, &rr, &r0r);
+		++k;
+		stats->history[k] = sqrt(rr)/b_norm;
+		if ((omega == 0) || (r0r == 0)) break; // Breakdown
+
+		vector_bicg_direction(n, r, (r0r/rho)*(alpha/omega), omega, v, p);
+		rho = r0r;
+	}
+	stats->iterations = k;
+
+	free(r);
+	free(r0);
+	free(p);
+	free(v);
+	free(s);
+	free(t);
+	if (M != NULL){
+		free(p_hat);
+		free(s_hat);
+	}
+	return solver_stats_end(stats, tolerance, begin, "BiCGSTAB");
+}
+
+// Preconditioned block CG for A*X = B, with k right-hand sides stored row-major
+// (B[i*k + j] is the entry i of the right-hand side j). The k search directions share each
+// iteration: one SpMM (A is read once for the k vectors) and k x k products. The step and
+// the new directions are both taken from P^T*A*P, by a Cholesky factorization:
+//	alpha = (P^T A P)^-1 P^T R,  P = Z - P (P^T A P)^-1 (A P)^T Z
+// which stays well conditioned when some columns converge before the others, unlike the
+// (R^T Z)^-1 of the textbook recurrence. The history is the largest relative residual of
+// the k columns. A preconditioner is applied column by column.
+int solver_block_cg(bsr_matrix *A, int k, double *B, double *X, double tolerance, int max_iterations, preconditioner *M, solver_stats *stats){
+	double begin = omp_get_wtime();
+	int n = A->nrows;
+	long size = (long)n*k;
+	double *R = malloc(sizeof(double) * size);
+	double *P = malloc(sizeof(double) * size);
+	double *Q = malloc(sizeof(double) * size);
+	double *Z = (M != NULL) ? malloc(sizeof(double) * size) : R;
+	double *r = (M != NULL) ? malloc(sizeof(double) * n) : NULL; // One column of R and of Z
+	double *z = (M != NULL) ? malloc(sizeof(double) * n) : NULL;
+	double *G = malloc(sizeof(double) * k*k), *C = malloc(sizeof(double) * k*k);
+	double *b_norms = malloc(sizeof(double) * k), *rr = malloc(sizeof(double) * k);
+	solver_stats_init(stats, max_iterations);
+
+	// R = B - A*X, column norms of B
+	memcpy(R, B, sizeof(double) * size);
+	bsr_spmm(A, k, X, R, -1.0, 1.0);
+	multivector_gram(n, k, B, B, G);
+	for (int j = 0; j < k; ++j) b_norms[j] = (G[j*k + j] > 0) ? sqrt(G[j*k + j]) : 1.0;
+	multivector_gram(n, k, R, R, G);
+	stats->history[0] = 0;
+	for (int j = 0; j < k; ++j) stats->history[0] = fmax(stats->history[0], sqrt(G[j*k + j])/b_norms[j]);
+	if (M != NULL) solver_block_precondition(M, n, k, R, Z, r, z);
+	memcpy(P, Z, sizeof(double) * size);
+
+	int iteration = 0;
+	while ((iteration < max_iterations) && (stats->history[iteration] > tolerance)){
+		// alpha = (P^T A P)^-1 P^T R, X += P*alpha, R -= A*P*alpha
+		bsr_spmm(A, k, P, Q, 1.0, 0.0);
+		multivector_gram2(n, k, P, Q, R, G, C);
+		if (solver_small_cholesky(k, G) != 0) break; // Directions linearly dependent
+		solver_small_cholesky_solve(k, G, C);
+		multivector_cg_update(n, k, C, P, Q, X, R, rr);
+		++iteration;
+		stats->history[iteration] = 0;
+		for (int j = 0; j < k; ++j) stats->history[iteration] = fmax(stats->history[iteration], sqrt(rr[j])/b_norms[j]);
+		if (stats->history[iteration] <= tolerance) break;
+
+		// P = Z - P (P^T A P)^-1 (A P)^T Z, A-orthogonal to the previous directions
+		if (M != NULL) solver_block_precondition(M, n, k, R, Z, r, z);
+		multivector_gram(n, k, Q, Z, C);
+		solver_small_cholesky_solve(k, G, C);
+		for (int e = 0; e < k*k; ++e) C[e] = -C[e];
+		multivector_cg_direction(n, k, Z, C, P);
+	}
+	stats->iterations = iteration;
+
+	free(R);
+	free(P);
+	free(Q);
+	if (M != NULL){
+		free(Z);
+		free(r);
+		free(z);
+	}
+	free(G);
+	free(C);
+	free(b_norms);
+	free(rr);
+	return solver_stats_end(stats, tolerance, begin, "Block CG");
+}
+
+
+// Iterative refinement: r = b - A*x with A, then A_low*d = r is solved by the inner solver
+// down to inner_tolerance, from d = 0, and x += d. The iterations stream A_low (16-bit
+// deltas and float values: about half the bytes of A), the accuracy is the one of A as
+// long as the inner solves reduce the residual. The iterations and the history are the
+// ones of the inner solver, the history getting the true residual after each correction.
+// M is a preconditioner for A_low (built on A).
+int solver_refine(bsr_matrix *A, bsr_matrix *A_low, solver_function inner, double *b, double *x, double tolerance, double inner_tolerance,
+                  int max_iterations, preconditioner *M, solver_stats *stats){
+	double begin = omp_get_wtime();
+	int n = A->nrows;
+	double *r = malloc(sizeof(double) * n);
+	double *d = malloc(sizeof(double) * n);
+	solver_stats_init(stats, max_iterations);
+
+	double b_norm = solver_residual(A, b, x, r);
+	stats->history[0] = sqrt(vector_dot(n, r, r))/b_norm;
+	int k = 0;
+	while ((k < max_iterations) && (stats->history[k] > tolerance)){
+		memset(d, 0, sizeof(double) * n);
+		solver_stats inner_stats;
+		inner(A_low, r, d, inner_tolerance, max_iterations - k, M, &inner_stats);
+		for (int j = 1; j <= inner_stats.iterations; ++j) stats->history[k + j] = stats->history[k]*inner_stats.history[j];
+		int progress = (inner_stats.iterations > 0);
+		double previous = stats->history[k];
+		k += inner_stats.iterations;
+		solver_stats_free(&inner_stats);
+		if (!progress) break;
+
+		vector_axpy(n, 1.0, d, x);
+		solver_residual(A, b, x, r);
+		stats->history[k] = sqrt(vector_dot(n, r, r))/b_norm;
+		if (stats->history[k] >= previous) break; // A_low is too far from A
+	}
+	stats->iterations = k;
+
+	free(r);
+	free(d);
+	return solver_stats_end(stats, tolerance, begin, "Iterative refinement");
+}
+
+
+/*============== Statistics ===================*/
+void solver_stats_print(solver_stats *stats, const char *name){
+	printf("%s: %d iterations, relative residual %.3e, %.4f s (%.4f ms per iteration)%s\n", name, stats->iterations, stats->residual,
+		stats->time, 1e3*stats->time_per_iteration, (stats->converged) ? "" : ", NOT converged");
+}
+
+void solver_stats_free(solver_stats *stats){
+	free(stats->history);
+}
+
+#endif